@@ -0,0 +1,146 @@
+#include "plugin.h"
+#include "cadence.h"
+#include "stats.h"
+
+#define CADENCE_SAMPLES		16		// poll times kept
+#define CADENCE_SPANS		8		// spans that have to agree
+#define CADENCE_MAX_POLLS	4		// most polls per period looked for
+#define CADENCE_MIN_PERIOD	4000	// us, anything quicker is a game polling in a loop
+#define CADENCE_MAX_PERIOD	100000
+
+typedef struct
+{
+	int64_t times[CADENCE_SAMPLES];	// us, ring of the last polls
+	int count;
+	int head;			// where the next poll goes
+	int logged;			// polls per period last logged, so only changes are
+	volatile int64_t next;		// us, predicted next poll, 0 if not learned
+	volatile int32_t period;	// us
+	volatile int32_t polls;
+	volatile int32_t jitter;	// us
+} SCadence;
+
+static SCadence l_Cadence[4];
+
+/* Time of the poll back polls ago, 0 is the newest */
+static int64_t CadenceTime(SCadence *c, int back)
+{
+	return c->times[(c->head - 1 - back + 2 * CADENCE_SAMPLES) % CADENCE_SAMPLES];
+}
+
+/* See if the last polls repeat every polls polls, fills in the period and
+   how far the spans are off it. The shortest and the longest span are left
+   out, a single late poll (a lag frame) makes one of each. */
+static int CadenceFit(SCadence *c, int polls, int *period, int *jitter)
+{
+	int64_t spans[CADENCE_SPANS];
+
+	if (c->count < CADENCE_SPANS + polls)
+		return 0;
+
+	for (int i = 0; i < CADENCE_SPANS; i++)
+	{
+		int64_t span = CadenceTime(c, i) - CadenceTime(c, i + polls);
+		int j = i;
+		for (; j > 0 && spans[j - 1] > span; j--)
+			spans[j] = spans[j - 1];
+		spans[j] = span;
+	}
+
+	int64_t median = spans[CADENCE_SPANS / 2];
+	if (median < CADENCE_MIN_PERIOD || median > CADENCE_MAX_PERIOD)
+		return 0;
+
+	int64_t spread = median - spans[1];
+	if (spans[CADENCE_SPANS - 2] - median > spread)
+		spread = spans[CADENCE_SPANS - 2] - median;
+	if (spread > CADENCE_JITTER)
+		return 0;
+
+	*period = (int) median;
+	*jitter = (int) spread;
+	return 1;
+}
+
+void CadenceReset(int index)
+{
+	SCadence *c = &l_Cadence[index];
+
+	c->count = 0;
+	c->head = 0;
+	c->logged = 0;
+	atomicStore64(&c->next, 0);
+	atomicStore32(&c->period, 0);
+	atomicStore32(&c->polls, 0);
+	atomicStore32(&c->jitter, 0);
+}
+
+void CadenceRecord(int index, int64_t now)
+{
+	SCadence *c = &l_Cadence[index];
+
+	int64_t predicted = CadenceNext(index, now);
+	if (predicted)
+		StatsPollOffset(index, now - predicted);
+
+	c->times[c->head] = now;
+	c->head = (c->head + 1) % CADENCE_SAMPLES;
+	if (c->count < CADENCE_SAMPLES)
+		c->count++;
+
+	// the fewest polls that make a period, twice a frame doesn't repeat every poll
+	int period = 0, jitter = 0, polls;
+	for (polls = 1; polls <= CADENCE_MAX_POLLS; polls++)
+		if (CadenceFit(c, polls, &period, &jitter))
+			break;
+
+	if (polls > CADENCE_MAX_POLLS)
+	{
+		atomicStore64(&c->next, 0);
+		atomicStore32(&c->period, 0);
+		return;
+	}
+
+	// the poll one period before the next one
+	atomicStore32(&c->period, period);
+	atomicStore32(&c->polls, polls);
+	atomicStore32(&c->jitter, jitter);
+	atomicStore64(&c->next, CadenceTime(c, polls - 1) + period);
+
+	if (polls != c->logged)
+	{
+		DebugMessage(M64MSG_INFO, "Controller %i is polled %i time%s every %i us", index + 1, polls, polls > 1 ? "s" : "", period);
+		c->logged = polls;
+	}
+}
+
+int64_t CadenceNext(int index, int64_t now)
+{
+	SCadence *c = &l_Cadence[index];
+	int64_t next = atomicLoad64(&c->next);
+	int64_t period = atomicLoad32(&c->period);
+
+	if (!next || !period)
+		return 0;
+
+	// the game skipped polls (loading, lag frames), the slots go on
+	if (now > next + period / 2)
+		next += (now - next + period / 2) / period * period;
+
+	return next;
+}
+
+int CadencePeriod(int index)
+{
+	return atomicLoad32(&l_Cadence[index].period);
+}
+
+int CadencePolls(int index)
+{
+	return atomicLoad32(&l_Cadence[index].polls);
+}
+
+int CadenceJitter(int index)
+{
+	return atomicLoad32(&l_Cadence[index].jitter);
+}
@@ -0,0 +1,35 @@
+#ifndef __CADENCE_H__
+#define __CADENCE_H__
+
+#include <stdint.h>
+
+/* Poll cadence of the running game.
+ *
+ * Games read the controllers at a fixed point of every VI: once per frame
+ * at 60 Hz (NTSC) or 50 Hz (PAL), some twice per frame. The times of the
+ * last state polls of each controller are kept, and the smallest number of
+ * polls whose spans agree to within CADENCE_JITTER gives the period and the
+ * polls per period, which predicts when the next poll comes. With
+ * PrefetchAlign the I/O thread uses it to send the state poll so the reply
+ * lands just before the game asks for it. Recorded on the emulator thread,
+ * the prediction is read from the I/O thread. */
+
+#define CADENCE_JITTER		1000	// us, most a span may be off the period and still count as regular
+
+/* Forget what was learned, on a new ROM */
+extern void CadenceReset(int index);
+
+/* A state poll came from the game at now (us) */
+extern void CadenceRecord(int index, int64_t now);
+
+/* Time of the next poll expected at or after now (us), 0 while the game
+ * doesn't poll regularly. Polls the game skips are extrapolated over. */
+extern int64_t CadenceNext(int index, int64_t now);
+
+/* What was learned: period in us (0 if nothing), polls in it and the most
+ * a span was off */
+extern int CadencePeriod(int index);
+extern int CadencePolls(int index);
+extern int CadenceJitter(int index);
+
+#endif // __CADENCE_H__
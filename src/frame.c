@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include "frame.h"
+#include "joybus.h"
+#include "timer.h"
+
+#define FRAME_PROBE_TIMEOUT	50000	// us
+
+/* 03 00 FE 'N' 'F': a 3 byte command without reply for legacy firmware */
+static const unsigned char l_FrameProbe[] = { 0x03, 0x00, 0xFE, 'N', 'F' };
+
+unsigned char FrameCrc(const unsigned char *data, int len)
+{
+	unsigned char crc = 0;
+
+	for (int i = 0; i < len; i++)
+	{
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80) ? (unsigned char) ((crc << 1) ^ 0x07) : (unsigned char) (crc << 1);
+	}
+
+	return crc;
+}
+
+int FrameEncode(unsigned char *out, unsigned char seq, unsigned char channel, const unsigned char *cmd)
+{
+	const int len = 2 + JOYBUS_TX_LEN(cmd);
+
+	out[0] = FRAME_SYNC;
+	out[1] = seq;
+	out[2] = channel;
+	out[3] = (unsigned char) len;
+	memcpy(out + FRAME_HEADER, cmd, len);
+	out[FRAME_HEADER + len] = FrameCrc(out + 1, FRAME_HEADER - 1 + len);
+
+	return FRAME_SIZE(len);
+}
+
+static void FrameConsume(SFrameParser *parser, int count)
+{
+	parser->len -= count;
+	memmove(parser->buf, parser->buf + count, parser->len);
+}
+
+/* Make sure the parser holds at least need bytes.
+ * Returns 1 if it does, 0 on timeout, -1 on a port error. */
+static int FrameFill(STransport *transport, SFrameParser *parser, int need, int64_t deadline)
+{
+	if (parser->len >= need)
+		return 1;
+
+	int64_t left = deadline - timerMicros();
+	int res = TransportRead(transport, parser->buf + parser->len, need - parser->len, left > 0 ? (int) left : 0);
+	if (res < 0)
+		return -1;
+
+	parser->len += res;
+	return parser->len >= need;
+}
+
+int FrameRead(STransport *transport, SFrameParser *parser, SFrame *frame, int64_t deadline)
+{
+	for (;;)
+	{
+		// hunt for the start of a frame
+		int skip = 0;
+		while (skip < parser->len && parser->buf[skip] != FRAME_SYNC)
+			skip++;
+		if (skip)
+		{
+			FrameConsume(parser, skip);
+			parser->resyncs++;
+		}
+
+		int res = FrameFill(transport, parser, FRAME_HEADER, deadline);
+		if (res <= 0)
+			return res;
+		if (parser->buf[0] != FRAME_SYNC)
+			continue;
+
+		const int len = parser->buf[3];
+		if (len > FRAME_MAX)
+		{
+			FrameConsume(parser, 1);
+			parser->resyncs++;
+			continue;
+		}
+
+		res = FrameFill(transport, parser, FRAME_SIZE(len), deadline);
+		if (res <= 0)
+			return res;
+
+		if (parser->buf[FRAME_HEADER + len] != FrameCrc(parser->buf + 1, FRAME_HEADER - 1 + len))
+		{
+			// a sync byte in the middle of something else, or a damaged frame
+			FrameConsume(parser, 1);
+			parser->resyncs++;
+			continue;
+		}
+
+		frame->seq = parser->buf[1];
+		frame->channel = parser->buf[2];
+		frame->len = len;
+		memcpy(frame->payload, parser->buf + FRAME_HEADER, len);
+		FrameConsume(parser, FRAME_SIZE(len));
+		return 1;
+	}
+}
+
+void FramePush(SFrameQueue *queue, const SFrame *frame)
+{
+	if (queue->count == FRAME_QUEUE)
+	{
+		queue->head = (queue->head + 1) % FRAME_QUEUE;
+		queue->count--;
+	}
+
+	queue->frames[(queue->head + queue->count) % FRAME_QUEUE] = *frame;
+	queue->count++;
+}
+
+void FramePushFront(SFrameQueue *queue, const SFrame *frame)
+{
+	if (queue->count == FRAME_QUEUE)
+		queue->count--;
+
+	queue->head = (queue->head + FRAME_QUEUE - 1) % FRAME_QUEUE;
+	queue->frames[queue->head] = *frame;
+	queue->count++;
+}
+
+int FramePop(SFrameQueue *queue, SFrame *frame)
+{
+	if (!queue->count)
+		return 0;
+
+	*frame = queue->frames[queue->head];
+	queue->head = (queue->head + 1) % FRAME_QUEUE;
+	queue->count--;
+	return 1;
+}
+
+int FrameProbe(STransport *transport)
+{
+	SFrameParser parser;
+	SFrame frame;
+	int version = 0;
+
+	memset(&parser, 0, sizeof(parser));
+	TransportFlush(transport);
+	TransportWrite(transport, l_FrameProbe, sizeof(l_FrameProbe));
+
+	// hello: 'N' 'F' version
+	int64_t deadline = timerMicros() + FRAME_PROBE_TIMEOUT;
+	while (FrameRead(transport, &parser, &frame, deadline) > 0)
+	{
+		if (frame.len >= 3 && frame.payload[0] == 'N' && frame.payload[1] == 'F')
+		{
+			version = frame.payload[2];
+			break;
+		}
+	}
+
+	TransportFlush(transport);
+	return version;
+}
@@ -0,0 +1,86 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stdint.h>
+
+#include "transport.h"
+
+/* Framed wire protocol.
+ *
+ * The legacy protocol writes the raw PIF channel block and expects exactly
+ * rx_len bytes back, so only one command can be on the wire and a single
+ * lost or extra byte desynchronizes the link for good. Framed firmware
+ * wraps both directions in
+ *
+ *   A5 seq channel len payload[len] crc
+ *
+ * where crc is a CRC-8 (polynomial 0x07) over seq, channel, len and the
+ * payload. A request carries the legacy bytes (cmd[0], cmd[1], tx bytes),
+ * the reply carries whatever the controller answered, fewer than rx_len
+ * bytes meaning no response. Replies echo the sequence number of their
+ * request, so several requests can be in flight and a reply that arrives
+ * too late is recognized and dropped. A damaged frame is skipped by
+ * hunting for the next sync byte.
+ *
+ * The channel byte selects the N64 port on adapters that carry several
+ * controllers over one serial device, it is 0 on single port adapters. */
+
+#define FRAME_SYNC		0xA5
+#define FRAME_HEADER	4		// sync, seq, channel, len
+#define FRAME_MAX		72		// max payload, fits the largest channel block
+#define FRAME_SIZE(len)	(FRAME_HEADER + (len) + 1)
+
+/* Requests sent back to back before waiting for the first reply */
+#define FRAME_PIPELINE	8
+
+typedef struct
+{
+	unsigned char seq;
+	unsigned char channel;
+	int len;
+	unsigned char payload[FRAME_MAX];
+} SFrame;
+
+/* Receive state of a link: bytes read but not yet consumed */
+typedef struct
+{
+	unsigned char buf[2 * FRAME_SIZE(FRAME_MAX)];
+	int len;
+	int resyncs;		// damaged or misaligned frames skipped
+} SFrameParser;
+
+/* Frames read off a link that somebody else has to pick up */
+#define FRAME_QUEUE		8
+
+typedef struct
+{
+	SFrame frames[FRAME_QUEUE];
+	int head;
+	int count;
+} SFrameQueue;
+
+extern unsigned char FrameCrc(const unsigned char *data, int len);
+
+/* Wrap a PIF channel block in a request frame, returns the frame size */
+extern int FrameEncode(unsigned char *out, unsigned char seq, unsigned char channel, const unsigned char *cmd);
+
+/* Read the next intact frame before deadline (timerMicros time). Partial
+ * frames are kept in the parser for the next call.
+ * Returns 1 if frame was filled in, 0 on timeout, -1 on a port error. */
+extern int FrameRead(STransport *transport, SFrameParser *parser, SFrame *frame, int64_t deadline);
+
+/* Queue a frame at the back, dropping the oldest one if the queue is full,
+ * or at the front to hand it back to the next FramePop */
+extern void FramePush(SFrameQueue *queue, const SFrame *frame);
+extern void FramePushFront(SFrameQueue *queue, const SFrame *frame);
+
+/* Take the oldest frame off a queue, returns 0 if it is empty */
+extern int FramePop(SFrameQueue *queue, SFrame *frame);
+
+/* Find out whether the device speaks the framed protocol. Sends a command
+ * that legacy firmware forwards without expecting a reply, framed firmware
+ * answers it with a hello frame.
+ * Returns the protocol version, 0 for legacy firmware. */
+extern int FrameProbe(STransport *transport);
+
+#endif // __FRAME_H__
@@ -0,0 +1,200 @@
+#include <string.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "plugin.h"
+#include "rs232.h"
+#include "hotplug.h"
+#include "iothread.h"
+#include "transport.h"
+#include "thread.h"
+#include "timer.h"
+
+#define HOTPLUG_INTERVAL	100		// ms, also how long stopping can take
+#define HOTPLUG_RETRY		10		// intervals between reopen attempts without /dev events
+
+static thread_t l_HotplugThread;
+static volatile int32_t l_HotplugRunning = 0;
+static int l_HotplugClosed[4];		// the dead handle of the link owned by controller i is closed
+
+/* Each link is looked after by the first controller on it */
+static int HotplugOwner(int index)
+{
+	for (int i = 0; i < index; i++)
+		if (controller[i].link == controller[index].link)
+			return 0;
+	return controller[index].link != NULL;
+}
+
+static void HotplugMarkLost(SLink *link)
+{
+	if (atomicCas32(&link->lost, 0, 1))
+		DebugMessage(M64MSG_WARNING, "Lost serial device %s, waiting for it to come back", link->name);
+}
+
+/* Drop the dead handle so the kernel can give the device its old name back,
+   and everything that was in flight on it */
+static void HotplugClose(SLink *link)
+{
+	mutexLock(&link->lock);
+	TransportClose(&link->transport);
+	memset(&link->parser, 0, sizeof(link->parser));
+	memset(link->queue, 0, sizeof(link->queue));
+	link->tx_len = 0;
+	link->resync = 0;
+	for (int i = 0; i < 4; i++)
+		if (controller[i].link == link)
+			controller[i].pending_len = 0;
+	IoThreadResync();
+	mutexUnlock(&link->lock);
+}
+
+static int HotplugReconnect(SLink *link)
+{
+	STransport transport;
+
+	if (!TransportPresent(link->name) || !TransportOpen(&transport, link->name, link->baud))
+		return 0;
+
+	// it may be another tty now, which doesn't know it should spin
+	if (transport.port >= 0 && transport.port != link->transport.port)
+		comSetSpinLimit(transport.port, link->spin_wait);
+
+	// the I/O thread only touches the transport with the lock held, and
+	// sees the resync before it waits on whatever it gets next
+	mutexLock(&link->lock);
+	link->transport = transport;
+	atomicStore32(&link->lost, 0);
+	IoThreadResync();
+	mutexUnlock(&link->lock);
+
+	DebugMessage(M64MSG_INFO, "Serial device %s is back", link->name);
+	return 1;
+}
+
+/* Wait for the next check, returns 1 if something changed in /dev */
+static int HotplugWait(int fd)
+{
+#ifdef __linux__
+	if (fd >= 0)
+	{
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, HOTPLUG_INTERVAL) <= 0)
+			return 0;
+
+		char events[4096];
+		while (read(fd, events, sizeof(events)) > 0)
+			;
+		return 1;
+	}
+#endif
+	(void) fd;
+	timerSleepMicros(HOTPLUG_INTERVAL * 1000);
+	return 0;
+}
+
+static THREAD_FUNC(HotplugMain)
+{
+	int fd = -1;
+	int tick = 0;
+
+#ifdef __linux__
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0 && inotify_add_watch(fd, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB) < 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+#endif
+
+	while (atomicLoad32(&l_HotplugRunning))
+	{
+		int changed = HotplugWait(fd);
+		int retry = changed || ++tick % HOTPLUG_RETRY == 0;
+
+		for (int i = 0; i < 4; i++)
+		{
+			SLink *link = controller[i].link;
+
+			if (!HotplugOwner(i))
+				continue;
+
+			// unplugged while nothing was talking to it, whoever is will notice
+			if (!atomicLoad32(&link->lost) && mutexTryLock(&link->lock))
+			{
+				if (TransportLost(&link->transport) || (changed && !TransportPresent(link->name)))
+					HotplugMarkLost(link);
+				mutexUnlock(&link->lock);
+			}
+
+			if (!atomicLoad32(&link->lost))
+				continue;
+
+			if (!l_HotplugClosed[i])
+			{
+				HotplugClose(link);
+				l_HotplugClosed[i] = 1;
+			}
+
+			if (retry && HotplugReconnect(link))
+				l_HotplugClosed[i] = 0;
+		}
+	}
+
+#ifdef __linux__
+	if (fd >= 0)
+		close(fd);
+#endif
+
+	THREAD_RETURN;
+}
+
+void HotplugStart(void)
+{
+	if (atomicLoad32(&l_HotplugRunning))
+		return;
+
+	memset(l_HotplugClosed, 0, sizeof(l_HotplugClosed));
+	atomicStore32(&l_HotplugRunning, 1);
+
+	if (!threadCreate(&l_HotplugThread, HotplugMain, NULL))
+	{
+		atomicStore32(&l_HotplugRunning, 0);
+		DebugMessage(M64MSG_WARNING, "Couldn't start the hotplug thread, unplugged controllers won't reconnect");
+	}
+}
+
+void HotplugStop(void)
+{
+	if (!atomicLoad32(&l_HotplugRunning))
+		return;
+
+	atomicStore32(&l_HotplugRunning, 0);
+	threadJoin(l_HotplugThread);
+}
+
+int HotplugLost(int index)
+{
+	SLink *link = controller[index].link;
+
+	if (!link)
+		return 0;
+
+	if (atomicLoad32(&link->lost))
+		return 1;
+
+	// the watcher isn't running, keep trying the port like before; the
+	// transport is only looked at under the lock, it may be swapped
+	if (!atomicLoad32(&l_HotplugRunning) || !mutexTryLock(&link->lock))
+		return 0;
+
+	int lost = TransportLost(&link->transport);
+	if (lost)
+		HotplugMarkLost(link);
+	mutexUnlock(&link->lock);
+	return lost;
+}
@@ -0,0 +1,20 @@
+#ifndef __HOTPLUG_H__
+#define __HOTPLUG_H__
+
+/* Serial device hotplug.
+ *
+ * When the device of a controller goes away (unplugged, USB glitch) its
+ * link is marked lost and the controller answers "no response" right away
+ * without touching the serial port. A watcher thread closes the dead
+ * handle, waits for the device to show up again under its Serial name
+ * and swaps the reopened port into the link. On Linux it wakes up on
+ * inotify events for /dev, elsewhere it checks a few times a second. */
+
+extern void HotplugStart(void);
+extern void HotplugStop(void);
+
+/* The device of the controller is gone, answer without touching the port.
+   Also notices a hangup reported by the last transfer. */
+extern int HotplugLost(int index);
+
+#endif // __HOTPLUG_H__
@@ -0,0 +1,830 @@
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#include "plugin.h"
+#include "cadence.h"
+#include "hotplug.h"
+#include "iothread.h"
+#include "joybus.h"
+#include "mempak.h"
+#include "realtime.h"
+#include "rumble.h"
+#include "stats.h"
+#include "transfer.h"
+#include "transport.h"
+#include "thread.h"
+#include "timer.h"
+
+#define IOTHREAD_IDLE_WAIT	100000	// us, nothing to do but still check for shutdown
+#define IOTHREAD_RETRY		1000	// us, before asking a controller that didn't answer again
+#define IOTHREAD_BUSY		100		// us, before trying a port the emulation thread had again
+#define IOTHREAD_POLL_WAIT	1000	// us, longest sleep on ports that can't wake the thread
+#define IOTHREAD_GUARD		250		// us, PrefetchAlign: margin between the sample landing and the predicted poll
+#define IOTHREAD_SLOT_CHECK	500		// us, PrefetchAlign: how often to look for the game's poll once its sample went out
+#define IOTHREAD_QUEUE		8		// game commands a port can have queued each way, a power of two
+
+enum { IO_NONE, IO_GAME, IO_STATE, IO_RUMBLE, IO_MEMPAK };
+
+/* A game command on its way to the I/O thread and back */
+typedef struct
+{
+	unsigned char cmd[128];
+	uint32_t id;
+} SIoEntry;
+
+/* Lock-free queue between one producer and one consumer: only the
+   producer moves head, only the consumer moves tail */
+typedef struct
+{
+	SIoEntry entry[IOTHREAD_QUEUE];
+	volatile int32_t head;
+	volatile int32_t tail;
+} SIoQueue;
+
+typedef struct
+{
+	volatile int32_t active;	// looked after by the thread
+	int job;			// what is in flight on the port, IO_NONE if nothing
+	unsigned char cmd[128];	// its channel block
+	int64_t next;		// us, leave the port alone until then
+	int64_t busy;		// us, the port lock was taken, try the game's next command again then
+	int64_t idle;		// us, the port was busy when it had bytes nobody waited for, don't watch it until then
+	int readable;		// its handle woke the thread
+	int64_t started;	// us, when the job in flight went out
+	int64_t due;		// us, PrefetchAlign holds the state poll back until then, 0 if it doesn't
+	int64_t slot;		// us, predicted game poll the last state poll was sent for
+	int lead;			// us, recent time from sending a state poll to having its sample
+	/* Newest state sample: high word is the capture time in microseconds
+	 * (truncated, made odd so it is never zero), low word is the 4 reply bytes. Written only
+	 * by the I/O thread and read only by the emulator thread. */
+	volatile int64_t sample;
+
+	/* Game commands, see IoThreadSubmit. The emulation thread produces
+	 * requests and consumes answers, the I/O thread the other way round. */
+	SIoQueue requests;
+	SIoQueue answers;
+	uint32_t id;		// emulation thread: last id handed out
+	uint32_t issued;	// emulation thread: id of the command waiting for its answer, 0 if none
+	unsigned char issued_cmd[128];
+	unsigned char *deferred;	// emulation thread: block IoThreadCollectAll fills in
+} SIoPort;
+
+static SIoPort l_IoPort[4];
+static thread_t l_IoThread;
+static volatile int32_t l_IoRunning = 0;
+static volatile int32_t l_IoResync = 0;
+static mutex_t l_IoIdleLock;
+static cond_t l_IoIdle;
+static int l_IoWork;		// IoThreadWake was called, protected by l_IoIdleLock
+static mutex_t l_IoAnswerLock;
+static cond_t l_IoAnswered;	// an answer was queued, the emulation thread may be waiting for it
+static int l_IoThreadInit = 0;
+
+#ifdef __linux__
+static int l_IoEpoll = -1;
+static int l_IoEvent = -1;	// eventfd IoThreadWake pokes
+static int l_IoTimer = -1;	// timerfd for wakeups finer than epoll's milliseconds
+static int l_IoWatched[4];	// port descriptors in the epoll set
+static int l_IoWatchedCount = 0;
+#endif
+
+static void IoThreadInit(void)
+{
+	if (l_IoThreadInit)
+		return;
+
+	mutexInit(&l_IoIdleLock);
+	condInit(&l_IoIdle);
+	mutexInit(&l_IoAnswerLock);
+	condInit(&l_IoAnswered);
+	l_IoThreadInit = 1;
+}
+
+/* Slot behind the newest entry, NULL if the queue is full (producer) */
+static SIoEntry *IoQueueBack(SIoQueue *queue)
+{
+	if (queue->head - atomicLoad32(&queue->tail) == IOTHREAD_QUEUE)
+		return NULL;
+	return &queue->entry[queue->head & (IOTHREAD_QUEUE - 1)];
+}
+
+static void IoQueuePush(SIoQueue *queue)
+{
+	atomicStore32(&queue->head, queue->head + 1);
+}
+
+/* Oldest entry, NULL if the queue is empty (consumer) */
+static SIoEntry *IoQueueFront(SIoQueue *queue)
+{
+	if (atomicLoad32(&queue->head) == queue->tail)
+		return NULL;
+	return &queue->entry[queue->tail & (IOTHREAD_QUEUE - 1)];
+}
+
+static void IoQueuePop(SIoQueue *queue)
+{
+	atomicStore32(&queue->tail, queue->tail + 1);
+}
+
+/* Hand the game command at the front of the requests back, answered in port->cmd */
+static void IoThreadAnswer(SIoPort *port)
+{
+	SIoEntry *request = IoQueueFront(&port->requests);
+	SIoEntry *answer = IoQueueBack(&port->answers);
+
+	// full only if the emulation thread gave up on all of them, nobody waits for this one
+	if (answer)
+	{
+		memcpy(answer->cmd, port->cmd, sizeof(answer->cmd));
+		answer->id = request->id;
+		IoQueuePush(&port->answers);
+	}
+	IoQueuePop(&port->requests);
+
+	mutexLock(&l_IoAnswerLock);
+	condSignal(&l_IoAnswered);
+	mutexUnlock(&l_IoAnswerLock);
+}
+
+/* Hand the result of a transaction to whoever asked for it, res is -1 if
+   it couldn't be sent */
+static void IoThreadDone(int index, SIoPort *port, int job, int res)
+{
+	if (job == IO_GAME)
+		IoThreadAnswer(port);
+	else if (job == IO_RUMBLE)
+		RumbleDone(index, port->cmd, res);
+	else if (job == IO_MEMPAK)
+		MempakDone(index, port->cmd, res);
+	else if (job == IO_STATE && res == 4 && !(port->cmd[1] & JOYBUS_NO_RESPONSE))
+	{
+		uint32_t stamp = (uint32_t) timerMicros() | 1;
+		uint32_t state;
+		memcpy(&state, JOYBUS_RX_DATA(port->cmd), sizeof(state));
+
+		atomicStore64(&port->sample, (int64_t) (((uint64_t) stamp << 32) | state));
+
+		// quick to go up, slow to come down, so a slow reply doesn't miss the next poll
+		int elapsed = (int) (timerMicros() - port->started);
+		port->lead = elapsed > port->lead ? elapsed : port->lead - (port->lead - elapsed) / 8;
+	}
+
+	// nothing plugged in or the device is not answering, back off
+	if (res >= 0 && (port->cmd[1] & JOYBUS_NO_RESPONSE))
+		port->next = timerMicros() + IOTHREAD_RETRY;
+
+	port->job = IO_NONE;
+}
+
+/* With PrefetchAlign, hold the state poll back so its reply lands just
+   before the game's next poll. Returns 1 if it goes out now. */
+static int IoThreadDue(int index, SIoPort *port, int64_t now)
+{
+	int64_t poll = controller[index].prefetch_align ? CadenceNext(index, now) : 0;
+
+	port->due = 0;
+
+	// the game doesn't poll regularly (yet), keep the sample fresh all the time
+	if (!poll)
+		return 1;
+
+	// sent for this one already, the next is known once the game had it
+	if (poll == port->slot)
+	{
+		port->due = (poll > now ? poll : now) + IOTHREAD_SLOT_CHECK;
+		return 0;
+	}
+
+	int64_t start = poll - port->lead - CadenceJitter(index) - IOTHREAD_GUARD;
+	if (now < start)
+	{
+		port->due = start;
+		return 0;
+	}
+
+	port->slot = poll;
+	return 1;
+}
+
+/* A port on the same link, this one included, has a transaction in flight */
+static int IoThreadLinkBusy(int index)
+{
+	for (int i = 0; i < 4; i++)
+		if (l_IoPort[i].job != IO_NONE && controller[i].link == controller[index].link)
+			return 1;
+	return 0;
+}
+
+/* Another port on the same link has a game command waiting, background
+   work there must not keep taking the link from it */
+static int IoThreadLinkWanted(int index)
+{
+	for (int i = 0; i < 4; i++)
+		if (i != index && atomicLoad32(&l_IoPort[i].active) && controller[i].link == controller[index].link
+			&& IoQueueFront(&l_IoPort[i].requests))
+			return 1;
+	return 0;
+}
+
+/* Put the next piece of work for a controller on the wire */
+static void IoThreadBegin(int index, SIoPort *port, int64_t now)
+{
+	static const unsigned char poll[7] = { 0x01, 0x04, JOYBUS_CMD_STATE, 0, 0, 0, 0 };
+	SIoEntry *request = IoQueueFront(&port->requests);
+	int job;
+
+	// the game waits for its commands, they go first and no backoff holds them
+	if (request)
+	{
+		// behind our own transaction on a shared link, its reply wakes us
+		if (now < port->busy || IoThreadLinkBusy(index))
+			return;
+
+		memcpy(port->cmd, request->cmd, sizeof(port->cmd));
+
+		int started = HotplugLost(index) ? -1 : ControllerStart(index, port->cmd);
+		if (started > 0)
+		{
+			port->job = IO_GAME;
+			port->started = now;
+		}
+		// unplugged or resyncing, the answer is known already
+		else if (started < 0)
+		{
+			port->cmd[1] |= JOYBUS_NO_RESPONSE;
+			IoThreadAnswer(port);
+		}
+		else
+			port->busy = now + IOTHREAD_BUSY;
+		return;
+	}
+
+	if (now < port->next || IoThreadLinkWanted(index))
+		return;
+
+	// nothing to talk to until the device is back, IoThreadResync says when
+	if (HotplugLost(index))
+	{
+		port->next = now + IOTHREAD_IDLE_WAIT;
+		return;
+	}
+
+	// motor changes first, they are felt right away
+	if (RumbleNext(index, port->cmd))
+		job = IO_RUMBLE;
+	else if (MempakNext(index, port->cmd))
+		job = IO_MEMPAK;
+	else if (controller[index].prefetch && IoThreadDue(index, port, now))
+	{
+		memcpy(port->cmd, poll, sizeof(poll));
+		job = IO_STATE;
+	}
+	else
+		return;
+
+	if (ControllerStart(index, port->cmd) > 0)
+	{
+		port->job = job;
+		port->started = now;
+		return;
+	}
+
+	// the emulation thread has the port, give the work back and retry shortly
+	if (job == IO_STATE)
+		port->slot = 0;
+	IoThreadDone(index, port, job, -1);
+	port->next = now + IOTHREAD_BUSY;
+}
+
+#ifdef __linux__
+/* Make the epoll set hold exactly the descriptors of the ports */
+static void IoThreadWatch(const int *fds, int count)
+{
+	for (int i = 0; i < l_IoWatchedCount; i++)
+	{
+		int keep = 0;
+		for (int j = 0; j < count; j++)
+			keep |= fds[j] == l_IoWatched[i];
+		if (keep)
+			continue;
+
+		// closed descriptors leave the set on their own
+		epoll_ctl(l_IoEpoll, EPOLL_CTL_DEL, l_IoWatched[i], NULL);
+		l_IoWatched[i--] = l_IoWatched[--l_IoWatchedCount];
+	}
+
+	for (int j = 0; j < count; j++)
+	{
+		int known = 0;
+		for (int i = 0; i < l_IoWatchedCount; i++)
+			known |= fds[j] == l_IoWatched[i];
+		if (known)
+			continue;
+
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = fds[j];
+		if (epoll_ctl(l_IoEpoll, EPOLL_CTL_ADD, fds[j], &event) == 0 || errno == EEXIST)
+			l_IoWatched[l_IoWatchedCount++] = fds[j];
+	}
+}
+
+static void IoThreadUnwatchAll(void)
+{
+	IoThreadWatch(NULL, 0);
+}
+#endif
+
+/* The ports on transport t have bytes to read */
+static void IoThreadReadable(STransport *t)
+{
+	for (int i = 0; i < 4; i++)
+		if (atomicLoad32(&l_IoPort[i].active) && &controller[i].link->transport == t)
+			l_IoPort[i].readable = 1;
+}
+
+/* Sleep until bytes arrive on any port, a deadline or backoff runs out,
+   or there is new work */
+static void IoThreadWait(void)
+{
+	STransport *transports[4];
+	int fds[4];
+	int count = 0;
+	int pollable = 1;
+	int precise = 0;	// waking up on time matters (PrefetchAlign)
+	int64_t now = timerMicros();
+	int64_t wake = now + IOTHREAD_IDLE_WAIT;
+
+	// ports in flight first, their link locks are ours
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			SIoPort *port = &l_IoPort[i];
+
+			if (!atomicLoad32(&port->active) || (port->job == IO_NONE) != pass)
+				continue;
+
+			if (port->job == IO_NONE)
+			{
+				// a game command is work even if its retry is due already,
+				// unless it waits for the reply of our own transaction
+				if (IoQueueFront(&port->requests))
+				{
+					if (port->busy < wake && !IoThreadLinkBusy(i))
+						wake = port->busy;
+				}
+				else if (port->next > now && port->next < wake)
+					wake = port->next;
+				if (port->due > now && port->due < wake)
+				{
+					wake = port->due;
+					precise = 1;
+				}
+				if (port->idle > now && port->idle < wake)
+					wake = port->idle;
+			}
+			else if (ControllerDeadline(i) < wake)
+				wake = ControllerDeadline(i);
+
+			// a shared device is in the set once
+			STransport *t = &controller[i].link->transport;
+			int known = 0;
+			for (int j = 0; j < count; j++)
+				known |= transports[j] == t;
+			if (known)
+				continue;
+
+			// the link lock is ours from ControllerStart to ControllerFinish, so the
+			// hotplug thread can't swap the transport while we wait on it; an idle
+			// port's handle is looked up under the lock, a swap resyncs the set
+			int fd = -1;
+			if (port->job != IO_NONE)
+				fd = t->ops ? t->ops->handle(t) : -1;
+			else if (port->idle > now || HotplugLost(i) || atomicLoad32(&controller[i].waiters))
+				continue;
+			else if (mutexTryLock(&controller[i].link->lock))
+			{
+				fd = t->ops ? t->ops->handle(t) : -1;
+				mutexUnlock(&controller[i].link->lock);
+				if (fd < 0)
+					continue;
+			}
+			else
+				continue;
+
+			transports[count] = t;
+			fds[count] = fd;
+			pollable &= fd >= 0;
+			count++;
+		}
+	}
+
+	int64_t timeout = wake > now ? wake - now : 0;
+
+	// a handle was swapped, the epoll set may hold a stale one by the same number
+	if (atomicLoad32(&l_IoResync))
+		return;
+
+#ifdef __linux__
+	if (l_IoEpoll >= 0 && pollable)
+	{
+		struct epoll_event events[6];
+
+		IoThreadWatch(fds, count);
+		if (precise && l_IoTimer >= 0)
+		{
+			struct itimerspec when;
+			memset(&when, 0, sizeof(when));
+			when.it_value.tv_sec = wake / 1000000;
+			when.it_value.tv_nsec = (wake % 1000000) * 1000;
+			timerfd_settime(l_IoTimer, TFD_TIMER_ABSTIME, &when, NULL);
+		}
+		int res = epoll_wait(l_IoEpoll, events, 6, (int) ((timeout + 999) / 1000));
+
+		// ports in flight are looked at anyway, idle ones only if they have bytes
+		for (int i = 0; i < res; i++)
+		{
+			uint64_t value;
+			if (events[i].data.fd == l_IoEvent || events[i].data.fd == l_IoTimer)
+				while (read(events[i].data.fd, &value, sizeof(value)) > 0)
+					;
+			for (int j = 0; j < count; j++)
+				if (events[i].data.fd == fds[j])
+					IoThreadReadable(transports[j]);
+		}
+		return;
+	}
+#else
+	(void) fds;
+	(void) pollable;
+	(void) precise;
+#endif
+
+	// ports without a descriptor, or no epoll: IoThreadWake can't cut it short
+	if (count)
+	{
+		int ready = TransportWaitAny(transports, count, (int) (timeout < IOTHREAD_POLL_WAIT ? timeout : IOTHREAD_POLL_WAIT));
+		for (int j = 0; j < count; j++)
+			if (ready > 0 && (ready & (1 << j)))
+				IoThreadReadable(transports[j]);
+		return;
+	}
+
+	mutexLock(&l_IoIdleLock);
+	if (!l_IoWork && atomicLoad32(&l_IoRunning))
+		condWait(&l_IoIdle, &l_IoIdleLock, timeout);
+	l_IoWork = 0;
+	mutexUnlock(&l_IoIdleLock);
+}
+
+static THREAD_FUNC(IoThreadMain)
+{
+	(void) arg;
+
+	RealtimeThread();
+
+	while (atomicLoad32(&l_IoRunning))
+	{
+		// a port was reopened, ask the lost ones again and watch the new handles
+		if (atomicCas32(&l_IoResync, 1, 0))
+		{
+			for (int i = 0; i < 4; i++)
+				if (l_IoPort[i].job == IO_NONE)
+					l_IoPort[i].next = 0;
+#ifdef __linux__
+			IoThreadUnwatchAll();
+#endif
+		}
+
+		for (int i = 0; i < 4; i++)
+		{
+			SIoPort *port = &l_IoPort[i];
+			int res;
+
+			if (!atomicLoad32(&port->active))
+				continue;
+
+			if (port->job != IO_NONE && ControllerFinish(i, &res))
+				IoThreadDone(i, port, port->job, res);
+
+			// bytes nobody waits for, a late reply; if the port is busy, it is
+			// left out of the set for a while so they don't keep waking the thread
+			if (port->readable && port->job == IO_NONE && !IoThreadLinkBusy(i) && !ControllerIdle(i))
+				port->idle = timerMicros() + IOTHREAD_BUSY;
+			port->readable = 0;
+
+			if (port->job == IO_NONE)
+				IoThreadBegin(i, port, timerMicros());
+		}
+
+		IoThreadWait();
+	}
+
+	// let the transactions in flight finish, they hold the port locks
+	for (int busy = 1; busy; )
+	{
+		busy = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			SIoPort *port = &l_IoPort[i];
+			int res;
+
+			if (port->job == IO_NONE)
+				continue;
+			if (ControllerFinish(i, &res))
+				IoThreadDone(i, port, port->job, res);
+			else
+				busy = 1;
+		}
+		if (busy)
+			timerSleepMicros(IOTHREAD_BUSY);
+	}
+
+	THREAD_RETURN;
+}
+
+void IoThreadStart(int index)
+{
+	SIoPort *port = &l_IoPort[index];
+
+	IoThreadInit();
+
+	if (atomicLoad32(&port->active))
+		return;
+
+	port->job = IO_NONE;
+	port->next = 0;
+	port->busy = 0;
+	port->idle = 0;
+	port->readable = 0;
+	port->due = 0;
+	port->slot = 0;
+	port->lead = IOTHREAD_RETRY;
+	atomicStore64(&port->sample, 0);
+	atomicStore32(&port->requests.head, 0);
+	atomicStore32(&port->requests.tail, 0);
+	atomicStore32(&port->answers.head, 0);
+	atomicStore32(&port->answers.tail, 0);
+	port->issued = 0;
+	port->deferred = NULL;
+	atomicStore32(&port->active, 1);
+
+	if (!atomicLoad32(&l_IoRunning))
+	{
+#ifdef __linux__
+		l_IoEpoll = epoll_create1(EPOLL_CLOEXEC);
+		l_IoEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		l_IoWatchedCount = 0;
+		if (l_IoEpoll >= 0 && l_IoEvent >= 0)
+		{
+			struct epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN;
+			event.data.fd = l_IoEvent;
+			epoll_ctl(l_IoEpoll, EPOLL_CTL_ADD, l_IoEvent, &event);
+
+			l_IoTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			event.data.fd = l_IoTimer;
+			if (l_IoTimer >= 0 && epoll_ctl(l_IoEpoll, EPOLL_CTL_ADD, l_IoTimer, &event) < 0)
+			{
+				close(l_IoTimer);
+				l_IoTimer = -1;
+			}
+		}
+		else if (l_IoEpoll >= 0)
+		{
+			close(l_IoEpoll);
+			l_IoEpoll = -1;
+		}
+#endif
+
+		l_IoWork = 0;
+		atomicStore32(&l_IoResync, 0);
+		atomicStore32(&l_IoRunning, 1);
+
+		if (!threadCreate(&l_IoThread, IoThreadMain, NULL))
+		{
+			atomicStore32(&l_IoRunning, 0);
+			atomicStore32(&port->active, 0);
+			DebugMessage(M64MSG_WARNING, "Couldn't start the I/O thread, controller %i goes without it", index + 1);
+			return;
+		}
+	}
+
+	IoThreadWake(index);
+	DebugMessage(M64MSG_INFO, "I/O thread looks after controller %i", index + 1);
+}
+
+void IoThreadStopAll(void)
+{
+	if (atomicLoad32(&l_IoRunning))
+	{
+		atomicStore32(&l_IoRunning, 0);
+		IoThreadWake(0);
+		threadJoin(l_IoThread);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		atomicStore32(&l_IoPort[i].active, 0);
+		atomicStore64(&l_IoPort[i].sample, 0);
+		l_IoPort[i].issued = 0;
+		l_IoPort[i].deferred = NULL;
+	}
+
+#ifdef __linux__
+	if (l_IoEpoll >= 0)
+		close(l_IoEpoll);
+	if (l_IoEvent >= 0)
+		close(l_IoEvent);
+	if (l_IoTimer >= 0)
+		close(l_IoTimer);
+	l_IoEpoll = l_IoEvent = l_IoTimer = -1;
+#endif
+}
+
+void IoThreadWake(int index)
+{
+	(void) index;
+
+	if (!l_IoThreadInit)
+		return;
+
+	mutexLock(&l_IoIdleLock);
+	l_IoWork = 1;
+	condSignal(&l_IoIdle);
+	mutexUnlock(&l_IoIdleLock);
+
+#ifdef __linux__
+	uint64_t one = 1;
+	if (l_IoEvent >= 0)
+		while (write(l_IoEvent, &one, sizeof(one)) < 0 && errno == EINTR)
+			;
+#endif
+}
+
+void IoThreadResync(void)
+{
+	atomicStore32(&l_IoResync, 1);
+	if (atomicLoad32(&l_IoRunning))
+		IoThreadWake(0);
+}
+
+int IoThreadReadState(int index, unsigned char *cmd)
+{
+	SIoPort *port = &l_IoPort[index];
+
+	if (!controller[index].prefetch || !JOYBUS_IS_STATE_POLL(cmd))
+		return 0;
+
+	int64_t sample = atomicLoad64(&port->sample);
+	if (sample == 0)
+	{
+		StatsSampleAge(index, 0, 0);
+		return 0;
+	}
+
+	uint32_t stamp = (uint32_t) ((uint64_t) sample >> 32);
+	uint32_t state = (uint32_t) sample;
+	uint32_t age = (uint32_t) timerMicros() - stamp;
+
+	// the stamp was rounded up to odd, it can be a microsecond ahead
+	if (age == UINT32_MAX)
+		age = 0;
+
+	// too old, the I/O thread has probably lost the controller
+	if (age > (uint32_t) controller[index].prefetch_window)
+	{
+		StatsSampleAge(index, age, 0);
+		return 0;
+	}
+
+	StatsSampleAge(index, age, 1);
+	memcpy(JOYBUS_RX_DATA(cmd), &state, sizeof(state));
+	return 1;
+}
+
+/* The thread runs the port's game commands */
+static int IoThreadServes(SIoPort *port)
+{
+	return atomicLoad32(&l_IoRunning) && atomicLoad32(&port->active);
+}
+
+int IoThreadSubmit(int index, const unsigned char *cmd)
+{
+	SIoPort *port = &l_IoPort[index];
+
+	if (!IoThreadServes(port))
+		return 0;
+
+	SIoEntry *request = IoQueueBack(&port->requests);
+	if (!request)
+		return 0;
+
+	// 0 is no command
+	if (++port->id == 0)
+		port->id = 1;
+
+	int len = 2 + JOYBUS_TX_LEN(cmd);
+	memcpy(request->cmd, cmd, len + JOYBUS_RX_LEN(cmd));
+	request->id = port->id;
+	memcpy(port->issued_cmd, cmd, len);
+	port->issued = port->id;
+
+	IoQueuePush(&port->requests);
+	IoThreadWake(index);
+	return 1;
+}
+
+/* Wait for the answer to the issued command and fill cmd in from it */
+static void IoThreadAwait(int index, SIoPort *port, unsigned char *cmd)
+{
+	const int len = 2 + JOYBUS_TX_LEN(cmd) + JOYBUS_RX_LEN(cmd);
+
+	// every port of a shared link can be ahead of it, each taking at most the cap
+	int64_t give_up = timerMicros() + 5 * (int64_t) controller[index].rtt[RTT_CLASSES - 1].cap;
+
+	for (;;)
+	{
+		SIoEntry *answer;
+		while ((answer = IoQueueFront(&port->answers)) != NULL)
+		{
+			// answers to commands the game rewrote or we gave up on are dropped
+			int ours = answer->id == port->issued;
+			if (ours)
+				memcpy(cmd, answer->cmd, len);
+			IoQueuePop(&port->answers);
+			if (ours)
+			{
+				port->issued = 0;
+				return;
+			}
+		}
+
+		int64_t now = timerMicros();
+		if (now >= give_up)
+			break;
+
+		mutexLock(&l_IoAnswerLock);
+		if (!IoQueueFront(&port->answers))
+			condWait(&l_IoAnswered, &l_IoAnswerLock, give_up - now);
+		mutexUnlock(&l_IoAnswerLock);
+	}
+
+	port->issued = 0;
+	cmd[1] |= JOYBUS_NO_RESPONSE;
+}
+
+int IoThreadCollect(int index, unsigned char *cmd, int defer)
+{
+	SIoPort *port = &l_IoPort[index];
+
+	if (!IoThreadServes(port))
+		return 0;
+
+	// the game rewrote the command after it was issued, ask for the new one
+	if (port->issued && memcmp(port->issued_cmd, cmd, 2 + JOYBUS_TX_LEN(cmd)) != 0)
+	{
+		StatsRetry(index, cmd[2]);
+		port->issued = 0;
+	}
+
+	// same channel twice before the end of the frame, answer the first one
+	if (port->deferred)
+	{
+		IoThreadAwait(index, port, port->deferred);
+		port->deferred = NULL;
+	}
+
+	if (!port->issued && !IoThreadSubmit(index, cmd))
+		return 0;
+
+	if (defer)
+		port->deferred = cmd;
+	else
+		IoThreadAwait(index, port, cmd);
+	return 1;
+}
+
+void IoThreadCollectAll(void)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		SIoPort *port = &l_IoPort[i];
+
+		if (!port->deferred)
+			continue;
+
+		IoThreadAwait(i, port, port->deferred);
+		port->deferred = NULL;
+	}
+}
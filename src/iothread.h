@@ -0,0 +1,46 @@
+#ifndef __IOTHREAD_H__
+#define __IOTHREAD_H__
+
+/* Background I/O thread.
+ *
+ * One thread looks after the serial ports of every controller it was
+ * started for. It sends queued Rumble Pak motor changes, writes back and
+ * warms up the Controller Pak mirror and, with prefetch enabled, keeps
+ * polling the controller state (Joybus 0x01), or with PrefetchAlign sends
+ * it once per game poll, timed by the poll cadence (cadence.h) so the
+ * reply lands just before the game asks. The game's own commands for
+ * those ports go through the thread as well, ahead of everything else.
+ * It never waits on a single port: each port has at most one transaction
+ * in flight with a deadline of its own, and the thread sleeps until one of
+ * the ports has bytes (epoll on Linux, every open handle is watched), so a
+ * slow or unplugged controller doesn't hold up the others. The newest
+ * state sample of each controller is published through a single lock-free
+ * slot, so that ReadController can answer state polls without touching the
+ * serial port; game commands and their answers travel through a pair of
+ * lock-free queues per port. */
+
+extern void IoThreadStart(int index);
+extern void IoThreadStopAll(void);
+
+/* There is new background work, wake the thread if it is idle */
+extern void IoThreadWake(int index);
+
+/* A port was closed or opened again, its handle may have changed */
+extern void IoThreadResync(void);
+
+/* Answer a state poll from the prefetched sample.
+ * Returns 1 if cmd was filled in, 0 if the caller has to do the transfer. */
+extern int IoThreadReadState(int index, unsigned char *cmd);
+
+/* Hand a game command to the thread ahead of ReadController (split phase).
+ * Returns 0 if the thread doesn't look after the port. */
+extern int IoThreadSubmit(int index, const unsigned char *cmd);
+
+/* Answer a game command through the thread, submitting it unless it went
+ * out already. With defer set, cmd is filled in by IoThreadCollectAll at
+ * the end of the PIF frame, so the channels are on the wire side by side.
+ * Returns 0 if the caller has to do the transfer. */
+extern int IoThreadCollect(int index, unsigned char *cmd, int defer);
+extern void IoThreadCollectAll(void);
+
+#endif // __IOTHREAD_H__
@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "joybus.h"
+
+unsigned char JoybusAddressCrc(unsigned int address)
+{
+	static const unsigned char xor_table[16] = {
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x15, 0x1F, 0x0B,
+		0x16, 0x19, 0x07, 0x0E, 0x1C, 0x0D, 0x1A, 0x01
+	};
+	unsigned char crc = 0;
+
+	for (int i = 15; i >= 5; i--)
+		if ((address >> i) & 1)
+			crc ^= xor_table[i];
+
+	return crc & 0x1F;
+}
+
+unsigned char JoybusDataCrc(const unsigned char *data)
+{
+	unsigned char crc = 0;
+
+	// CRC-8, polynomial 0x85, with 8 trailing zero bits shifted through
+	for (int i = 0; i <= JOYBUS_PAK_BLOCK; i++)
+	{
+		for (int bit = 7; bit >= 0; bit--)
+		{
+			unsigned char xor_tap = (crc & 0x80) ? 0x85 : 0x00;
+			crc <<= 1;
+			if (i < JOYBUS_PAK_BLOCK && (data[i] & (1 << bit)))
+				crc |= 1;
+			crc ^= xor_tap;
+		}
+	}
+
+	return crc;
+}
+
+void JoybusPakRead(unsigned char *cmd, unsigned int address)
+{
+	cmd[0] = 3;
+	cmd[1] = 1 + JOYBUS_PAK_BLOCK;
+	cmd[2] = JOYBUS_CMD_PAK_READ;
+	cmd[3] = (address >> 8) & 0xFF;
+	cmd[4] = (address & 0xE0) | JoybusAddressCrc(address);
+}
+
+void JoybusPakWrite(unsigned char *cmd, unsigned int address, const unsigned char *data)
+{
+	cmd[0] = 3 + JOYBUS_PAK_BLOCK;
+	cmd[1] = 1;
+	cmd[2] = JOYBUS_CMD_PAK_WRITE;
+	cmd[3] = (address >> 8) & 0xFF;
+	cmd[4] = (address & 0xE0) | JoybusAddressCrc(address);
+	memcpy(cmd + 5, data, JOYBUS_PAK_BLOCK);
+}
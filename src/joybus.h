@@ -0,0 +1,60 @@
+#ifndef __JOYBUS_H__
+#define __JOYBUS_H__
+
+/* Joybus commands as they appear in a PIF RAM channel block:
+ *   cmd[0]   tx length (bits 0-5)
+ *   cmd[1]   rx length (bits 0-5), the core reads bit 7 as "no response"
+ *   cmd[2..] tx bytes, starting with the command byte
+ *   followed by rx_len bytes of reply */
+
+#define JOYBUS_CMD_INFO			0x00
+#define JOYBUS_CMD_STATE		0x01
+#define JOYBUS_CMD_PAK_READ		0x02
+#define JOYBUS_CMD_PAK_WRITE	0x03
+#define JOYBUS_CMD_RESET		0xFF
+
+#define JOYBUS_NO_RESPONSE		0x80
+
+#define JOYBUS_TX_LEN(cmd)		((cmd)[0] & 0x3F)
+#define JOYBUS_RX_LEN(cmd)		((cmd)[1] & 0x3F)
+#define JOYBUS_RX_DATA(cmd)		((cmd) + 2 + JOYBUS_TX_LEN(cmd))
+
+/* A plain controller state poll: 01 04 01 followed by 4 reply bytes */
+#define JOYBUS_IS_STATE_POLL(cmd) \
+	(JOYBUS_TX_LEN(cmd) == 1 && JOYBUS_RX_LEN(cmd) == 4 && (cmd)[2] == JOYBUS_CMD_STATE)
+
+/* Info / reset reply: 2 bytes of device id followed by the status byte */
+#define JOYBUS_IS_INFO(cmd) \
+	(JOYBUS_TX_LEN(cmd) == 1 && JOYBUS_RX_LEN(cmd) == 3 && \
+	((cmd)[2] == JOYBUS_CMD_INFO || (cmd)[2] == JOYBUS_CMD_RESET))
+
+#define JOYBUS_STATUS_PAK			0x01	// a pak is plugged in
+#define JOYBUS_STATUS_PAK_REMOVED	0x02	// no pak / pak was pulled since the last status
+#define JOYBUS_STATUS_ADDR_CRC		0x04	// last pak address had a bad CRC
+
+/* Pak accesses move 32 byte blocks. The 16 bit address is sent big endian
+ * with its low 5 bits replaced by a CRC of the upper 11 bits:
+ *   read:  03 21 02 AH AL          -> 32 data bytes + data CRC
+ *   write: 23 01 03 AH AL data[32] -> data CRC */
+#define JOYBUS_PAK_BLOCK		32
+
+#define JOYBUS_IS_PAK_READ(cmd) \
+	(JOYBUS_TX_LEN(cmd) == 3 && JOYBUS_RX_LEN(cmd) == 33 && (cmd)[2] == JOYBUS_CMD_PAK_READ)
+#define JOYBUS_IS_PAK_WRITE(cmd) \
+	(JOYBUS_TX_LEN(cmd) == 35 && JOYBUS_RX_LEN(cmd) == 1 && (cmd)[2] == JOYBUS_CMD_PAK_WRITE)
+
+#define JOYBUS_PAK_ADDRESS(cmd)	((((cmd)[3] << 8) | (cmd)[4]) & 0xFFE0)
+#define JOYBUS_PAK_DATA(cmd)	((cmd) + 5)
+
+extern unsigned char JoybusAddressCrc(unsigned int address);
+extern unsigned char JoybusDataCrc(const unsigned char *data);
+
+/* Build pak read/write blocks for an (aligned) address */
+extern void JoybusPakRead(unsigned char *cmd, unsigned int address);
+extern void JoybusPakWrite(unsigned char *cmd, unsigned int address, const unsigned char *data);
+
+/* The address CRC of a pak command is valid */
+#define JOYBUS_PAK_ADDRESS_OK(cmd) \
+	(((cmd)[4] & 0x1F) == JoybusAddressCrc(JOYBUS_PAK_ADDRESS(cmd)))
+
+#endif // __JOYBUS_H__
@@ -0,0 +1,420 @@
+#include <string.h>
+
+#include "plugin.h"
+#include "mempak.h"
+#include "iothread.h"
+#include "joybus.h"
+#include "frame.h"
+#include "transfer.h"
+#include "stats.h"
+
+#define BIT_TEST(map, n)	((map)[(n) >> 5] & (1u << ((n) & 31)))
+#define BIT_SET(map, n)		((map)[(n) >> 5] |= (1u << ((n) & 31)))
+#define BIT_CLEAR(map, n)	((map)[(n) >> 5] &= ~(1u << ((n) & 31)))
+
+#define MEMPAK_ID_BLOCK		0x20	// first copy of the pak ID, the others are at 0x60, 0x80 and 0xC0
+#define MEMPAK_PROBE		0x8000	// reads back 0x80 on a Rumble Pak, 0x84 on a powered Transfer Pak
+
+/* The mirror is only used for a pak known to be a Controller Pak */
+#define MEMPAK_MIRRORED(pak)	((pak)->present == 1 && (pak)->identified == 1)
+
+typedef struct
+{
+	mutex_t lock;
+	int enabled;
+	int present;		// last status: 1 pak plugged in, 0 no pak, -1 unknown
+	int identified;		// 1 the pak is a Controller Pak, -1 it is another pak, 0 not known yet
+	int probed;			// the ID block was read to identify the pak
+	int warm_next;		// next block to warm up, -1 if not warming
+	int dirty_count;
+	uint32_t valid[MEMPAK_BLOCKS / 32];
+	uint32_t dirty[MEMPAK_BLOCKS / 32];
+	unsigned char data[MEMPAK_SIZE];
+} SMempak;
+
+static SMempak l_Mempak[4];
+static int l_MempakInit = 0;
+
+/* Forget everything we know about the pak, lock must be held */
+static void MempakInvalidate(SMempak *pak, int index)
+{
+	if (pak->dirty_count)
+		DebugMessage(M64MSG_WARNING, "Controller Pak %i removed with %i unsaved blocks", index + 1, pak->dirty_count);
+
+	memset(pak->valid, 0, sizeof(pak->valid));
+	memset(pak->dirty, 0, sizeof(pak->dirty));
+	pak->dirty_count = 0;
+	pak->warm_next = -1;
+	pak->identified = 0;
+	pak->probed = 0;
+}
+
+/* A pak ID block adds up on a formatted Controller Pak: the big-endian
+   words before the last two sum to the first of them, the last one is
+   0xFFF2 minus that sum */
+static int MempakIdValid(unsigned int address, const unsigned char *data)
+{
+	if (address != 0x20 && address != 0x60 && address != 0x80 && address != 0xC0)
+		return 0;
+
+	uint16_t sum = 0;
+	for (int i = 0; i < 28; i += 2)
+		sum += (uint16_t) ((data[i] << 8) | data[i + 1]);
+
+	return ((data[28] << 8) | data[29]) == sum && ((data[30] << 8) | data[31]) == (uint16_t) (0xFFF2 - sum);
+}
+
+/* The block a Rumble or Transfer Pak answers at its probe address */
+static int MempakOtherPak(const unsigned char *data)
+{
+	for (int i = 1; i < JOYBUS_PAK_BLOCK; i++)
+		if (data[i] != data[0])
+			return 0;
+	return data[0] == 0x80 || data[0] == 0x84;
+}
+
+void MempakReset(int index, int enabled)
+{
+	SMempak *pak = &l_Mempak[index];
+
+	if (!l_MempakInit)
+	{
+		for (int i = 0; i < 4; i++)
+			mutexInit(&l_Mempak[i].lock);
+		l_MempakInit = 1;
+	}
+
+	mutexLock(&pak->lock);
+	memset(pak->valid, 0, sizeof(pak->valid));
+	memset(pak->dirty, 0, sizeof(pak->dirty));
+	pak->dirty_count = 0;
+	pak->warm_next = -1;
+	pak->present = -1;
+	pak->identified = 0;
+	pak->probed = 0;
+	pak->enabled = enabled;
+	mutexUnlock(&pak->lock);
+}
+
+int MempakHandle(int index, unsigned char *cmd)
+{
+	SMempak *pak = &l_Mempak[index];
+	int handled = 0;
+
+	if (!pak->enabled)
+		return 0;
+
+	int read = JOYBUS_IS_PAK_READ(cmd);
+	if (!read && !JOYBUS_IS_PAK_WRITE(cmd))
+		return 0;
+
+	// everything above 0x8000 belongs to rumble / transfer paks, and a bad
+	// address CRC gets an error status from the real pak
+	unsigned int address = JOYBUS_PAK_ADDRESS(cmd);
+	if (address >= MEMPAK_SIZE || !JOYBUS_PAK_ADDRESS_OK(cmd))
+		return 0;
+
+	int block = address / JOYBUS_PAK_BLOCK;
+	unsigned char *rx = JOYBUS_RX_DATA(cmd);
+
+	mutexLock(&pak->lock);
+
+	if (MEMPAK_MIRRORED(pak))
+	{
+		if (read && BIT_TEST(pak->valid, block))
+		{
+			memcpy(rx, pak->data + address, JOYBUS_PAK_BLOCK);
+			rx[JOYBUS_PAK_BLOCK] = JoybusDataCrc(rx);
+			handled = 1;
+		}
+		else if (!read)
+		{
+			memcpy(pak->data + address, JOYBUS_PAK_DATA(cmd), JOYBUS_PAK_BLOCK);
+			BIT_SET(pak->valid, block);
+			if (!BIT_TEST(pak->dirty, block))
+			{
+				BIT_SET(pak->dirty, block);
+				pak->dirty_count++;
+			}
+			rx[0] = JoybusDataCrc(JOYBUS_PAK_DATA(cmd));
+			handled = 1;
+		}
+	}
+
+	mutexUnlock(&pak->lock);
+
+	if (handled && !read)
+		IoThreadWake(index);
+
+	return handled;
+}
+
+void MempakObserve(int index, const unsigned char *cmd)
+{
+	SMempak *pak = &l_Mempak[index];
+
+	if (!pak->enabled || (cmd[1] & JOYBUS_NO_RESPONSE))
+		return;
+
+	const unsigned char *rx = JOYBUS_RX_DATA(cmd);
+
+	if (JOYBUS_IS_INFO(cmd))
+	{
+		int present = (rx[2] & JOYBUS_STATUS_PAK) && !(rx[2] & JOYBUS_STATUS_PAK_REMOVED);
+
+		mutexLock(&pak->lock);
+		// a pak that was just plugged in has to be identified again
+		if (!present || pak->present != 1)
+			MempakInvalidate(pak, index);
+		pak->present = present;
+		mutexUnlock(&pak->lock);
+		return;
+	}
+
+	int read = JOYBUS_IS_PAK_READ(cmd);
+	if (!read && !JOYBUS_IS_PAK_WRITE(cmd))
+		return;
+
+	unsigned int address = JOYBUS_PAK_ADDRESS(cmd);
+	if (!JOYBUS_PAK_ADDRESS_OK(cmd))
+		return;
+
+	// only trust data the pak has confirmed with a good CRC
+	const unsigned char *data = read ? rx : JOYBUS_PAK_DATA(cmd);
+	if (rx[read ? JOYBUS_PAK_BLOCK : 0] != JoybusDataCrc(data))
+		return;
+
+	// the game's Rumble / Transfer Pak probe rules the Controller Pak out
+	if (address >= MEMPAK_SIZE)
+	{
+		if (read && address == MEMPAK_PROBE && MempakOtherPak(data))
+		{
+			mutexLock(&pak->lock);
+			if (pak->identified != -1)
+			{
+				MempakInvalidate(pak, index);
+				pak->identified = -1;
+			}
+			mutexUnlock(&pak->lock);
+		}
+		return;
+	}
+
+	int block = address / JOYBUS_PAK_BLOCK;
+
+	mutexLock(&pak->lock);
+	// a valid pak ID only comes from a formatted Controller Pak
+	if (pak->identified == 0 && MempakIdValid(address, data))
+		pak->identified = 1;
+	if (MEMPAK_MIRRORED(pak) && !BIT_TEST(pak->dirty, block))
+	{
+		memcpy(pak->data + address, data, JOYBUS_PAK_BLOCK);
+		BIT_SET(pak->valid, block);
+	}
+	mutexUnlock(&pak->lock);
+}
+
+void MempakWarm(int index)
+{
+	SMempak *pak = &l_Mempak[index];
+
+	if (!pak->enabled)
+		return;
+
+	mutexLock(&pak->lock);
+	pak->warm_next = 0;
+	mutexUnlock(&pak->lock);
+
+	IoThreadWake(index);
+}
+
+/* Take up to max dirty blocks into pak writes, cmds are 38 byte blocks.
+ * Returns how many there are. */
+static int MempakTakeBlocks(int index, unsigned char **cmds, int max)
+{
+	SMempak *pak = &l_Mempak[index];
+	int count = 0;
+
+	mutexLock(&pak->lock);
+	while (count < max && pak->dirty_count && MEMPAK_MIRRORED(pak))
+	{
+		int next = -1;
+		for (int i = 0; i < MEMPAK_BLOCKS / 32 && next < 0; i++)
+			if (pak->dirty[i])
+				for (int bit = 0; bit < 32; bit++)
+					if (pak->dirty[i] & (1u << bit))
+					{
+						next = i * 32 + bit;
+						break;
+					}
+
+		// cleared before sending, a write in the meantime marks it again
+		BIT_CLEAR(pak->dirty, next);
+		pak->dirty_count--;
+		JoybusPakWrite(cmds[count++], next * JOYBUS_PAK_BLOCK, pak->data + next * JOYBUS_PAK_BLOCK);
+	}
+	mutexUnlock(&pak->lock);
+
+	return count;
+}
+
+/* Mark the blocks whose write didn't go through dirty again, sent is 0 if
+ * the port was busy. Returns 1 if any was written, -1 otherwise. */
+static int MempakWritten(int index, unsigned char **cmds, int count, int sent)
+{
+	SMempak *pak = &l_Mempak[index];
+	int written = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		unsigned char *cmd = cmds[i];
+		int block = JOYBUS_PAK_ADDRESS(cmd) / JOYBUS_PAK_BLOCK;
+
+		if (sent && !(cmd[1] & JOYBUS_NO_RESPONSE) && JOYBUS_RX_DATA(cmd)[0] == JoybusDataCrc(JOYBUS_PAK_DATA(cmd)))
+		{
+			written++;
+			continue;
+		}
+
+		mutexLock(&pak->lock);
+		if (MEMPAK_MIRRORED(pak) && !BIT_TEST(pak->dirty, block))
+		{
+			BIT_SET(pak->dirty, block);
+			pak->dirty_count++;
+			if (sent)
+				StatsRetry(index, JOYBUS_CMD_PAK_WRITE);
+		}
+		mutexUnlock(&pak->lock);
+	}
+
+	return written ? 1 : -1;
+}
+
+/* Ask for the next block that isn't in the mirror yet, or for the pak
+ * status if it isn't known. Returns 0 if there is nothing to warm. */
+static int MempakWarmNext(int index, unsigned char *cmd)
+{
+	SMempak *pak = &l_Mempak[index];
+	int block = -1;
+	int status = 0;
+
+	mutexLock(&pak->lock);
+	if (pak->warm_next >= 0)
+	{
+		if (pak->present == -1)
+			status = 1;
+		else if (pak->present == 0 || pak->identified == -1)
+			pak->warm_next = -1;
+		else if (pak->identified == 0)
+		{
+			// read the pak ID to tell if it is a Controller Pak, once
+			if (!pak->probed)
+			{
+				block = MEMPAK_ID_BLOCK / JOYBUS_PAK_BLOCK;
+				pak->probed = 1;
+			}
+			else
+				pak->warm_next = -1;
+		}
+		else
+		{
+			while (pak->warm_next < MEMPAK_BLOCKS && BIT_TEST(pak->valid, pak->warm_next))
+				pak->warm_next++;
+			if (pak->warm_next < MEMPAK_BLOCKS)
+				block = pak->warm_next++;
+			else
+				pak->warm_next = -1;
+		}
+	}
+	mutexUnlock(&pak->lock);
+
+	if (status)
+	{
+		// don't know if there is a pak yet, ask the controller
+		cmd[0] = 1;
+		cmd[1] = 3;
+		cmd[2] = JOYBUS_CMD_INFO;
+	}
+	else if (block >= 0)
+		JoybusPakRead(cmd, block * JOYBUS_PAK_BLOCK);
+	else
+		return 0;
+
+	return 1;
+}
+
+int MempakNext(int index, unsigned char *cmd)
+{
+	if (!l_Mempak[index].enabled)
+		return 0;
+
+	// unsaved data first, if the port is busy the next round retries
+	if (MempakTakeBlocks(index, &cmd, 1))
+		return 1;
+
+	return MempakWarmNext(index, cmd);
+}
+
+void MempakDone(int index, unsigned char *cmd, int res)
+{
+	SMempak *pak = &l_Mempak[index];
+
+	if (JOYBUS_IS_PAK_WRITE(cmd))
+	{
+		MempakWritten(index, &cmd, 1, res >= 0);
+		return;
+	}
+
+	// the reply of a warm up read is picked up by MempakObserve,
+	// one that couldn't be sent is read again
+	if (res < 0 && JOYBUS_IS_PAK_READ(cmd))
+	{
+		int block = JOYBUS_PAK_ADDRESS(cmd) / JOYBUS_PAK_BLOCK;
+
+		mutexLock(&pak->lock);
+		if (pak->warm_next > block)
+			pak->warm_next = block;
+		if (block == MEMPAK_ID_BLOCK / JOYBUS_PAK_BLOCK && pak->identified == 0)
+			pak->probed = 0;
+		mutexUnlock(&pak->lock);
+	}
+}
+
+/* Write up to FRAME_PIPELINE dirty blocks to the pak from the calling thread.
+ * Returns 1 if any was written, 0 if there was nothing to do, -1 on failure. */
+static int MempakFlushBlocks(int index)
+{
+	unsigned char cmd[FRAME_PIPELINE][2 + 35 + 1];
+	unsigned char *cmds[FRAME_PIPELINE];
+
+	for (int i = 0; i < FRAME_PIPELINE; i++)
+		cmds[i] = cmd[i];
+
+	int count = MempakTakeBlocks(index, cmds, FRAME_PIPELINE);
+	if (!count)
+		return 0;
+
+	ControllerTransferPipeline(index, cmds, count);
+	return MempakWritten(index, cmds, count, 1);
+}
+
+void MempakFlush(int index)
+{
+	SMempak *pak = &l_Mempak[index];
+	int failures = 0;
+
+	if (!pak->enabled)
+		return;
+
+	// give up after a few failures in a row, the controller is probably gone
+	while (failures < 3)
+	{
+		int res = MempakFlushBlocks(index);
+		if (res == 0)
+			break;
+		failures = res < 0 ? failures + 1 : 0;
+	}
+
+	if (pak->dirty_count)
+		DebugMessage(M64MSG_ERROR, "Couldn't write %i blocks back to Controller Pak %i", pak->dirty_count, index + 1);
+}
@@ -0,0 +1,40 @@
+#ifndef __MEMPAK_H__
+#define __MEMPAK_H__
+
+/* Write-back mirror of the Controller Pak.
+ *
+ * Keeps a copy of the 32 KB pak in host memory. Pak reads (Joybus 0x02)
+ * of mirrored blocks are answered locally with a computed data CRC, pak
+ * writes (0x03) update the mirror and are flushed to the real pak by the
+ * I/O thread. The mirror is filled lazily from replies that
+ * pass by, or warmed up in the background, and thrown away as soon as the
+ * controller reports that the pak was pulled. It is only used once the pak
+ * has been identified as a Controller Pak by a valid pak ID block; until
+ * then, and for Rumble and Transfer Paks, everything goes to the pak. */
+
+#define MEMPAK_SIZE		0x8000
+#define MEMPAK_BLOCKS	(MEMPAK_SIZE / 32)
+
+/* Reset the mirror of a controller, enabling or disabling it */
+extern void MempakReset(int index, int enabled);
+
+/* Try to answer a pak read or write from the mirror.
+ * Returns 1 if cmd was handled, 0 if it has to go to the controller. */
+extern int MempakHandle(int index, unsigned char *cmd);
+
+/* Learn from a transaction that went to the controller */
+extern void MempakObserve(int index, const unsigned char *cmd);
+
+/* Ask the I/O thread to read the whole pak into the mirror */
+extern void MempakWarm(int index);
+
+/* Background work for the I/O thread: MempakNext fills cmd with the next
+ * block to write back or warm up, returns 0 if there is nothing to do.
+ * MempakDone takes the result of sending it (-1 if the port was busy). */
+extern int MempakNext(int index, unsigned char *cmd);
+extern void MempakDone(int index, unsigned char *cmd, int res);
+
+/* Write every dirty block back to the pak from the calling thread */
+extern void MempakFlush(int index);
+
+#endif // __MEMPAK_H__
@@ -4,8 +4,28 @@
 #include <string.h>
 
 #include "plugin.h"
+#include "cadence.h"
 #include "version.h"
 #include "rs232.h"
+#include "iothread.h"
+#include "joybus.h"
+#include "mempak.h"
+#include "transfer.h"
+#include "tpak.h"
+#include "rumble.h"
+#include "stats.h"
+#include "frame.h"
+#include "hotplug.h"
+#include "transport.h"
+#include "trace.h"
+#include "realtime.h"
+#include "timer.h"
+
+#define DEFAULT_PREFETCH_WINDOW	5000
+#define DEFAULT_READ_TIMEOUT	20
+#define DEFAULT_LATENCY_TIMER	1
+#define DEFAULT_TRACE_SIZE		4096
+#define DEFAULT_REALTIME_PRIORITY	10
 
 #ifdef PROJECT_64
 #include "configini.h"
@@ -17,6 +37,14 @@ static Config *l_ConfigInput;
 
 /* global data definitions */
 SController controller[4];  // 4 controllers
+static SLink l_Link[4];		// at most one serial device per controller
+static int l_ControllersInit = 0;
+static int l_BatchFrame = 0;
+static int l_Hotplug = 1;
+static char l_StatsFile[1024];
+static int l_StatsKey = 0;
+static char l_TraceFile[1024];
+static int l_TraceSize = DEFAULT_TRACE_SIZE;
 
 #ifndef PROJECT_64
 /* static data definitions */
@@ -34,6 +62,7 @@ ptr_ConfigSetDefaultString ConfigSetDefaultString = NULL;
 ptr_ConfigGetParamInt      ConfigGetParamInt = NULL;
 ptr_ConfigGetParamBool     ConfigGetParamBool = NULL;
 ptr_ConfigGetParamString   ConfigGetParamString = NULL;
+ptr_ConfigGetUserCachePath ConfigGetUserCachePath = NULL;
 #endif
 
 /* Global functions */
@@ -59,12 +88,250 @@ void DebugMessage(int level, const char *message, ...)
 	va_end(args);
 }
 
+/* Per-controller settings live in "Controller N" sections for Project64
+   and as numbered keys (e.g. "Prefetch1") for mupen64plus */
+static int ConfigGetControllerInt(int index, const char *key, int def)
+{
+#ifdef PROJECT_64
+	char section[13];
+	sprintf(section, "Controller %d", index + 1);
+	int value;
+	ConfigReadInt(l_ConfigInput, section, key, &value, def);
+	return value;
+#else
+	char param[32];
+	sprintf(param, "%s%d", key, index + 1);
+	return ConfigGetParamInt(l_ConfigInput, param);
+#endif
+}
+
+static int ConfigGetControllerBool(int index, const char *key, int def)
+{
+#ifdef PROJECT_64
+	char section[13];
+	sprintf(section, "Controller %d", index + 1);
+	bool value;
+	ConfigReadBool(l_ConfigInput, section, key, &value, def);
+	return value;
+#else
+	char param[32];
+	sprintf(param, "%s%d", key, index + 1);
+	return ConfigGetParamBool(l_ConfigInput, param);
+#endif
+}
+
+/* Plugin wide settings, "Settings" section for Project64 */
+static int ConfigGetGlobalBool(const char *key, int def)
+{
+#ifdef PROJECT_64
+	bool value;
+	ConfigReadBool(l_ConfigInput, "Settings", key, &value, def);
+	return value;
+#else
+	return ConfigGetParamBool(l_ConfigInput, key);
+#endif
+}
+
+static int ConfigGetGlobalInt(const char *key, int def)
+{
+#ifdef PROJECT_64
+	int value;
+	ConfigReadInt(l_ConfigInput, "Settings", key, &value, def);
+	return value;
+#else
+	return ConfigGetParamInt(l_ConfigInput, key);
+#endif
+}
+
+static void ConfigGetGlobalString(const char *key, const char *def, char *value, int size)
+{
+#ifdef PROJECT_64
+	ConfigReadString(l_ConfigInput, "Settings", key, value, size, def);
+#else
+	const char *param = ConfigGetParamString(l_ConfigInput, key);
+	snprintf(value, size, "%s", param ? param : def);
+#endif
+}
+
+static const char *l_SerialBackends[] = { "poll", "uring", "uring-sqpoll" };
+static int l_SerialBackend = COM_BACKEND_POLL;	// asked for, ports fall back to poll
+
+/* How serial ports are driven, "SerialBackend" */
+static void ConfigSetSerialBackend(void)
+{
+	char name[32];
+	int backend = COM_BACKEND_POLL;
+
+	ConfigGetGlobalString("SerialBackend", "poll", name, sizeof(name));
+	for (int i = 0; i < (int) (sizeof(l_SerialBackends) / sizeof(l_SerialBackends[0])); i++)
+		if (strcmp(name, l_SerialBackends[i]) == 0)
+			backend = i;
+	if (strcmp(name, l_SerialBackends[backend]) != 0)
+		DebugMessage(M64MSG_WARNING, "Unknown SerialBackend %s, using poll", name);
+
+	l_SerialBackend = backend;
+	comSetBackend(backend);
+}
+
+/* Where the Transfer Pak cache files go, "CacheDir" or a folder in the core's cache path */
+static void ConfigSetCacheDir(void)
+{
+	char path[1024];
+#ifdef PROJECT_64
+	ConfigGetGlobalString("CacheDir", "Cache", path, sizeof(path));
+#else
+	ConfigGetGlobalString("CacheDir", "", path, sizeof(path));
+	if (!path[0] && ConfigGetUserCachePath && ConfigGetUserCachePath())
+		snprintf(path, sizeof(path), "%s/input-serial", ConfigGetUserCachePath());
+	else if (!path[0])
+		snprintf(path, sizeof(path), ".");
+#endif
+	TpakSetCacheDir(path);
+}
+
+#ifndef PROJECT_64
+static void ConfigSetDefaultControllerInt(const char *key, int def, const char *help)
+{
+	char param[32];
+	for (int i = 0; i < 4; i++) {
+		sprintf(param, "%s%d", key, i + 1);
+		ConfigSetDefaultInt(l_ConfigInput, param, def, help);
+	}
+}
+
+static void ConfigSetDefaultControllerBool(const char *key, int def, const char *help)
+{
+	char param[32];
+	for (int i = 0; i < 4; i++) {
+		sprintf(param, "%s%d", key, i + 1);
+		ConfigSetDefaultBool(l_ConfigInput, param, def, help);
+	}
+}
+#endif
+
+/* Stop all background work and write back anything the controllers
+   haven't seen yet, the serial ports stay open */
+static void StopControllers(void)
+{
+	HotplugStop();
+	IoThreadStopAll();
+
+	if (l_BatchFrame)
+	{
+		ControllerFlushBatch();
+		ControllerBatchReport();
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (controller[i].control && controller[i].control->Present)
+		{
+			ControllerCancel(i);
+			MempakFlush(i);
+			RumbleFlush(i);
+			TpakClose(i);
+		}
+	}
+}
+
+/* Switch a freshly opened link to the framed protocol if asked to and the adapter speaks it */
+static SLink *LinkProbe(int index, SLink *link)
+{
+	if (ConfigGetControllerBool(index, "Framing", 0))
+	{
+		int version = FrameProbe(&link->transport);
+		link->framed = version > 0;
+		if (version > 0)
+			DebugMessage(M64MSG_INFO, "Controller %i speaks the framed protocol, version %i", index + 1, version);
+		else
+			DebugMessage(M64MSG_INFO, "Controller %i doesn't answer the framed protocol probe, using the plain protocol", index + 1);
+	}
+
+	return link;
+}
+
+/* Open the serial device of a controller, or join the controller that
+   already has it open. Sharing a device needs the framed protocol, the
+   frames carry the channel of each controller. */
+static SLink *LinkOpen(int index, const char *name, int baud)
+{
+	for (int i = 0; i < index; i++)
+	{
+		SLink *link = controller[i].link;
+		if (!link || !TransportMatch(&link->transport, name))
+			continue;
+
+		if (!link->framed)
+		{
+			int version = FrameProbe(&link->transport);
+			if (version <= 0)
+			{
+				DebugMessage(M64MSG_ERROR, "Controller %i can't share a serial port with controller %i, the adapter doesn't speak the framed protocol", index + 1, i + 1);
+				return NULL;
+			}
+			link->framed = 1;
+			DebugMessage(M64MSG_INFO, "Controller %i speaks the framed protocol, version %i", i + 1, version);
+		}
+
+		link->users++;
+		return link;
+	}
+
+	SLink *link = &l_Link[index];
+	if (!TransportOpen(&link->transport, name, baud))
+		return NULL;
+
+	link->users = 1;
+	link->baud = baud;
+	snprintf(link->name, sizeof(link->name), "%s", name);
+
+	int port = link->transport.port;
+	if (port < 0)
+	{
+		DebugMessage(M64MSG_INFO, "Connected to %s over %s", link->transport.address, TransportName(link->transport.ops->kind));
+		return LinkProbe(index, link);
+	}
+
+	DebugMessage(M64MSG_INFO, "Opened %s at %i baud (asked for %i), low latency %s, %s backend", comGetPortName(port),
+		comGetBaudRate(port), baud, comGetLowLatency(port) ? "on" : "not available", l_SerialBackends[comGetBackend(port)]);
+	if (comGetBackend(port) != l_SerialBackend)
+		DebugMessage(M64MSG_WARNING, "No io_uring for %s, using poll. It needs Linux 5.6 and can be turned off (kernel.io_uring_disabled, seccomp)", comGetPortName(port));
+
+	int latency = comGetLatencyTimer(port);
+	int wanted = ConfigGetGlobalInt("LatencyTimer", DEFAULT_LATENCY_TIMER);
+	if (latency >= 0 && wanted > 0 && latency > wanted)
+		DebugMessage(M64MSG_WARNING, "Couldn't lower the USB latency timer of %s from %i ms to %i ms, every reply can be delayed by up to %i ms. "
+			"Check that /sys/bus/usb-serial/devices/%s/latency_timer is writable (e.g. with a udev rule)",
+			comGetPortName(port), latency, wanted, latency, comGetPortName(port));
+	else if (latency >= 0)
+		DebugMessage(M64MSG_INFO, "USB latency timer of %s is %i ms", comGetPortName(port), latency);
+
+	return LinkProbe(index, link);
+}
+
+/* Close the devices of all controllers */
+static void LinkCloseAll(void)
+{
+	for (int i = 0; i < 4; i++)
+		TransportClose(&l_Link[i].transport);
+}
+
 void InitializeComPorts()
 {
 	int devices = comEnumerate();
 
 	for (int i = 0; i < comGetNoPorts(); i++)
-		DebugMessage(M64MSG_INFO, "com[%i]: %s", i, comGetPortName(i));
+	{
+		int vid, pid;
+		const char *serial;
+		const char *id = comGetPortId(i);
+
+		if (comGetUsbInfo(i, &vid, &pid, &serial))
+			DebugMessage(M64MSG_INFO, "com[%i]: %s (%04x:%04x%s%s)%s%s", i, comGetPortName(i), vid, pid,
+				serial ? " serial " : "", serial ? serial : "", id ? " by-id " : "", id ? id : "");
+		else
+			DebugMessage(M64MSG_INFO, "com[%i]: %s", i, comGetPortName(i));
+	}
 
 	DebugMessage(M64MSG_INFO, "Found %i serial devices", devices);
 }
@@ -112,7 +379,10 @@ EXPORT void PluginLoaded(void)
 
 EXPORT void CloseDLL(void)
 {
+	StopControllers();
+	LinkCloseAll();
 	comTerminate();
+	RealtimeUnlockAll();
 	ConfigFree(l_ConfigInput);
 }
 
@@ -193,6 +463,7 @@ EXPORT m64p_error CALL PluginStartup(m64p_dynlib_handle CoreLibHandle, void *Con
 	ConfigGetParamInt = (ptr_ConfigGetParamInt)DLSYM(CoreLibHandle, "ConfigGetParamInt");
 	ConfigGetParamBool = (ptr_ConfigGetParamBool)DLSYM(CoreLibHandle, "ConfigGetParamBool");
 	ConfigGetParamString = (ptr_ConfigGetParamString) DLSYM(CoreLibHandle, "ConfigGetParamString");
+	ConfigGetUserCachePath = (ptr_ConfigGetUserCachePath) DLSYM(CoreLibHandle, "ConfigGetUserCachePath");
 
 	if (!ConfigOpenSection || !ConfigSaveSection || !ConfigSetDefaultInt || !ConfigSetDefaultString|| !ConfigGetParamInt || !ConfigGetParamBool || !ConfigGetParamString)
 		return M64ERR_INCOMPATIBLE;
@@ -218,6 +489,32 @@ EXPORT m64p_error CALL PluginStartup(m64p_dynlib_handle CoreLibHandle, void *Con
 	ConfigSetDefaultBool(l_ConfigInput, "Enabled4", 0, "Set controller 4 on or off");
 	ConfigSetDefaultString(l_ConfigInput, "Serial4", "ttyACM3", "Serial device for controller");
 	ConfigSetDefaultInt(l_ConfigInput, "Baud4", 115200, "Baud rate for controller 4");
+
+	ConfigSetDefaultControllerBool("Prefetch", 0, "Poll the controller state from a background thread instead of the emulation thread");
+	ConfigSetDefaultControllerInt("PrefetchWindow", DEFAULT_PREFETCH_WINDOW, "Max age in microseconds of a prefetched controller state before falling back to a direct read");
+	ConfigSetDefaultControllerBool("PrefetchAlign", 0, "Learn when the game polls the controller and send the prefetch so its reply arrives just before, instead of polling all the time");
+	ConfigSetDefaultControllerInt("ReadTimeout", DEFAULT_READ_TIMEOUT, "Max time in milliseconds to wait for a reply before reporting no controller");
+	ConfigSetDefaultControllerInt("SpinWait", 0, "Max time in microseconds to spin for a reply on a serial port before sleeping, learned from recent replies, 0 to always sleep");
+	ConfigSetDefaultControllerBool("SplitPhase", 0, "Send commands to the controller as soon as the game writes them and collect the reply when it reads them");
+	ConfigSetDefaultControllerBool("PakMirror", 0, "Serve Controller Pak reads from memory and write changes back in the background");
+	ConfigSetDefaultControllerBool("PakWarm", 0, "Read the whole Controller Pak into memory in the background when a game starts");
+	ConfigSetDefaultControllerBool("Framing", 0, "Ask the adapter for the framed protocol (sequence numbers and CRC, several commands in flight) and fall back to the plain protocol if it doesn't answer");
+	ConfigSetDefaultControllerInt("Channel", -1, "Port on a multi-port adapter when several controllers use the same serial device, -1 for the controller number");
+	ConfigSetDefaultControllerBool("RumbleAsync", 0, "Acknowledge Rumble Pak writes right away, send them in the background and drop the ones that don't change the motor");
+	ConfigSetDefaultControllerBool("TpakCache", 0, "Keep Game Boy cartridge ROM read through the Transfer Pak in a cache and serve repeated reads from it");
+
+	ConfigSetDefaultBool(l_ConfigInput, "BatchFrame", 0, "Send the commands of all controllers in a PIF frame back to back and wait for the replies together");
+	ConfigSetDefaultBool(l_ConfigInput, "Hotplug", 1, "Reopen a serial device that was unplugged or glitched out as soon as it comes back");
+	ConfigSetDefaultString(l_ConfigInput, "CacheDir", "", "Folder for the Transfer Pak cartridge cache, empty for the core's cache folder");
+	ConfigSetDefaultInt(l_ConfigInput, "LatencyTimer", DEFAULT_LATENCY_TIMER, "Latency timer in milliseconds for USB-serial bridges (FTDI, CH340...), restored when the port is closed, 0 to leave it alone");
+	ConfigSetDefaultString(l_ConfigInput, "SerialBackend", "poll", "How serial ports move their data on Linux: poll, uring (one system call per transaction) or uring-sqpoll (none for quick replies, keeps a core busy)");
+	ConfigSetDefaultString(l_ConfigInput, "StatsFile", "", "File the transaction statistics are written to when the ROM is closed or StatsKey is pressed, empty to disable");
+	ConfigSetDefaultInt(l_ConfigInput, "StatsKey", 0, "SDL key code that writes the transaction statistics to StatsFile, 0 to disable");
+	ConfigSetDefaultString(l_ConfigInput, "TraceFile", "", "File all Joybus commands and replies are recorded to while a ROM is running, for the replay transport, empty to disable");
+	ConfigSetDefaultInt(l_ConfigInput, "TraceSize", DEFAULT_TRACE_SIZE, "Size of the TraceFile ring in kilobytes, the oldest traffic is overwritten when it is full");
+	ConfigSetDefaultBool(l_ConfigInput, "Realtime", 0, "Run the I/O thread with real-time scheduling and keep the plugin locked in memory");
+	ConfigSetDefaultInt(l_ConfigInput, "RealtimeCpu", -1, "CPU the I/O thread is pinned to in real-time mode, -1 for any");
+	ConfigSetDefaultInt(l_ConfigInput, "RealtimePriority", DEFAULT_REALTIME_PRIORITY, "SCHED_FIFO priority of the I/O thread in real-time mode, 1 to 99");
 	ConfigSaveSection("Input-Serial");
 
 	InitializeComPorts();
@@ -231,7 +528,10 @@ EXPORT m64p_error CALL PluginShutdown(void)
 	if (!l_PluginInit)
 		return M64ERR_NOT_INIT;
 
+	StopControllers();
+	LinkCloseAll();
 	comTerminate();
+	RealtimeUnlockAll();
 
 	l_PluginInit = 0;
 	return M64ERR_SUCCESS;
@@ -271,14 +571,50 @@ EXPORT m64p_error CALL PluginGetVersion(m64p_plugin_type *PluginType, int *Plugi
 *******************************************************************/
 EXPORT void CALL InitiateControllers(CONTROL_INFO ControlInfo)
 {
+	// the I/O threads hold on to the old controller state
+	HotplugStop();
+	IoThreadStopAll();
+
+	l_BatchFrame = ConfigGetGlobalBool("BatchFrame", 0);
+	l_Hotplug = ConfigGetGlobalBool("Hotplug", 1);
+	ConfigSetCacheDir();
+	ConfigGetGlobalString("StatsFile", "", l_StatsFile, sizeof(l_StatsFile));
+	l_StatsKey = ConfigGetGlobalInt("StatsKey", 0);
+	ConfigGetGlobalString("TraceFile", "", l_TraceFile, sizeof(l_TraceFile));
+	l_TraceSize = ConfigGetGlobalInt("TraceSize", DEFAULT_TRACE_SIZE);
+	comSetLatencyTimer(ConfigGetGlobalInt("LatencyTimer", DEFAULT_LATENCY_TIMER));
+	ConfigSetSerialBackend();
+	StatsReset();
+
+	RealtimeUnlockAll();
+	RealtimeConfigure(ConfigGetGlobalInt("RealtimeCpu", -1),
+		ConfigGetGlobalBool("Realtime", 0) ? ConfigGetGlobalInt("RealtimePriority", DEFAULT_REALTIME_PRIORITY) : 0);
+
 	// reset controllers
-	memset(controller, 0, sizeof(SController));
+	if (l_ControllersInit)
+	{
+		LinkCloseAll();
+		for (int i=0; i<4; i++)
+			mutexDestroy(&l_Link[i].lock);
+	}
+
+	memset(controller, 0, sizeof(controller));
+	memset(l_Link, 0, sizeof(l_Link));
+
+	for (int i=0; i<4; i++)
+	{
+		mutexInit(&l_Link[i].lock);
+		TpakReset(i, 0);
+		RumbleReset(i, 0);
+		CadenceReset(i);
+	}
+	l_ControllersInit = 1;
 
 	for (int i=0; i<4; i++)
 	{
 		// set our CONTROL struct pointers to the array that was passed in to this function from the core
 		// this small struct tells the core whether each controller is plugged in, and what type of pak is connected
-		controller[i].control = ControlInfo.Controls;
+		controller[i].control = &ControlInfo.Controls[i];
 
 #ifdef PROJECT_64
 		char serial_sec_buf[13];
@@ -307,9 +643,9 @@ EXPORT void CALL InitiateControllers(CONTROL_INFO ControlInfo)
 
 		if (enabled && serial && baud)
 		{
-			int port = comFindPort(serial);
+			SLink *link = LinkOpen(i, serial, baud);
 
-			if (port >= 0 && comOpen(port, baud) != 0)
+			if (link)
 			{
 				DebugMessage(M64MSG_INFO, "Assigned controller %i to serial port %s", i+1, serial);
 
@@ -317,11 +653,57 @@ EXPORT void CALL InitiateControllers(CONTROL_INFO ControlInfo)
 				controller[i].control->Present = 1;
 				controller[i].control->RawData = 1;
 				controller[i].control->Plugin = PLUGIN_NONE;
-				controller[i].serial = port;
+				controller[i].link = link;
+
+				controller[i].prefetch = ConfigGetControllerBool(i, "Prefetch", 0);
+				controller[i].prefetch_window = ConfigGetControllerInt(i, "PrefetchWindow", DEFAULT_PREFETCH_WINDOW);
+				controller[i].prefetch_align = ConfigGetControllerBool(i, "PrefetchAlign", 0);
+
+				for (int k = 0; k < RTT_CLASSES; k++)
+					RttInit(&controller[i].rtt[k], ConfigGetControllerInt(i, "ReadTimeout", DEFAULT_READ_TIMEOUT) * 1000);
+
+				controller[i].split_phase = ConfigGetControllerBool(i, "SplitPhase", 0);
+
+				controller[i].pak_mirror = ConfigGetControllerBool(i, "PakMirror", 0);
+				controller[i].pak_warm = ConfigGetControllerBool(i, "PakWarm", 0);
+				MempakReset(i, controller[i].pak_mirror);
+
+				controller[i].tpak_cache = ConfigGetControllerBool(i, "TpakCache", 0);
+				TpakReset(i, controller[i].tpak_cache);
+
+				controller[i].rumble_async = ConfigGetControllerBool(i, "RumbleAsync", 0);
+				RumbleReset(i, controller[i].rumble_async);
+
+				int spin = ConfigGetControllerInt(i, "SpinWait", 0);
+				if (spin > link->spin_wait)
+					link->spin_wait = spin;
 			}
 		}
 	}
 
+	// a shared device needs a channel per controller, by default their number
+	for (int i=0; i<4; i++)
+	{
+		if (!controller[i].link)
+			continue;
+
+		int channel = ConfigGetControllerInt(i, "Channel", -1);
+		if (channel < 0 || channel > 3)
+			channel = controller[i].link->users > 1 ? i : 0;
+		controller[i].channel = channel;
+
+		for (int j = 0; j < i; j++)
+			if (controller[j].link == controller[i].link && controller[j].channel == channel)
+				DebugMessage(M64MSG_WARNING, "Controllers %i and %i share a serial port and channel %i", j + 1, i + 1, channel);
+	}
+
+	for (int i=0; i<4; i++)
+		if (l_Link[i].transport.ops && l_Link[i].transport.port >= 0)
+			comSetSpinLimit(l_Link[i].transport.port, l_Link[i].spin_wait);
+
+	// everything a transaction touches is in place now, fault it in before the game runs
+	RealtimeLockImage();
+
 	DebugMessage(M64MSG_INFO, "%s version %i.%i.%i initialized.", PLUGIN_NAME, VERSION_PRINTF_SPLIT(PLUGIN_VERSION));
 }
 
@@ -343,6 +725,87 @@ EXPORT void CALL InitiateControllers(CONTROL_INFO ControlInfo)
 *******************************************************************/
 EXPORT void CALL ControllerCommand(int index, unsigned char *cmd)
 {
+	if (index < 0 || cmd == NULL || !controller[index].control->Present || !controller[index].split_phase)
+		return;
+
+	// state polls are answered by the I/O thread
+	if (controller[index].prefetch && JOYBUS_IS_STATE_POLL(cmd))
+		return;
+
+	// the device is gone, ReadController answers for it
+	if (HotplugLost(index))
+		return;
+
+	// let the pak mirror have a go first
+	if (controller[index].pak_mirror && (JOYBUS_IS_PAK_READ(cmd) || JOYBUS_IS_PAK_WRITE(cmd)))
+		return;
+
+	// same for the Transfer Pak cache
+	if (controller[index].tpak_cache && JOYBUS_IS_PAK_READ(cmd))
+		return;
+
+	// and motor writes
+	if (controller[index].rumble_async && JOYBUS_IS_PAK_WRITE(cmd) && JOYBUS_PAK_ADDRESS(cmd) >= 0xC000)
+		return;
+
+	// the I/O thread runs it if it looks after the port
+	if (IoThreadSubmit(index, cmd))
+		return;
+
+	ControllerIssue(index, cmd);
+}
+
+/* Everything ReadController does, apart from tracing */
+static void ReadControllerHandle(int index, unsigned char *cmd)
+{
+	// end of the PIF frame
+	if (index < 0)
+	{
+		if (l_BatchFrame)
+			ControllerFlushBatch();
+		IoThreadCollectAll();
+		return;
+	}
+
+	if (cmd == NULL || !controller[index].control->Present)
+		return;
+
+	// learn when the game polls, PrefetchAlign times the prefetch by it
+	if (JOYBUS_IS_STATE_POLL(cmd))
+		CadenceRecord(index, timerMicros());
+
+	// unplugged, don't wait on the port until the hotplug thread has it back
+	if (HotplugLost(index))
+	{
+		cmd[1] |= JOYBUS_NO_RESPONSE;
+		return;
+	}
+
+	if (IoThreadReadState(index, cmd))
+		return;
+
+	if (MempakHandle(index, cmd))
+		return;
+
+	if (TpakHandle(index, cmd))
+		return;
+
+	if (RumbleHandle(index, cmd))
+		return;
+
+	if (IoThreadCollect(index, cmd, l_BatchFrame))
+		return;
+
+	if (controller[index].split_phase && ControllerComplete(index, cmd))
+		return;
+
+	if (l_BatchFrame)
+	{
+		ControllerBatch(index, cmd);
+		return;
+	}
+
+	ControllerTransfer(index, cmd);
 }
 
 /******************************************************************
@@ -358,22 +821,19 @@ EXPORT void CALL ControllerCommand(int index, unsigned char *cmd)
 *******************************************************************/
 EXPORT void CALL ReadController(int index, unsigned char *cmd)
 {
-	if (cmd == NULL || !controller[index].control->Present)
+	if (!TraceActive())
+	{
+		ReadControllerHandle(index, cmd);
 		return;
+	}
 
-	unsigned char tx_len = cmd[0] & 0x3F;
-	const unsigned char rx_len = cmd[1] & 0x3F;
-
-	unsigned char *rx_data = cmd + 2 + tx_len;
-
-	comWrite(controller[index].serial, (const char*) cmd, 2 + tx_len);
-
-	char buffer[33];
-	memset(buffer, 0, sizeof(buffer));
-
-	comRead(controller[index].serial, buffer, rx_len);
+	int64_t start = timerMicros();
+	ReadControllerHandle(index, cmd);
 
-	memcpy(rx_data, buffer, rx_len);
+	if (index < 0)
+		TraceFrameEnd(l_BatchFrame);
+	else if (cmd != NULL && controller[index].control->Present)
+		TraceCommand(index, cmd, start);
 }
 
 /******************************************************************
@@ -385,6 +845,27 @@ EXPORT void CALL ReadController(int index, unsigned char *cmd)
 *******************************************************************/
 EXPORT int CALL RomOpen(void)
 {
+	if (l_TraceFile[0])
+		TraceStart(l_TraceFile, l_TraceSize);
+
+	if (l_Hotplug)
+		HotplugStart();
+
+	for (int i = 0; i < 4; i++)
+	{
+		// every game polls at its own pace
+		CadenceReset(i);
+
+		if (!controller[i].control || !controller[i].control->Present)
+			continue;
+
+		if (controller[i].prefetch || controller[i].pak_mirror || controller[i].rumble_async)
+			IoThreadStart(i);
+
+		if (controller[i].pak_warm)
+			MempakWarm(i);
+	}
+
 	return 1;
 }
 
@@ -396,6 +877,13 @@ EXPORT int CALL RomOpen(void)
 *******************************************************************/
 EXPORT void CALL RomClosed(void)
 {
+	StopControllers();
+	TraceStop();
+
+	StatsReport();
+	if (l_StatsFile[0])
+		StatsDump(l_StatsFile);
+	StatsReset();
 }
 
 /******************************************************************
@@ -419,6 +907,8 @@ EXPORT void CALL GetKeys(int index, BUTTONS *keys)
 *******************************************************************/
 EXPORT void CALL SDL_KeyDown(int keymod, int keysym)
 {
+	if (l_StatsKey && keysym == l_StatsKey && l_StatsFile[0])
+		StatsDump(l_StatsFile);
 }
 
 /******************************************************************
@@ -6,9 +6,6 @@
 #include "m64p_plugin.h"
 #include "m64p_types.h"
 #include "m64p_config.h"
-
-/* global function definitions */
-extern void DebugMessage(int level, const char *message, ...);
 #else
 #include "pj64_types.h"
 
@@ -31,10 +28,55 @@ extern void DebugMessage(int level, const char *message, ...);
 #define DLSYM(a, b) dlsym(a, b)
 #endif
 
+#include "thread.h"
+#include "rtt.h"
+#include "frame.h"
+#include "transport.h"
+
+/* global function definitions */
+extern void DebugMessage(int level, const char *message, ...);
+
+/* A serial device, shared by the controllers multiplexed over it */
+typedef struct
+{
+    STransport transport;	// serial port or socket the adapter is behind
+    int users;			// controllers on this device
+    volatile int32_t lost;	// the device went away, the hotplug thread is waiting for it
+    int baud;			// rate the device was opened with
+    char name[256];		// Serial setting (transport URI) the device was found by
+    mutex_t lock;		// serializes transactions on the serial port
+    int framed;			// the device speaks the framed protocol
+    unsigned char seq;	// sequence number of the last frame sent
+    SFrameParser parser;	// framed replies read but not consumed yet
+    SFrameQueue queue[4];	// replies read off the link, by channel
+    unsigned char tx[4 * FRAME_SIZE(FRAME_MAX)];	// batched frames not written yet
+    int tx_len;
+    int spin_wait;		// max microseconds a serial port spins for a reply, the largest SpinWait on it
+    int64_t resync;		// us, the plain protocol lost track of its replies: drop what arrives until then, 0 if in sync
+    int quiet;			// us, how long the line has to be quiet for that, the deadline of the miss
+} SLink;
+
 typedef struct
 {
     CONTROL *control;	// pointer to CONTROL struct in Core library
-    int serial;			// pointer to BUTTONS struct in Core library
+    SLink *link;		// serial device the controller is on
+    int channel;		// N64 port on a multi-port adapter, tags its frames
+    volatile int32_t waiters;	// emulator thread is waiting for the lock
+    int prefetch;		// answer state polls from the I/O thread
+    int prefetch_window;	// max age of a prefetched state sample in microseconds
+    int prefetch_align;	// time the prefetch by the game's poll cadence instead of polling all the time
+    SRttTracker rtt[RTT_CLASSES];	// round trip times by RttClass, size the read deadline
+    int split_phase;	// send commands from ControllerCommand, read replies in ReadController
+    unsigned char pending[128];	// command block sent by ControllerCommand, awaiting its reply
+    int pending_len;	// tx bytes of the pending command, 0 if none
+    int64_t pending_start;	// time the pending command was sent
+    int pak_mirror;		// keep a write-back copy of the Controller Pak
+    int pak_warm;		// read the whole Controller Pak in the background at RomOpen
+    int tpak_cache;		// keep Transfer Pak cartridge ROM reads in the cache directory
+    int rumble_async;	// acknowledge Rumble Pak writes locally and send them in the background
+    unsigned char pending_seq;	// sequence number of the pending command
 } SController;
 
+extern SController controller[4];
+
 #endif // __PLUGIN_H__
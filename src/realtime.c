@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <link.h>
+#endif
+#endif
+
+#include "plugin.h"
+#include "realtime.h"
+
+#define REALTIME_STACK		(64 * 1024)	// bytes of the thread stack faulted in up front
+#define REALTIME_REGIONS	8
+
+enum { REPORT_AFFINITY = 1, REPORT_SCHEDULER = 2, REPORT_LOCK = 4 };
+
+typedef struct
+{
+	void *data;
+	size_t size;
+} SRegion;
+
+static int l_RealtimeCpu = -1;
+static int l_RealtimePriority = 0;
+static int l_RealtimeReported = 0;	// REPORT_ bits, each failure is only logged once
+static SRegion l_RealtimeRegions[REALTIME_REGIONS];
+static int l_RealtimeRegionCount = 0;
+
+static int RealtimeReport(int what)
+{
+	if (l_RealtimeReported & what)
+		return 0;
+
+	l_RealtimeReported |= what;
+	return 1;
+}
+
+#ifdef _WIN32
+static int RealtimeError(void)		{ return (int) GetLastError(); }
+
+static const char *RealtimeErrorText(int error)
+{
+	static char text[32];
+	snprintf(text, sizeof(text), "error %i", error);
+	return text;
+}
+#else
+static int RealtimeError(void)		{ return errno; }
+static const char *RealtimeErrorText(int error)	{ return strerror(error); }
+#endif
+
+/* Touch every page so none of them faults later, locking keeps them in */
+static void RealtimePrefault(void *data, size_t size)
+{
+	volatile unsigned char *bytes = data;
+
+	for (size_t i = 0; i < size; i += 4096)
+		(void) bytes[i];
+	if (size)
+		(void) bytes[size - 1];
+}
+
+static int RealtimeLockPages(void *data, size_t size)
+{
+#ifdef _WIN32
+	return VirtualLock(data, size) != 0;
+#else
+	return mlock(data, size) == 0;
+#endif
+}
+
+void RealtimeConfigure(int cpu, int priority)
+{
+	l_RealtimeCpu = cpu;
+	l_RealtimePriority = priority > 0 ? priority : 0;
+}
+
+int RealtimeEnabled(void)
+{
+	return l_RealtimePriority > 0;
+}
+
+void RealtimeThread(void)
+{
+	if (!RealtimeEnabled())
+		return;
+
+	if (l_RealtimeCpu >= 0)
+	{
+#if defined(_WIN32)
+		int pinned = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << l_RealtimeCpu) != 0;
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(l_RealtimeCpu, &set);
+		int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		int pinned = res == 0;
+		errno = res;
+#else
+		int pinned = 0;
+		errno = ENOTSUP;
+#endif
+		if (!pinned && RealtimeReport(REPORT_AFFINITY))
+		{
+			int error = RealtimeError();
+			DebugMessage(M64MSG_WARNING, "Couldn't pin the I/O thread to CPU %i (%s), it runs on any CPU", l_RealtimeCpu, RealtimeErrorText(error));
+		}
+	}
+
+#ifdef _WIN32
+	int scheduled = SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#else
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = l_RealtimePriority;
+	if (param.sched_priority > sched_get_priority_max(SCHED_FIFO))
+		param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+	int res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	int scheduled = res == 0;
+	errno = res;
+#endif
+	if (!scheduled && RealtimeReport(REPORT_SCHEDULER))
+	{
+		int error = RealtimeError();
+		DebugMessage(M64MSG_WARNING, "Couldn't give the I/O thread real-time priority %i (%s), it keeps normal scheduling. "
+			"On Linux it needs CAP_SYS_NICE or an rtprio limit (/etc/security/limits.conf)", l_RealtimePriority, RealtimeErrorText(error));
+	}
+	else if (scheduled)
+		DebugMessage(M64MSG_INFO, "I/O thread runs at real-time priority %i", l_RealtimePriority);
+
+	// the deepest the thread goes, so the stack doesn't fault in mid transaction
+	unsigned char stack[REALTIME_STACK];
+	memset(stack, 0, sizeof(stack));
+	RealtimePrefault(stack, sizeof(stack));
+	RealtimeLockPages(stack, sizeof(stack));
+}
+
+static void RealtimeLock(void *data, size_t size)
+{
+	if (!RealtimeEnabled() || !size)
+		return;
+
+	RealtimePrefault(data, size);
+
+	if (!RealtimeLockPages(data, size))
+	{
+		if (RealtimeReport(REPORT_LOCK))
+		{
+			int error = RealtimeError();
+			DebugMessage(M64MSG_WARNING, "Couldn't lock the plugin in memory (%s), it can be paged out. "
+				"On Linux raise the memlock limit (ulimit -l)", RealtimeErrorText(error));
+		}
+		return;
+	}
+
+	if (l_RealtimeRegionCount < REALTIME_REGIONS)
+	{
+		l_RealtimeRegions[l_RealtimeRegionCount].data = data;
+		l_RealtimeRegions[l_RealtimeRegionCount].size = size;
+		l_RealtimeRegionCount++;
+	}
+}
+
+#ifdef __linux__
+/* Lock the loaded segments of the object this code is in */
+static int RealtimeLockSegments(struct dl_phdr_info *info, size_t size, void *arg)
+{
+	uintptr_t self = (uintptr_t) arg;
+	int mine = 0;
+
+	(void) size;
+
+	for (int i = 0; i < info->dlpi_phnum; i++)
+	{
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+		if (phdr->p_type == PT_LOAD && self >= start && self < start + phdr->p_memsz)
+			mine = 1;
+	}
+	if (!mine)
+		return 0;
+
+	for (int i = 0; i < info->dlpi_phnum; i++)
+	{
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type == PT_LOAD)
+			RealtimeLock((void *) (info->dlpi_addr + phdr->p_vaddr), phdr->p_memsz);
+	}
+	return 1;
+}
+#endif
+
+void RealtimeLockImage(void)
+{
+	if (!RealtimeEnabled() || l_RealtimeRegionCount)
+		return;
+
+#if defined(_WIN32)
+	HMODULE module;
+	if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCSTR) &RealtimeLockImage, &module))
+	{
+		const IMAGE_DOS_HEADER *dos = (const IMAGE_DOS_HEADER *) module;
+		const IMAGE_NT_HEADERS *nt = (const IMAGE_NT_HEADERS *) ((const BYTE *) module + dos->e_lfanew);
+		RealtimeLock(module, nt->OptionalHeader.SizeOfImage);
+	}
+#elif defined(__linux__)
+	dl_iterate_phdr(RealtimeLockSegments, (void *) (uintptr_t) &RealtimeLockImage);
+#else
+	if (RealtimeReport(REPORT_LOCK))
+		DebugMessage(M64MSG_WARNING, "Locking the plugin in memory is not supported on this system");
+#endif
+
+	if (l_RealtimeRegionCount)
+		DebugMessage(M64MSG_INFO, "Plugin locked in memory");
+}
+
+void RealtimeUnlockAll(void)
+{
+	for (int i = 0; i < l_RealtimeRegionCount; i++)
+	{
+#ifdef _WIN32
+		VirtualUnlock(l_RealtimeRegions[i].data, l_RealtimeRegions[i].size);
+#else
+		munlock(l_RealtimeRegions[i].data, l_RealtimeRegions[i].size);
+#endif
+	}
+	l_RealtimeRegionCount = 0;
+}
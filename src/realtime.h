@@ -0,0 +1,28 @@
+#ifndef __REALTIME_H__
+#define __REALTIME_H__
+
+/* Real-time mode.
+ *
+ * Opt-in protection of the I/O thread against the rest of the machine
+ * (shader compiles, a recording encoder): the thread is pinned to one CPU
+ * and runs SCHED_FIFO (time critical priority on Windows), and the state
+ * it touches on every transaction is faulted in and locked in memory so
+ * a reply never waits for a page fault. Whatever the system refuses
+ * (EPERM without CAP_SYS_NICE, RLIMIT_MEMLOCK...) is reported once and
+ * the thread goes on with normal scheduling. */
+
+/* Settings for the threads and memory from now on, priority 0 turns
+   real-time mode off, cpu -1 doesn't pin */
+extern void RealtimeConfigure(int cpu, int priority);
+
+extern int RealtimeEnabled(void);
+
+/* Make the calling thread real-time and prefault its stack */
+extern void RealtimeThread(void);
+
+/* Prefault and lock the plugin's code and static data (controller and
+   link state, pak mirrors, statistics), until RealtimeUnlockAll */
+extern void RealtimeLockImage(void);
+extern void RealtimeUnlockAll(void);
+
+#endif // __REALTIME_H__
@@ -42,11 +42,38 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+/** termios2 from asm/termbits.h, which clashes with termios.h */
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+#endif
+
 /*****************************************************************************/
 /** Base name for COM devices */
 #if defined(__APPLE__) && defined(__MACH__)
@@ -62,30 +89,71 @@
 #endif
 
 /*****************************************************************************/
+#define COM_SPINSAMPLES       16
+
 typedef struct {
 	char * port;
+	char * byId;
+	char * serial;
+	int vid;
+	int pid;
 	int handle;
+	volatile int lost;
+	int baudrate;
+	int lowLatency;
+	int setLowLatency;
+	int latencyTimer;
+	int savedLatencyTimer;
+	int backend;
+	void * uring;
+	int spinLimit;
+	int spinBudget;
+	int recent[COM_SPINSAMPLES];	// microseconds the last reads waited
+	int recentCount;
+	COMSpinStats spin;
 } COMDevice;
 
 #define COM_MAXDEVICES        64
 static COMDevice comDevices[COM_MAXDEVICES];
 static int noDevices = 0;
+static int latencyTimer = 0;
+static int backend = COM_BACKEND_POLL;
 
 /*****************************************************************************/
 /** Private functions */
 void _AppendDevices(const char * base);
+void _ScanSysfs();
+void _ScanById();
+int _AddDevice(const char * port);
+int _MatchBase(const char * name);
 int _BaudFlag(int BaudRate);
+int _WaitReadable(int handle, int timeout_us);
+int64_t _Micros(clockid_t clock);
+void _LearnSpin(COMDevice * com, int waited_us);
+int _SetBaudOther(int handle, int baudrate);
+int _GetBaudRate(int handle, int baudrate);
+int _SetLowLatency(int handle, int * changed);
+void _ClearLowLatency(int handle);
+int _LatencyTimerPath(int index, char * path, size_t size);
+int _ReadLatencyTimer(const char * path);
+int _WriteLatencyTimer(const char * path, int ms);
+void * _UringOpen(int handle, int sqpoll);
+void _UringClose(void * uring);
+int _UringTransact(void * uring, const char * tx, size_t tx_len, char * rx, size_t rx_len, int timeout_us);
 
 /*****************************************************************************/
 int comEnumerate()
 {
-	for (int i = 0; i < noDevices; i++) {
-		if (comDevices[i].port) free(comDevices[i].port);
-		comDevices[i].port = NULL;
+	// Known devices keep their index (and open handle), new ones are appended
+	DIR * dirp = opendir("/sys/class/tty");
+	if (dirp) {
+		closedir(dirp);
+		_ScanSysfs();
+		_ScanById();
+	} else {
+		for (int i = 0; i < noBases; i++)
+			_AppendDevices(devBases[i]);
 	}
-	noDevices = 0;
-	for (int i = 0; i < noBases; i++)
-		_AppendDevices(devBases[i]);
 	return noDevices;
 }
 
@@ -94,8 +162,11 @@ void comTerminate()
 	comCloseAll();
 	for (int i = 0; i < noDevices; i++) {
 		if (comDevices[i].port) free(comDevices[i].port);
-		comDevices[i].port = NULL;
+		if (comDevices[i].byId) free(comDevices[i].byId);
+		if (comDevices[i].serial) free(comDevices[i].serial);
+		memset(&comDevices[i], 0, sizeof(COMDevice));
 	}
+	noDevices = 0;
 }
 
 int comGetNoPorts()
@@ -107,10 +178,46 @@ int comGetNoPorts()
 int comFindPort(const char * name)
 {
 	int p;
-	for (p = 0; p < noDevices; p++)
+	const char * byId = "/dev/serial/by-id/";
+	for (p = 0; p < noDevices; p++) {
 		if (strcmp(name, comDevices[p].port) == 0)
 			return p;
-	return -1;
+		if (comDevices[p].byId && (strcmp(name, comDevices[p].byId) == 0
+			|| (strncmp(name, byId, strlen(byId)) == 0 && strcmp(name + strlen(byId), comDevices[p].byId) == 0)))
+			return p;
+		if (strncmp(name, "/dev/", 5) == 0 && strcmp(name + 5, comDevices[p].port) == 0)
+			return p;
+	}
+	// Some other name for a device, e.g. a udev symlink
+	char path[256];
+	snprintf(path, sizeof(path), name[0] == '/' ? "%s" : "/dev/%s", name);
+	char * real = realpath(path, NULL);
+	if (!real)
+		return -1;
+	for (p = 0; p < noDevices; p++)
+		if (strncmp(real, "/dev/", 5) == 0 && strcmp(real + 5, comDevices[p].port) == 0)
+			break;
+	free(real);
+	if (p < noDevices)
+		return p;
+	return _AddDevice(name);
+}
+
+const char * comGetPortId(int index)
+{
+	if (index >= noDevices || index < 0)
+		return NULL;
+	return comDevices[index].byId;
+}
+
+int comGetUsbInfo(int index, int * vid, int * pid, const char ** serial)
+{
+	if (index >= noDevices || index < 0 || !comDevices[index].vid)
+		return 0;
+	if (vid) *vid = comDevices[index].vid;
+	if (pid) *pid = comDevices[index].pid;
+	if (serial) *serial = comDevices[index].serial;
+	return 1;
 }
 
 const char * comGetInternalName(int index)
@@ -119,7 +226,7 @@ const char * comGetInternalName(int index)
 	static char name[COM_MAXNAME];
 	if (index >= noDevices || index < 0)
 		return NULL;
-	sprintf(name, "/dev/%s", comDevices[index].port);
+	snprintf(name, COM_MAXNAME, comDevices[index].port[0] == '/' ? "%s" : "/dev/%s", comDevices[index].port);
 	return name;
 }
 
@@ -152,16 +259,54 @@ int comOpen(int index, int baudrate)
 	config.c_lflag = 0;
 	config.c_cflag = CREAD | CLOCAL | CS8;
 
+	// Rates without a Bxxx constant are set through termios2 below
 	int flag = _BaudFlag(baudrate);
-	cfsetospeed(&config, flag);
-	cfsetispeed(&config, flag);
+#ifndef __linux__
+	if (flag == -1) {
+		close(handle);
+		return 0;
+	}
+#endif
+	cfsetospeed(&config, flag != -1 ? flag : B38400);
+	cfsetispeed(&config, flag != -1 ? flag : B38400);
 
 	// Validate configuration
 	if (tcsetattr(handle, TCSANOW, &config) < 0) {
 		close(handle);
 		return 0;
 	}
+	if (flag == -1 && _SetBaudOther(handle, baudrate) < 0) {
+		close(handle);
+		return 0;
+	}
 	com->handle = handle;
+	com->lost = 0;
+	com->baudrate = _GetBaudRate(handle, baudrate);
+	com->lowLatency = _SetLowLatency(handle, &com->setLowLatency);
+
+	// USB-serial bridges buffer replies for up to latency_timer ms
+	com->latencyTimer = -1;
+	com->savedLatencyTimer = -1;
+	char path[256];
+	if (_LatencyTimerPath(index, path, sizeof(path))) {
+		com->latencyTimer = _ReadLatencyTimer(path);
+		if (latencyTimer > 0 && com->latencyTimer > latencyTimer
+			&& _WriteLatencyTimer(path, latencyTimer) == 0) {
+			com->savedLatencyTimer = com->latencyTimer;
+			com->latencyTimer = _ReadLatencyTimer(path);
+		}
+	}
+
+	// io_uring needs a 5.6 kernel and may be off (io_uring_disabled, seccomp)
+	com->backend = COM_BACKEND_POLL;
+	com->uring = NULL;
+#ifdef __linux__
+	if (backend != COM_BACKEND_POLL) {
+		com->uring = _UringOpen(handle, backend == COM_BACKEND_URING_SQPOLL);
+		if (com->uring)
+			com->backend = backend;
+	}
+#endif
 	return 1;
 }
 
@@ -172,9 +317,61 @@ void comClose(int index)
 	COMDevice * com = &comDevices[index];
 	if (com->handle < 0) 
 		return;
-	tcdrain(com->handle);
+	if (!com->lost)
+		tcdrain(com->handle);
+#ifdef __linux__
+	_UringClose(com->uring);
+#endif
+	com->uring = NULL;
+	// Leave the tty flags the way we found them
+	if (com->setLowLatency && !com->lost)
+		_ClearLowLatency(com->handle);
+	com->setLowLatency = 0;
 	close(com->handle);
 	com->handle = -1;
+	// Give the bridge its old latency back
+	char path[256];
+	if (com->savedLatencyTimer >= 0 && _LatencyTimerPath(index, path, sizeof(path)))
+		_WriteLatencyTimer(path, com->savedLatencyTimer);
+	com->savedLatencyTimer = -1;
+}
+
+int comGetBaudRate(int index)
+{
+	if (index >= noDevices || index < 0)
+		return 0;
+	return comDevices[index].handle >= 0 ? comDevices[index].baudrate : 0;
+}
+
+int comGetLowLatency(int index)
+{
+	if (index >= noDevices || index < 0)
+		return 0;
+	return comDevices[index].handle >= 0 ? comDevices[index].lowLatency : 0;
+}
+
+void comSetLatencyTimer(int ms)
+{
+	latencyTimer = ms;
+}
+
+int comGetLatencyTimer(int index)
+{
+	if (index >= noDevices || index < 0)
+		return -1;
+	return comDevices[index].handle >= 0 ? comDevices[index].latencyTimer : -1;
+}
+
+void comSetBackend(int value)
+{
+	backend = value;
+}
+
+int comGetBackend(int index)
+{
+	if (index >= noDevices || index < 0)
+		return COM_BACKEND_POLL;
+	return comDevices[index].handle >= 0 ? comDevices[index].backend : COM_BACKEND_POLL;
 }
 
 void comCloseAll()
@@ -191,33 +388,211 @@ int comWrite(int index, const char * buffer, size_t len)
 	if (comDevices[index].handle <= 0)
 		return 0;
 	int res = write(comDevices[index].handle, buffer, len);
+	if (res < 0 && errno != EAGAIN && errno != EINTR)
+		comDevices[index].lost = 1;
 	return res;
 }
 
+int comIsLost(int index)
+{
+	if (index >= noDevices || index < 0)
+		return 0;
+	return comDevices[index].lost;
+}
+
+int comGetHandle(int index)
+{
+	if (index >= noDevices || index < 0)
+		return -1;
+	return comDevices[index].handle > 0 ? comDevices[index].handle : -1;
+}
+
 int comRead(int index, char * buffer, size_t len)
+{
+	return comReadTimeout(index, buffer, len, -1);
+}
+
+int comReadTimeout(int index, char * buffer, size_t len, int timeout_us)
 {
 	if (index >= noDevices || index < 0)
 		return 0;
-	if (comDevices[index].handle <= 0)
+	int handle = comDevices[index].handle;
+	if (handle <= 0)
 		return 0;
 
-	size_t bytes_left, bytes_read;
-	ssize_t res;
-
-	bytes_left = len;
-	bytes_read = 0;
+	COMDevice * com = &comDevices[index];
+	size_t bytes_read = 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t start = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	int64_t deadline = start + timeout_us;
+
+	// A reply that is about to arrive is cheaper to spin for than to sleep
+	// for, a poll() wakeup costs tens of microseconds
+	int waiting = timeout_us != 0 && len > 0;
+	if (waiting && com->spinBudget > 0) {
+		int64_t cpu = _Micros(CLOCK_THREAD_CPUTIME_ID);
+		int64_t end = start + (timeout_us > 0 && timeout_us < com->spinBudget ? timeout_us : com->spinBudget);
+		int64_t spun = start;
+		while (bytes_read < len && spun < end) {
+			ssize_t res = read(handle, buffer + bytes_read, len - bytes_read);
+			if (res > 0)
+				bytes_read += res;
+			spun = _Micros(CLOCK_MONOTONIC);
+		}
+		com->spin.spun++;
+		com->spin.spinUs += spun - start;
+		com->spin.spinCpuUs += _Micros(CLOCK_THREAD_CPUTIME_ID) - cpu;
+		if (bytes_read == len)
+			com->spin.caught++;
+	}
 
-	do {
-		if ((res = read(comDevices[index].handle, buffer + bytes_read, bytes_left)) < 0)
+	// VMIN = VTIME = 0, so read() never blocks; sleep in poll() until data arrives
+	while (bytes_read < len) {
+		int wait = -1;
+		if (timeout_us >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int64_t left = deadline - ((int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000);
+			// past the deadline, still take whatever is already there
+			wait = left > 0 ? (int) left : 0;
+		}
+		int ready = _WaitReadable(handle, wait);
+		if (ready < 0) {
+			comDevices[index].lost = 1;
 			return -1;
-
+		}
+		if (ready == 0)
+			break;
+
+		ssize_t res = read(handle, buffer + bytes_read, len - bytes_read);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			comDevices[index].lost = 1;
+			return -1;
+		}
+		// readable but nothing to read: the device went away
+		if (res == 0) {
+			comDevices[index].lost = 1;
+			return -1;
+		}
 		bytes_read += res;
-		bytes_left -= res;
-	} while (bytes_left > 0);
+	}
 
+	if (waiting) {
+		com->spin.waits++;
+		if (bytes_read == len)
+			_LearnSpin(com, (int) (_Micros(CLOCK_MONOTONIC) - start));
+	}
 	return bytes_read;
 }
 
+int comTransact(int index, const char * tx, size_t tx_len, char * rx, size_t rx_len, int timeout_us)
+{
+	if (index >= noDevices || index < 0)
+		return 0;
+	COMDevice * com = &comDevices[index];
+	if (com->handle <= 0)
+		return 0;
+#ifdef __linux__
+	// nothing to wait for without a reply, the plain write is as good
+	if (com->uring && rx_len > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int64_t start = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+		int res = _UringTransact(com->uring, tx, tx_len, rx, rx_len, timeout_us);
+		if (res == -1) {
+			com->lost = 1;
+			return -1;
+		}
+		if (res >= 0) {
+			if ((size_t) res == rx_len || (res == 0 && timeout_us >= 0))
+				return res;
+			// the reply came in pieces, wait for the rest until the same deadline
+			int left = timeout_us;
+			if (timeout_us >= 0) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				int64_t spent = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 - start;
+				left = spent < timeout_us ? timeout_us - (int) spent : 0;
+			}
+			int more = comReadTimeout(index, rx + res, rx_len - res, left);
+			return more < 0 ? -1 : res + more;
+		}
+	}
+#endif
+	int res = comWrite(index, tx, tx_len);
+	if (res < 0 && com->lost)
+		return -1;
+	if (!rx_len)
+		return 0;
+	return comReadTimeout(index, rx, rx_len, timeout_us);
+}
+
+void comSetSpinLimit(int index, int max_us)
+{
+	if (index >= noDevices || index < 0)
+		return;
+	COMDevice * com = &comDevices[index];
+	com->spinLimit = max_us > 0 ? max_us : 0;
+	// start spinning the whole way and learn from there
+	com->spinBudget = com->spinLimit;
+	com->recentCount = 0;
+	memset(&com->spin, 0, sizeof(com->spin));
+}
+
+int comGetSpinStats(int index, COMSpinStats * stats)
+{
+	if (index >= noDevices || index < 0)
+		return 0;
+	COMDevice * com = &comDevices[index];
+	*stats = com->spin;
+	stats->budgetUs = com->spinBudget;
+	return com->spinLimit > 0 || com->spin.spun > 0;
+}
+
+void comFlush(int index)
+{
+	if (index >= noDevices || index < 0)
+		return;
+	if (comDevices[index].handle <= 0)
+		return;
+	tcflush(comDevices[index].handle, TCIFLUSH);
+}
+
+int comWaitAny(const int * indices, int count, int timeout_us)
+{
+	#define COM_MAXWAIT    32
+	struct pollfd pfd[COM_MAXWAIT];
+	if (count > COM_MAXWAIT)
+		count = COM_MAXWAIT;
+	for (int i = 0; i < count; i++) {
+		int index = indices[i];
+		pfd[i].fd = (index >= 0 && index < noDevices && comDevices[index].handle > 0) ? comDevices[index].handle : -1;
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+	}
+
+	int res;
+	do {
+#ifdef __linux__
+		struct timespec ts;
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000;
+		res = ppoll(pfd, count, timeout_us < 0 ? NULL : &ts, NULL);
+#else
+		res = poll(pfd, count, timeout_us < 0 ? -1 : (timeout_us + 999) / 1000);
+#endif
+	} while (res < 0 && errno == EINTR);
+
+	if (res < 0)
+		return -1;
+	int mask = 0;
+	for (int i = 0; i < count; i++)
+		if (pfd[i].revents)
+			mask |= 1 << i;
+	return mask;
+}
+
 /*****************************************************************************/
 int _BaudFlag(int BaudRate)
 {
@@ -265,20 +640,291 @@ int _BaudFlag(int BaudRate)
 	}
 }
 
+int _SetBaudOther(int handle, int baudrate)
+{
+#ifdef __linux__
+	struct termios2 config;
+	if (ioctl(handle, TCGETS2, &config) < 0)
+		return -1;
+	config.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	config.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	config.c_ispeed = baudrate;
+	config.c_ospeed = baudrate;
+	return ioctl(handle, TCSETS2, &config);
+#else
+	return -1;
+#endif
+}
+
+int _GetBaudRate(int handle, int baudrate)
+{
+#ifdef __linux__
+	// what the driver actually made of it
+	struct termios2 config;
+	if (ioctl(handle, TCGETS2, &config) == 0 && config.c_ospeed)
+		return config.c_ospeed;
+#endif
+	return baudrate;
+}
+
+int _SetLowLatency(int handle, int * changed)
+{
+	*changed = 0;
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct serial;
+	if (ioctl(handle, TIOCGSERIAL, &serial) < 0)
+		return 0;
+	if (serial.flags & ASYNC_LOW_LATENCY)
+		return 1;
+	serial.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(handle, TIOCSSERIAL, &serial) < 0)
+		return 0;
+	*changed = 1;
+	// some drivers accept the flag without keeping it
+	if (ioctl(handle, TIOCGSERIAL, &serial) < 0)
+		return 0;
+	return (serial.flags & ASYNC_LOW_LATENCY) != 0;
+#else
+	(void) handle;
+	return 0;
+#endif
+}
+
+void _ClearLowLatency(int handle)
+{
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct serial;
+	if (ioctl(handle, TIOCGSERIAL, &serial) < 0)
+		return;
+	serial.flags &= ~ASYNC_LOW_LATENCY;
+	ioctl(handle, TIOCSSERIAL, &serial);
+#else
+	(void) handle;
+#endif
+}
+
+int _LatencyTimerPath(int index, char * path, size_t size)
+{
+#ifdef __linux__
+	// Follow symlinks like /dev/serial/by-id to the tty name
+	char * real = realpath(comGetInternalName(index), NULL);
+	if (!real)
+		return 0;
+	const char * name = strrchr(real, '/');
+	snprintf(path, size, "/sys/bus/usb-serial/devices/%s/latency_timer", name ? name + 1 : real);
+	free(real);
+	return access(path, F_OK) == 0;
+#else
+	return 0;
+#endif
+}
+
+int _ReadLatencyTimer(const char * path)
+{
+	int ms = -1;
+	FILE * file = fopen(path, "r");
+	if (!file)
+		return -1;
+	if (fscanf(file, "%d", &ms) != 1)
+		ms = -1;
+	fclose(file);
+	return ms;
+}
+
+int _WriteLatencyTimer(const char * path, int ms)
+{
+	FILE * file = fopen(path, "w");
+	if (!file)
+		return -1;
+	int res = fprintf(file, "%d\n", ms) > 0 ? 0 : -1;
+	if (fclose(file) != 0)
+		res = -1;
+	return res;
+}
+
+int _WaitReadable(int handle, int timeout_us)
+{
+	struct pollfd pfd;
+	pfd.fd = handle;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	int res;
+	do {
+#ifdef __linux__
+		struct timespec ts;
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000;
+		res = ppoll(&pfd, 1, timeout_us < 0 ? NULL : &ts, NULL);
+#else
+		res = poll(&pfd, 1, timeout_us < 0 ? -1 : (timeout_us + 999) / 1000);
+#endif
+	} while (res < 0 && errno == EINTR);
+
+	if (res <= 0)
+		return res;
+	if (!(pfd.revents & POLLIN))
+		return -1;
+	return 1;
+}
+
+int64_t _Micros(clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void _LearnSpin(COMDevice * com, int waited_us)
+{
+	com->recent[com->recentCount++ % COM_SPINSAMPLES] = waited_us;
+	if (!com->spinLimit || com->recentCount % (COM_SPINSAMPLES / 2))
+		return;
+
+	// sorted copy of the window
+	int count = com->recentCount < COM_SPINSAMPLES ? com->recentCount : COM_SPINSAMPLES;
+	int sorted[COM_SPINSAMPLES];
+	for (int i = 0; i < count; i++) {
+		int j = i;
+		for (; j > 0 && sorted[j - 1] > com->recent[i]; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = com->recent[i];
+	}
+
+	// most replies take longer than we may spin: sleep right away.
+	// Otherwise spin long enough to catch nine in ten, with some slack
+	int median = sorted[count / 2];
+	int p90 = sorted[count * 9 / 10];
+	if (median > com->spinLimit)
+		com->spinBudget = 0;
+	else
+		com->spinBudget = p90 + p90 / 4 < com->spinLimit ? p90 + p90 / 4 : com->spinLimit;
+}
+
 void _AppendDevices(const char * base)
 {
 	int baseLen = strlen(base);
 	struct dirent * dp;
 	// Enumerate devices
 	DIR * dirp = opendir("/dev");
+	if (!dirp)
+		return;
 	while ((dp = readdir(dirp)) && noDevices < COM_MAXDEVICES) {
 		if (strlen(dp->d_name) >= baseLen) {
-			if (memcmp(base, dp->d_name, baseLen) == 0) {
-				COMDevice * com = &comDevices[noDevices ++];
-				com->port = (char *) strdup(dp->d_name);
-				com->handle = -1;
+			if (memcmp(base, dp->d_name, baseLen) == 0)
+				_AddDevice(dp->d_name);
+		}
+	}
+	closedir(dirp);
+}
+
+int _MatchBase(const char * name)
+{
+	for (int i = 0; i < noBases; i++)
+		if (strncmp(name, devBases[i], strlen(devBases[i])) == 0)
+			return 1;
+	return 0;
+}
+
+int _AddDevice(const char * port)
+{
+	for (int i = 0; i < noDevices; i++)
+		if (strcmp(comDevices[i].port, port) == 0)
+			return i;
+	if (noDevices >= COM_MAXDEVICES)
+		return -1;
+	COMDevice * com = &comDevices[noDevices];
+	memset(com, 0, sizeof(COMDevice));
+	com->port = (char *) strdup(port);
+	com->handle = -1;
+	return noDevices ++;
+}
+
+/** Read a one line sysfs attribute */
+static int _ReadAttribute(const char * dir, const char * name, char * value, size_t size)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE * file = fopen(path, "r");
+	if (!file)
+		return 0;
+	int ok = fgets(value, size, file) != NULL;
+	fclose(file);
+	if (ok)
+		value[strcspn(value, "\r\n")] = 0;
+	return ok;
+}
+
+void _ScanSysfs()
+{
+	struct dirent * dp;
+	// One pass over the tty class, only ttys backed by a device
+	DIR * dirp = opendir("/sys/class/tty");
+	if (!dirp)
+		return;
+	while ((dp = readdir(dirp))) {
+		if (!_MatchBase(dp->d_name))
+			continue;
+		char path[512];
+		snprintf(path, sizeof(path), "/sys/class/tty/%s/device", dp->d_name);
+		char * device = realpath(path, NULL);
+		if (!device)
+			continue;
+		int index = _AddDevice(dp->d_name);
+		if (index < 0) {
+			free(device);
+			break;
+		}
+		// The USB device is a few levels up from the interface
+		COMDevice * com = &comDevices[index];
+		char value[128];
+		for (int level = 0; level < 4; level++) {
+			if (_ReadAttribute(device, "idVendor", value, sizeof(value))) {
+				com->vid = (int) strtol(value, NULL, 16);
+				if (_ReadAttribute(device, "idProduct", value, sizeof(value)))
+					com->pid = (int) strtol(value, NULL, 16);
+				if (_ReadAttribute(device, "serial", value, sizeof(value))) {
+					if (com->serial) free(com->serial);
+					com->serial = strdup(value);
+				}
+				break;
+			}
+			char * slash = strrchr(device, '/');
+			if (!slash || slash == device)
+				break;
+			*slash = 0;
+		}
+		free(device);
+	}
+	closedir(dirp);
+}
+
+void _ScanById()
+{
+	struct dirent * dp;
+	// Names move when a device comes back as another tty
+	for (int i = 0; i < noDevices; i++) {
+		if (comDevices[i].byId) free(comDevices[i].byId);
+		comDevices[i].byId = NULL;
+	}
+	DIR * dirp = opendir("/dev/serial/by-id");
+	if (!dirp)
+		return;
+	while ((dp = readdir(dirp))) {
+		if (dp->d_name[0] == '.')
+			continue;
+		char path[512];
+		snprintf(path, sizeof(path), "/dev/serial/by-id/%s", dp->d_name);
+		char * real = realpath(path, NULL);
+		if (!real)
+			continue;
+		for (int i = 0; i < noDevices; i++) {
+			if (strncmp(real, "/dev/", 5) == 0 && strcmp(real + 5, comDevices[i].port) == 0) {
+				if (comDevices[i].byId) free(comDevices[i].byId);
+				comDevices[i].byId = strdup(dp->d_name);
 			}
 		}
+		free(real);
 	}
 	closedir(dirp);
 }
@@ -0,0 +1,283 @@
+/*
+	Cross-platform serial / RS232 library
+	-> Linux io_uring backend of rs232-linux.c
+	-> rs232-uring.c
+
+	Same license as rs232-linux.c (MIT).
+
+	A transaction (request out, reply back) goes to the kernel as one
+	chain: write -> poll for input (with a linked timeout) -> read. The
+	port is a fixed file and the data moves through a registered buffer,
+	so one io_uring_enter submits it and waits for it. With SQPOLL a
+	kernel thread picks the chain up and a reply that comes quickly is
+	reaped from the ring without any system call, at the cost of a busy
+	core.
+	Talks to the kernel directly, no liburing.
+*/
+
+#if defined(__linux__)
+
+#include "rs232.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define URING_ENTRIES	8
+#define URING_TX		0			// offsets in the registered buffer
+#define URING_RX		128
+#define URING_BUFFER	256
+#define URING_IDLE		2000		// ms before the SQPOLL thread sleeps
+#define URING_SPIN		50			// us to watch the completion ring before sleeping on it
+
+enum { URING_WRITE, URING_POLL, URING_TIMEOUT, URING_READ, URING_CHAIN };
+
+typedef struct {
+	int ring;
+	int sqpoll;
+	void * sqMap;
+	void * cqMap;
+	size_t sqMapSize;
+	size_t cqMapSize;
+	struct io_uring_sqe * sqes;
+	size_t sqesSize;
+	unsigned * sqHead;
+	unsigned * sqTail;
+	unsigned * sqMask;
+	unsigned * sqFlags;
+	unsigned * sqArray;
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned * cqMask;
+	struct io_uring_cqe * cqes;
+	struct __kernel_timespec timeout;	// read by the kernel when the chain starts
+	unsigned char buffer[URING_BUFFER];	// registered
+} COMUring;
+
+/*****************************************************************************/
+static int _UringSetup(unsigned entries, struct io_uring_params * params)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int _UringEnter(int ring, unsigned submit, unsigned complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, ring, submit, complete, flags, NULL, 0);
+}
+
+static int _UringRegister(int ring, unsigned opcode, void * arg, unsigned count)
+{
+	return (int) syscall(__NR_io_uring_register, ring, opcode, arg, count);
+}
+
+static int64_t _UringMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void _UringClose(void * uring)
+{
+	COMUring * u = uring;
+	if (!u)
+		return;
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqesSize);
+	if (u->cqMap && u->cqMap != MAP_FAILED && u->cqMap != u->sqMap)
+		munmap(u->cqMap, u->cqMapSize);
+	if (u->sqMap && u->sqMap != MAP_FAILED)
+		munmap(u->sqMap, u->sqMapSize);
+	if (u->ring >= 0)
+		close(u->ring);
+	free(u);
+}
+
+/* Set up a ring for the port behind handle, NULL if the kernel won't (errno tells why) */
+void * _UringOpen(int handle, int sqpoll)
+{
+	COMUring * u = calloc(1, sizeof(COMUring));
+	if (!u)
+		return NULL;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	if (sqpoll) {
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = URING_IDLE;
+	}
+	u->sqpoll = sqpoll;
+	u->ring = _UringSetup(URING_ENTRIES, &params);
+	if (u->ring < 0) {
+		free(u);
+		return NULL;
+	}
+
+	// the rings, in one mapping on any kernel that has everything used here
+	u->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	u->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cqMapSize > u->sqMapSize)
+			u->sqMapSize = u->cqMapSize;
+		u->cqMapSize = u->sqMapSize;
+	}
+	u->sqMap = mmap(NULL, u->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring, IORING_OFF_SQ_RING);
+	if (u->sqMap == MAP_FAILED)
+		goto fail;
+	u->cqMap = (params.features & IORING_FEAT_SINGLE_MMAP) ? u->sqMap
+		: mmap(NULL, u->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring, IORING_OFF_CQ_RING);
+	if (u->cqMap == MAP_FAILED)
+		goto fail;
+	u->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	unsigned char * sq = u->sqMap;
+	unsigned char * cq = u->cqMap;
+	u->sqHead = (unsigned *) (sq + params.sq_off.head);
+	u->sqTail = (unsigned *) (sq + params.sq_off.tail);
+	u->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+	u->sqFlags = (unsigned *) (sq + params.sq_off.flags);
+	u->sqArray = (unsigned *) (sq + params.sq_off.array);
+	u->cqHead = (unsigned *) (cq + params.cq_off.head);
+	u->cqTail = (unsigned *) (cq + params.cq_off.tail);
+	u->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	// the port as fixed file 0, the buffer as fixed buffer 0
+	struct iovec iov = { u->buffer, sizeof(u->buffer) };
+	if (_UringRegister(u->ring, IORING_REGISTER_FILES, &handle, 1) < 0
+		|| _UringRegister(u->ring, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+		goto fail;
+
+	return u;
+
+fail:
+	{
+		int error = errno;
+		_UringClose(u);
+		errno = error;
+	}
+	return NULL;
+}
+
+static struct io_uring_sqe * _UringSqe(COMUring * u, unsigned tail, int op, int flags, unsigned long long data)
+{
+	unsigned slot = tail & *u->sqMask;
+	struct io_uring_sqe * sqe = &u->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = (unsigned char) op;
+	sqe->flags = (unsigned char) flags;
+	sqe->user_data = data;
+	u->sqArray[slot] = slot;
+	return sqe;
+}
+
+/* Reap the completions of the chain into res, returns how many there were */
+static int _UringReap(COMUring * u, int * res)
+{
+	unsigned head = *u->cqHead;
+	unsigned tail = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE);
+	int count = 0;
+
+	for (; head != tail; head++, count++) {
+		struct io_uring_cqe * cqe = &u->cqes[head & *u->cqMask];
+		if (cqe->user_data < URING_CHAIN)
+			res[cqe->user_data] = cqe->res;
+	}
+	__atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/* Write tx, wait at most timeout_us for input, read up to rx_len of it.
+ * Returns the bytes read, -1 on an error, -2 if it doesn't fit in the
+ * registered buffer (the caller does it the plain way then). */
+int _UringTransact(void * uring, const char * tx, size_t tx_len, char * rx, size_t rx_len, int timeout_us)
+{
+	COMUring * u = uring;
+	int res[URING_CHAIN];
+
+	if (tx_len > URING_RX - URING_TX || rx_len > URING_BUFFER - URING_RX)
+		return -2;
+
+	memcpy(u->buffer + URING_TX, tx, tx_len);
+	// forever is an hour, the chain needs a timeout to stay linked
+	u->timeout.tv_sec = timeout_us < 0 ? 3600 : timeout_us / 1000000;
+	u->timeout.tv_nsec = timeout_us < 0 ? 0 : (timeout_us % 1000000) * 1000;
+	for (int i = 0; i < URING_CHAIN; i++)
+		res[i] = -ECANCELED;
+
+	unsigned tail = *u->sqTail;
+	struct io_uring_sqe * sqe;
+
+	sqe = _UringSqe(u, tail++, IORING_OP_WRITE_FIXED, IOSQE_FIXED_FILE | IOSQE_IO_LINK, URING_WRITE);
+	sqe->addr = (unsigned long long) (uintptr_t) (u->buffer + URING_TX);
+	sqe->len = (unsigned) tx_len;
+
+	// tty reads don't wait with VMIN = 0, so wait for input first
+	sqe = _UringSqe(u, tail++, IORING_OP_POLL_ADD, IOSQE_FIXED_FILE | IOSQE_IO_LINK, URING_POLL);
+	sqe->poll32_events = POLLIN;
+
+	sqe = _UringSqe(u, tail++, IORING_OP_LINK_TIMEOUT, IOSQE_IO_LINK, URING_TIMEOUT);
+	sqe->addr = (unsigned long long) (uintptr_t) &u->timeout;
+	sqe->len = 1;
+
+	sqe = _UringSqe(u, tail++, IORING_OP_READ_FIXED, IOSQE_FIXED_FILE, URING_READ);
+	sqe->addr = (unsigned long long) (uintptr_t) (u->buffer + URING_RX);
+	sqe->len = (unsigned) rx_len;
+
+	__atomic_store_n(u->sqTail, tail, __ATOMIC_RELEASE);
+
+	int reaped = 0;
+	if (u->sqpoll) {
+		// the kernel thread takes the chain, only wake it if it went to sleep
+		if (__atomic_load_n(u->sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+			_UringEnter(u->ring, 0, 0, IORING_ENTER_SQ_WAKEUP);
+		// a reply that is quick to come is picked up without a system call,
+		// then wait in the kernel so the spinning doesn't starve the others
+		int64_t spin = _UringMicros() + URING_SPIN;
+		while (reaped < URING_CHAIN) {
+			reaped += _UringReap(u, res);
+			if (reaped == URING_CHAIN || _UringMicros() < spin)
+				continue;
+			if (_UringEnter(u->ring, 0, URING_CHAIN - reaped, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				return -1;
+		}
+	} else {
+		int submitted = 0;
+		while (reaped < URING_CHAIN) {
+			int ret = _UringEnter(u->ring, URING_CHAIN - submitted, URING_CHAIN - reaped, IORING_ENTER_GETEVENTS);
+			if (ret < 0 && errno != EINTR)
+				return -1;
+			if (ret > 0)
+				submitted += ret;
+			reaped += _UringReap(u, res);
+		}
+	}
+
+	if (res[URING_WRITE] < 0 && res[URING_WRITE] != -ECANCELED)
+		return -1;
+	// timed out without input, the read was cancelled
+	if (res[URING_POLL] == -ECANCELED || res[URING_POLL] == -ETIME)
+		return 0;
+	if (res[URING_POLL] < 0 || !(res[URING_POLL] & POLLIN))
+		return -1;
+	// readable but nothing to read: the device went away
+	if (res[URING_READ] <= 0)
+		return res[URING_READ] == -EAGAIN ? 0 : -1;
+
+	memcpy(rx, u->buffer + URING_RX, res[URING_READ]);
+	return res[URING_READ];
+}
+
+#endif // __linux__
@@ -45,6 +45,8 @@ typedef int        bool;
 typedef struct {
 	int port;
 	void * handle;
+	int timeout;
+	volatile int lost;
 } COMDevice;
 
 /*****************************************************************************/
@@ -80,14 +82,20 @@ int comEnumerate()
 		SetLastError(0);
 		QueryDosDeviceA(NULL, list, size);
 	}
-	// Gather all COM ports
+	// Gather all COM ports, known ones keep their index (and open handle)
 	int port;
 	const char * nlist = findPattern(list, comPtn, &port);
-	noDevices = 0;
-	while(port > 0 && noDevices < COM_MAXDEVICES) {
-		COMDevice * com = &comDevices[noDevices ++];
-		com->port = port;
-		com->handle    = 0;
+	while(port > 0) {
+		int known = 0;
+		for (int i = 0; i < noDevices; i++)
+			if (comDevices[i].port == port)
+				known = 1;
+		if (!known && noDevices < COM_MAXDEVICES) {
+			COMDevice * com = &comDevices[noDevices ++];
+			memset(com, 0, sizeof(COMDevice));
+			com->port = port;
+			com->handle    = 0;
+		}
 		nlist = findPattern(nlist, comPtn, &port);
 	}
 	free(list);
@@ -123,6 +131,16 @@ int comFindPort(const char * name)
 	return -1;
 }
 
+const char * comGetPortId(int index)
+{
+	return NULL;
+}
+
+int comGetUsbInfo(int index, int * vid, int * pid, const char ** serial)
+{
+	return 0;
+}
+
 const char * comGetInternalName(int index)
 {
 	#define COM_MAXNAME    32
@@ -148,6 +166,8 @@ int comOpen(int index, int baudrate)
 	if (handle == INVALID_HANDLE_VALUE) 
 		return 0;
 	com->handle = handle;
+	com->lost = 0;
+	com->timeout = -1;
 	// Prepare read / write timeouts
 	SetupComm(handle, 64, 64);
 	timeouts.ReadIntervalTimeout = 0;
@@ -181,6 +201,42 @@ void comClose(int index)
 	com->handle = 0;
 }
 
+int comGetBaudRate(int index)
+{
+	DCB config;
+	if (index < 0 || index >= noDevices)
+		return 0;
+	COMDevice * com = &comDevices[index];
+	if (!com->handle || !GetCommState(com->handle, &config))
+		return 0;
+	return config.BaudRate;
+}
+
+int comGetLowLatency(int index)
+{
+	// no such knob on Windows, FTDI latency is set in the driver properties
+	return 0;
+}
+
+void comSetLatencyTimer(int ms)
+{
+}
+
+int comGetLatencyTimer(int index)
+{
+	return -1;
+}
+
+void comSetBackend(int backend)
+{
+	// io_uring is Linux only
+}
+
+int comGetBackend(int index)
+{
+	return COM_BACKEND_POLL;
+}
+
 void comCloseAll()
 {
 	for (int i = 0; i < noDevices; i++)
@@ -194,20 +250,115 @@ int comWrite(int index, const char * buffer, size_t len)
 		return 0;
 	COMDevice * com = &comDevices[index];
 	uint32_t bytes = 0;
-	WriteFile(com->handle, buffer, len, &bytes, NULL);
+	if (!WriteFile(com->handle, buffer, len, &bytes, NULL))
+		com->lost = 1;
 	return bytes;
 }
 
+int comIsLost(int index)
+{
+	if (index < 0 || index >= noDevices)
+		return 0;
+	return comDevices[index].lost;
+}
+
+int comGetHandle(int index)
+{
+	return -1;
+}
+
 int comRead(int index, char * buffer, size_t len)
 {
 	if (index < 0 || index >= noDevices)
 		return 0;
 	COMDevice * com = &comDevices[index];
+	if (com->timeout != -1)
+		return comReadTimeout(index, buffer, len, -1);
 	uint32_t bytes = 0;
 	ReadFile(com->handle, buffer, len, &bytes, NULL);
 	return bytes;
 }
 
+int comReadTimeout(int index, char * buffer, size_t len, int timeout_us)
+{
+	if (index < 0 || index >= noDevices)
+		return 0;
+	COMDevice * com = &comDevices[index];
+	if (timeout_us < 0) timeout_us = -1;
+	// Only touch the driver when the deadline changes
+	if (com->timeout != timeout_us) {
+		COMMTIMEOUTS timeouts;
+		memset(&timeouts, 0, sizeof(timeouts));
+		if (timeout_us == 0) {
+			timeouts.ReadIntervalTimeout = MAXDWORD;
+		}else if (timeout_us > 0) {
+			timeouts.ReadTotalTimeoutConstant = (timeout_us + 999) / 1000;
+		}
+		SetCommTimeouts(com->handle, &timeouts);
+		com->timeout = timeout_us;
+	}
+	uint32_t bytes = 0;
+	if (!ReadFile(com->handle, buffer, len, &bytes, NULL)) {
+		com->lost = 1;
+		return -1;
+	}
+	return bytes;
+}
+
+int comTransact(int index, const char * tx, size_t tx_len, char * rx, size_t rx_len, int timeout_us)
+{
+	if ((size_t) comWrite(index, tx, tx_len) != tx_len && comIsLost(index))
+		return -1;
+	if (!rx_len)
+		return 0;
+	return comReadTimeout(index, rx, rx_len, timeout_us);
+}
+
+void comSetSpinLimit(int index, int max_us)
+{
+	// ReadFile waits in the driver
+}
+
+int comGetSpinStats(int index, COMSpinStats * stats)
+{
+	memset(stats, 0, sizeof(COMSpinStats));
+	return 0;
+}
+
+void comFlush(int index)
+{
+	if (index < 0 || index >= noDevices)
+		return;
+	COMDevice * com = &comDevices[index];
+	PurgeComm(com->handle, PURGE_RXCLEAR);
+}
+
+int comWaitAny(const int * indices, int count, int timeout_us)
+{
+	DWORD start = GetTickCount();
+	if (count > 32)
+		count = 32;
+	// Serial handles can't be waited on together without overlapped I/O,
+	// check the input queues until something shows up
+	while (1) {
+		int mask = 0;
+		for (int i = 0; i < count; i++) {
+			int index = indices[i];
+			if (index < 0 || index >= noDevices)
+				continue;
+			COMSTAT stat;
+			DWORD errors;
+			if (!ClearCommError(comDevices[index].handle, &errors, &stat) || stat.cbInQue > 0)
+				mask |= 1 << i;
+		}
+		if (mask || timeout_us == 0)
+			return mask;
+		if (timeout_us > 0 && (int) (GetTickCount() - start) * 1000 >= timeout_us)
+			return 0;
+		Sleep(0);
+	}
+}
+
 /*****************************************************************************/
 const char * findPattern(const char * string, const char * pattern, int * value)
 {
@@ -107,6 +107,25 @@ extern "C" {
      */        
     int comFindPort(const char * name);
 
+    /**
+     * \fn const char * comGetPortId(int index)
+     * \brief Get the stable /dev/serial/by-id name of a port
+     * \param[in] index port index
+     * \return by-id name (without the directory), NULL if there is none
+     */
+    const char * comGetPortId(int index);
+
+    /**
+     * \fn int comGetUsbInfo(int index, int * vid, int * pid, const char ** serial)
+     * \brief Get the USB ids of a port
+     * \param[in] index port index
+     * \param[out] vid vendor id
+     * \param[out] pid product id
+     * \param[out] serial serial number string, NULL if the device has none
+     * \return 1 if the port is a USB device, 0 if not
+     */
+    int comGetUsbInfo(int index, int * vid, int * pid, const char ** serial);
+
 /*****************************************************************************/
     /**
      * \fn int comOpen(int index, int baudrate)
@@ -131,6 +150,59 @@ extern "C" {
      */            
     void comCloseAll();
 
+    /**
+     * \fn int comGetBaudRate(int index)
+     * \brief Baudrate the driver actually set on an opened port
+     * \param[in] index port index
+     * \return baudrate, 0 if the port is not open
+     */
+    int comGetBaudRate(int index);
+
+    /**
+     * \fn int comGetLowLatency(int index)
+     * \brief Whether the driver runs an opened port in low latency mode
+     * \param[in] index port index
+     * \return 1 if low latency is on, 0 if it is off or not supported
+     */
+    int comGetLowLatency(int index);
+
+    /**
+     * \fn void comSetLatencyTimer(int ms)
+     * \brief Latency timer to set on USB-serial bridges (FTDI, CH340...) at comOpen
+     * \brief The old value is restored at comClose
+     * \param[in] ms latency in milliseconds, 0 to leave the bridges alone
+     */
+    void comSetLatencyTimer(int ms);
+
+    /**
+     * \fn int comGetLatencyTimer(int index)
+     * \brief Latency timer in effect on an opened USB-serial bridge
+     * \param[in] index port index
+     * \return latency in milliseconds, -1 if the port has no latency timer
+     */
+    int comGetLatencyTimer(int index);
+
+    /** Ways a port can move its data, see comSetBackend */
+    #define COM_BACKEND_POLL          0   /**< write(), poll(), read() */
+    #define COM_BACKEND_URING         1   /**< one io_uring_enter per transaction (Linux) */
+    #define COM_BACKEND_URING_SQPOLL  2   /**< io_uring with a kernel polling thread, no system calls (Linux) */
+
+    /**
+     * \fn void comSetBackend(int backend)
+     * \brief Backend for the ports opened from now on
+     * \brief Ports fall back to COM_BACKEND_POLL if the kernel can't do the one asked for
+     * \param[in] backend one of the COM_BACKEND_ values
+     */
+    void comSetBackend(int backend);
+
+    /**
+     * \fn int comGetBackend(int index)
+     * \brief Backend an opened port actually uses
+     * \param[in] index port index
+     * \return one of the COM_BACKEND_ values
+     */
+    int comGetBackend(int index);
+
 /*****************************************************************************/
     /**
      * \fn int comWrite(int index, const char * buffer, size_t len)
@@ -152,6 +224,93 @@ extern "C" {
      */                
     int comRead(int index, char * buffer, size_t len);
 
+    /**
+     * \fn int comReadTimeout(int index, char * buffer, size_t len, int timeout_us)
+     * \brief Read data from the port, waiting at most timeout_us for it to arrive
+     * \param[in] index port index
+     * \param[in] buffer pointer to receive buffer
+     * \param[in] len length of receive buffer in bytes
+     * \param[in] timeout_us deadline in microseconds for the whole read, negative to wait forever
+     * \return number of bytes transferred (less than len on timeout), -1 on error
+     */
+    int comReadTimeout(int index, char * buffer, size_t len, int timeout_us);
+
+    /**
+     * \fn int comTransact(int index, const char * tx, size_t tx_len, char * rx, size_t rx_len, int timeout_us)
+     * \brief Write a request and read its reply, like comWrite followed by comReadTimeout
+     * \brief With an io_uring backend both go to the kernel at once
+     * \param[in] index port index
+     * \param[in] tx pointer to the request
+     * \param[in] tx_len length of the request in bytes
+     * \param[out] rx pointer to the reply buffer
+     * \param[in] rx_len length of the reply in bytes
+     * \param[in] timeout_us deadline in microseconds for the reply, negative to wait forever
+     * \return number of bytes read (less than rx_len on timeout), -1 on error
+     */
+    int comTransact(int index, const char * tx, size_t tx_len, char * rx, size_t rx_len, int timeout_us);
+
+    /** Spin-then-block counters of a port, see comSetSpinLimit */
+    typedef struct {
+        uint64_t waits;         /**< reads that had to wait for data */
+        uint64_t spun;          /**< of these, how many spun first */
+        uint64_t caught;        /**< of these, how many got all their data while spinning */
+        uint64_t spinUs;        /**< time spent spinning in microseconds */
+        uint64_t spinCpuUs;     /**< CPU time spent spinning in microseconds */
+        int budgetUs;           /**< spin budget in effect, learned from recent waits */
+    } COMSpinStats;
+
+    /**
+     * \fn void comSetSpinLimit(int index, int max_us)
+     * \brief Let comReadTimeout spin on non-blocking reads before sleeping in poll()
+     * \brief The budget follows the recent waits of the port, up to max_us
+     * \brief Also clears the counters
+     * \param[in] index port index
+     * \param[in] max_us longest spin in microseconds, 0 to always sleep
+     */
+    void comSetSpinLimit(int index, int max_us);
+
+    /**
+     * \fn int comGetSpinStats(int index, COMSpinStats * stats)
+     * \brief Get the spin-then-block counters of a port
+     * \param[in] index port index
+     * \param[out] stats counters
+     * \return 1 if the port spins or has spun, 0 if not
+     */
+    int comGetSpinStats(int index, COMSpinStats * stats);
+
+    /**
+     * \fn void comFlush(int index)
+     * \brief Discard any received data that has not been read yet
+     * \param[in] index port index
+     */
+    void comFlush(int index);
+
+    /**
+     * \fn int comIsLost(int index)
+     * \brief Check if the device of an open port went away (hangup or I/O error)
+     * \param[in] index port index
+     * \return 1 if the port has to be closed and opened again, 0 if not
+     */
+    int comIsLost(int index);
+
+    /**
+     * \fn int comGetHandle(int index)
+     * \brief Get the file descriptor of an open port, to wait on it with poll() next to other descriptors
+     * \param[in] index port index
+     * \return file descriptor, -1 if the port is closed or there is none (Windows)
+     */
+    int comGetHandle(int index);
+
+    /**
+     * \fn int comWaitAny(const int * indices, int count, int timeout_us)
+     * \brief Wait until at least one of several ports has data to read
+     * \param[in] indices port indices to wait on (at most 32)
+     * \param[in] count number of ports
+     * \param[in] timeout_us max time to wait in microseconds, negative to wait forever
+     * \return bit mask of ready ports (bit i for indices[i]), 0 on timeout, -1 on error
+     */
+    int comWaitAny(const int * indices, int count, int timeout_us);
+
 #ifdef __cplusplus
 }
 #endif
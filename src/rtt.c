@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtt.h"
+
+static int RttCompare(const void *a, const void *b)
+{
+	return *(const int32_t *) a - *(const int32_t *) b;
+}
+
+void RttInit(SRttTracker *rtt, int cap_us)
+{
+	memset(rtt, 0, sizeof(SRttTracker));
+	rtt->cap = cap_us;
+	// until we have measured anything, wait as long as we are allowed to
+	rtt->deadline = cap_us;
+}
+
+static void RttAdd(SRttTracker *rtt, int64_t us)
+{
+	rtt->samples[rtt->next] = (int32_t) (us > INT32_MAX ? INT32_MAX : us);
+	rtt->next = (rtt->next + 1) % RTT_SAMPLES;
+	if (rtt->count < RTT_SAMPLES)
+		rtt->count++;
+}
+
+void RttRecord(SRttTracker *rtt, int64_t us)
+{
+	RttAdd(rtt, us);
+
+	if (rtt->count < RTT_UPDATE || rtt->next % RTT_UPDATE != 0)
+		return;
+
+	int32_t sorted[RTT_SAMPLES];
+	memcpy(sorted, rtt->samples, rtt->count * sizeof(int32_t));
+	qsort(sorted, rtt->count, sizeof(int32_t), RttCompare);
+
+	rtt->p50 = sorted[rtt->count / 2];
+	rtt->p99 = sorted[(rtt->count * 99) / 100];
+
+	// twice the tail latency leaves room for a slow USB frame without
+	// waiting the full cap on every lost reply
+	int deadline = rtt->p99 * 2 + (rtt->p99 - rtt->p50);
+	if (deadline < RTT_MIN_DEADLINE)
+		deadline = RTT_MIN_DEADLINE;
+	if (deadline > rtt->cap)
+		deadline = rtt->cap;
+	rtt->deadline = deadline;
+}
+
+void RttMiss(SRttTracker *rtt)
+{
+	// the reply took at least that long, the next recomputation takes it into account
+	RttAdd(rtt, rtt->deadline);
+
+	int deadline = rtt->deadline * 2;
+	rtt->deadline = deadline > rtt->cap ? rtt->cap : deadline;
+}
@@ -0,0 +1,41 @@
+#ifndef __RTT_H__
+#define __RTT_H__
+
+#include <stdint.h>
+
+/* Round trip time tracker used to size the read deadline of a port.
+ *
+ * Keeps the last RTT_SAMPLES successful transaction times and derives the
+ * deadline from their percentiles, capped by the configured hard limit.
+ * A miss doubles the deadline, toward the cap. Controllers keep one per
+ * RTT_CLASSES, a pak read moves eight times the bytes of a state poll.
+ * Not thread safe, callers hold the controller lock. */
+
+#define RTT_SAMPLES		64
+#define RTT_UPDATE		16		// recompute the deadline every N samples
+#define RTT_MIN_DEADLINE	1000	// never wait less than this (us)
+#define RTT_CLASSES		2		// short transactions (state, info, reset) and pak reads and writes
+#define RTT_LONG		16		// bytes on the wire from which a transaction is a long one
+
+#define RttClass(bytes) ((bytes) >= RTT_LONG)
+
+typedef struct
+{
+	int32_t samples[RTT_SAMPLES];	// microseconds
+	int count;
+	int next;
+	int p50;
+	int p99;
+	int cap;			// hard deadline limit in microseconds
+	int deadline;		// current deadline in microseconds
+} SRttTracker;
+
+extern void RttInit(SRttTracker *rtt, int cap_us);
+extern void RttRecord(SRttTracker *rtt, int64_t us);
+
+/* A reply didn't arrive before the deadline */
+extern void RttMiss(SRttTracker *rtt);
+
+#define RttDeadline(rtt) ((rtt)->deadline)
+
+#endif // __RTT_H__
@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "plugin.h"
+#include "rumble.h"
+#include "iothread.h"
+#include "joybus.h"
+#include "transfer.h"
+
+#define RUMBLE_PROBE	0x8000	// reads back 0x80 on a Rumble Pak
+#define RUMBLE_MOTOR	0xC000
+
+#define RUMBLE_ID		0x80
+
+typedef struct
+{
+	mutex_t lock;
+	int enabled;
+	int present;		// 1 the pak identified as a Rumble Pak, 0 otherwise
+	int motor;			// motor state last accepted from the game, -1 unknown
+	int pending;		// motor holds a state the controller hasn't seen yet
+	unsigned int address;
+	volatile int64_t sent;
+	volatile int64_t suppressed;
+} SRumble;
+
+static SRumble l_Rumble[4];
+static int l_RumbleInit = 0;
+
+void RumbleReset(int index, int enabled)
+{
+	SRumble *rumble = &l_Rumble[index];
+
+	if (!l_RumbleInit)
+	{
+		for (int i = 0; i < 4; i++)
+			mutexInit(&l_Rumble[i].lock);
+		l_RumbleInit = 1;
+	}
+
+	mutexLock(&rumble->lock);
+	rumble->enabled = enabled;
+	rumble->present = 0;
+	rumble->motor = -1;
+	rumble->pending = 0;
+	atomicStore64(&rumble->sent, 0);
+	atomicStore64(&rumble->suppressed, 0);
+	mutexUnlock(&rumble->lock);
+}
+
+int RumbleHandle(int index, unsigned char *cmd)
+{
+	SRumble *rumble = &l_Rumble[index];
+	int handled = 0;
+	int wake = 0;
+
+	if (!rumble->enabled || !JOYBUS_IS_PAK_WRITE(cmd))
+		return 0;
+
+	unsigned int address = JOYBUS_PAK_ADDRESS(cmd);
+	if (address < RUMBLE_MOTOR || !JOYBUS_PAK_ADDRESS_OK(cmd))
+		return 0;
+
+	const unsigned char *data = JOYBUS_PAK_DATA(cmd);
+	int motor = data[0] & 0x01;
+
+	mutexLock(&rumble->lock);
+	if (rumble->present)
+	{
+		if (motor == rumble->motor)
+			atomicAdd64(&rumble->suppressed, 1);
+		else
+		{
+			rumble->motor = motor;
+			rumble->address = address;
+			rumble->pending = 1;
+			wake = 1;
+		}
+
+		JOYBUS_RX_DATA(cmd)[0] = JoybusDataCrc(data);
+		handled = 1;
+	}
+	mutexUnlock(&rumble->lock);
+
+	if (wake)
+		IoThreadWake(index);
+
+	return handled;
+}
+
+void RumbleObserve(int index, const unsigned char *cmd)
+{
+	SRumble *rumble = &l_Rumble[index];
+
+	if (!rumble->enabled || (cmd[1] & JOYBUS_NO_RESPONSE))
+		return;
+
+	const unsigned char *rx = JOYBUS_RX_DATA(cmd);
+
+	if (JOYBUS_IS_INFO(cmd))
+	{
+		if (!(rx[2] & JOYBUS_STATUS_PAK) || (rx[2] & JOYBUS_STATUS_PAK_REMOVED))
+		{
+			mutexLock(&rumble->lock);
+			rumble->present = 0;
+			rumble->motor = -1;
+			rumble->pending = 0;
+			mutexUnlock(&rumble->lock);
+		}
+		return;
+	}
+
+	// games identify the pak by reading back the probe address
+	if (!JOYBUS_IS_PAK_READ(cmd) || JOYBUS_PAK_ADDRESS(cmd) != RUMBLE_PROBE || !JOYBUS_PAK_ADDRESS_OK(cmd))
+		return;
+
+	if (rx[JOYBUS_PAK_BLOCK] != JoybusDataCrc(rx))
+		return;
+
+	mutexLock(&rumble->lock);
+	rumble->present = rx[0] == RUMBLE_ID;
+	if (!rumble->present)
+	{
+		rumble->motor = -1;
+		rumble->pending = 0;
+	}
+	mutexUnlock(&rumble->lock);
+}
+
+int RumbleNext(int index, unsigned char *cmd)
+{
+	SRumble *rumble = &l_Rumble[index];
+	unsigned char data[JOYBUS_PAK_BLOCK];
+
+	if (!rumble->enabled)
+		return 0;
+
+	mutexLock(&rumble->lock);
+	if (!rumble->pending)
+	{
+		mutexUnlock(&rumble->lock);
+		return 0;
+	}
+	memset(data, rumble->motor, sizeof(data));
+	JoybusPakWrite(cmd, rumble->address, data);
+	rumble->pending = 0;
+	mutexUnlock(&rumble->lock);
+
+	return 1;
+}
+
+int RumbleDone(int index, unsigned char *cmd, int res)
+{
+	SRumble *rumble = &l_Rumble[index];
+	const unsigned char *data = JOYBUS_PAK_DATA(cmd);
+	int motor = data[0];
+	int ok = res == 1 && !(cmd[1] & JOYBUS_NO_RESPONSE) && JOYBUS_RX_DATA(cmd)[0] == JoybusDataCrc(data);
+
+	mutexLock(&rumble->lock);
+	if (res < 0 && rumble->motor == motor)
+		rumble->pending = 1;	// port busy, try again
+	else if (!ok && rumble->motor == motor)
+		rumble->motor = -1;		// don't know what the motor is doing, send the next write
+	mutexUnlock(&rumble->lock);
+
+	if (ok)
+		atomicAdd64(&rumble->sent, 1);
+
+	return ok ? 1 : -1;
+}
+
+void RumbleFlush(int index)
+{
+	SRumble *rumble = &l_Rumble[index];
+
+	if (!rumble->enabled)
+		return;
+
+	unsigned char cmd[2 + 35 + 1];
+	if (RumbleNext(index, cmd))
+		RumbleDone(index, cmd, ControllerTransfer(index, cmd));
+
+	if (atomicLoad64(&rumble->sent) || atomicLoad64(&rumble->suppressed))
+		DebugMessage(M64MSG_INFO, "Rumble Pak %i: %lld motor writes sent, %lld suppressed", index + 1,
+			(long long) atomicLoad64(&rumble->sent), (long long) atomicLoad64(&rumble->suppressed));
+
+	atomicStore64(&rumble->sent, 0);
+	atomicStore64(&rumble->suppressed, 0);
+}
+
+int64_t RumbleSuppressed(int index)
+{
+	return atomicLoad64(&l_Rumble[index].suppressed);
+}
@@ -0,0 +1,38 @@
+#ifndef __RUMBLE_H__
+#define __RUMBLE_H__
+
+#include <stdint.h>
+
+/* Fire-and-forget Rumble Pak writes.
+ *
+ * Once the controller has identified its pak as a Rumble Pak (0x80 read
+ * back from 0x8000), motor writes (Joybus 0x03 to 0xC000 and up) are
+ * acknowledged right away with a locally computed data CRC. Writes that
+ * change the motor state are sent by the I/O thread, the
+ * others are dropped and counted. */
+
+/* Reset the Rumble Pak state of a controller, enabling or disabling it */
+extern void RumbleReset(int index, int enabled);
+
+/* Try to answer a motor write locally.
+ * Returns 1 if cmd was handled, 0 if it has to go to the controller. */
+extern int RumbleHandle(int index, unsigned char *cmd);
+
+/* Learn from a transaction that went to the controller */
+extern void RumbleObserve(int index, const unsigned char *cmd);
+
+/* Background work for the I/O thread: RumbleNext fills cmd with a write of
+ * the newest motor state, returns 0 if the controller has seen it already.
+ * RumbleDone takes the result of sending it (-1 if the port was busy),
+ * returns 1 if the write went through, -1 otherwise. */
+extern int RumbleNext(int index, unsigned char *cmd);
+extern int RumbleDone(int index, unsigned char *cmd, int res);
+
+/* Send any motor state the controller hasn't seen yet from the calling
+ * thread, log and reset the counters */
+extern void RumbleFlush(int index);
+
+/* Number of motor writes dropped because they didn't change anything */
+extern int64_t RumbleSuppressed(int index);
+
+#endif // __RUMBLE_H__
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "plugin.h"
+#include "cadence.h"
+#include "rs232.h"
+#include "stats.h"
+#include "joybus.h"
+#include "transport.h"
+
+/* Buckets cover 0 us to 2^32 us: values below STATS_SUB get a bucket each,
+ * above that every power of two is split into STATS_SUB linear buckets,
+ * which keeps the error under 1 / STATS_SUB (~6%). */
+#define STATS_SUB_BITS	4
+#define STATS_SUB		(1 << STATS_SUB_BITS)
+#define STATS_BUCKETS	((32 - STATS_SUB_BITS + 1) * STATS_SUB)
+
+enum { STATS_INFO, STATS_STATE, STATS_PAK_READ, STATS_PAK_WRITE, STATS_RESET, STATS_OTHER, STATS_COMMANDS };
+
+static const char *l_StatsNames[STATS_COMMANDS] = { "info", "state", "pak_read", "pak_write", "reset", "other" };
+
+enum { STATS_POLL_EARLY, STATS_POLL_LATE, STATS_SAMPLE_AGE, STATS_POLLS };
+
+static const char *l_StatsPollNames[STATS_POLLS] = { "poll_early", "poll_late", "sample_age" };
+
+typedef struct
+{
+	volatile int32_t buckets[STATS_BUCKETS];
+	volatile int32_t max_us;
+	volatile int64_t count;
+	volatile int64_t bytes;
+	volatile int64_t timeouts;
+	volatile int64_t short_reads;
+	volatile int64_t retries;
+} SStatsHistogram;
+
+static SStatsHistogram l_Stats[4][STATS_COMMANDS];
+static SStatsHistogram l_TransportStats[TRANSPORTS];	// all commands, by transport
+static SStatsHistogram l_PollStats[4][STATS_POLLS];	// game polls against the cadence, stale samples are timeouts
+
+static int StatsCommand(unsigned char command)
+{
+	switch (command)
+	{
+		case JOYBUS_CMD_INFO:		return STATS_INFO;
+		case JOYBUS_CMD_STATE:		return STATS_STATE;
+		case JOYBUS_CMD_PAK_READ:	return STATS_PAK_READ;
+		case JOYBUS_CMD_PAK_WRITE:	return STATS_PAK_WRITE;
+		case JOYBUS_CMD_RESET:		return STATS_RESET;
+		default:					return STATS_OTHER;
+	}
+}
+
+static int StatsMsb(uint32_t v)
+{
+#ifdef _MSC_VER
+	unsigned long bit;
+	_BitScanReverse(&bit, v);
+	return (int) bit;
+#else
+	return 31 - __builtin_clz(v);
+#endif
+}
+
+static int StatsBucket(uint32_t us)
+{
+	if (us < STATS_SUB)
+		return (int) us;
+
+	int shift = StatsMsb(us) - STATS_SUB_BITS;
+	return (shift + 1) * STATS_SUB + (int) ((us >> shift) & (STATS_SUB - 1));
+}
+
+/* Highest value that lands in a bucket */
+static uint32_t StatsBucketTop(int bucket)
+{
+	if (bucket < STATS_SUB)
+		return (uint32_t) bucket;
+
+	int shift = bucket / STATS_SUB - 1;
+	uint64_t low = (uint64_t) (STATS_SUB + bucket % STATS_SUB) << shift;
+	return (uint32_t) (low + ((uint64_t) 1 << shift) - 1);
+}
+
+static uint32_t StatsPercentile(SStatsHistogram *h, int64_t count, int percent)
+{
+	uint32_t max = (uint32_t) atomicLoad32(&h->max_us);
+	int64_t rank = (count * percent + 99) / 100;
+	int64_t seen = 0;
+
+	for (int i = 0; i < STATS_BUCKETS; i++)
+	{
+		seen += atomicLoad32(&h->buckets[i]);
+		if (seen >= rank && seen > 0)
+			return StatsBucketTop(i) < max ? StatsBucketTop(i) : max;
+	}
+	return max;
+}
+
+/* Values in the buckets, what the percentiles are taken over */
+static int64_t StatsValues(SStatsHistogram *h)
+{
+	int64_t values = 0;
+
+	for (int b = 0; b < STATS_BUCKETS; b++)
+		values += atomicLoad32(&h->buckets[b]);
+	return values;
+}
+
+static void StatsValue(SStatsHistogram *h, int64_t us)
+{
+	uint32_t value = us < 0 ? 0 : (us > INT32_MAX ? INT32_MAX : (uint32_t) us);
+	atomicAdd32(&h->buckets[StatsBucket(value)], 1);
+
+	int32_t max = atomicLoad32(&h->max_us);
+	while ((int32_t) value > max && !atomicCas32(&h->max_us, max, (int32_t) value))
+		max = atomicLoad32(&h->max_us);
+}
+
+static void StatsAdd(SStatsHistogram *h, const unsigned char *cmd, int res, int64_t us)
+{
+	const int rx_len = JOYBUS_RX_LEN(cmd);
+
+	atomicAdd64(&h->count, 1);
+	atomicAdd64(&h->bytes, 2 + JOYBUS_TX_LEN(cmd) + (res > 0 ? res : 0));
+
+	if (res <= 0 && rx_len > 0)
+	{
+		atomicAdd64(&h->timeouts, 1);
+		return;
+	}
+	if (res < rx_len)
+	{
+		atomicAdd64(&h->short_reads, 1);
+		return;
+	}
+
+	StatsValue(h, us);
+}
+
+void StatsRecord(int index, const unsigned char *cmd, int res, int64_t us)
+{
+	const STransportOps *ops = controller[index].link ? controller[index].link->transport.ops : NULL;
+
+	StatsAdd(&l_Stats[index][StatsCommand(cmd[2])], cmd, res, us);
+	if (ops)
+		StatsAdd(&l_TransportStats[ops->kind], cmd, res, us);
+}
+
+void StatsRetry(int index, unsigned char command)
+{
+	atomicAdd64(&l_Stats[index][StatsCommand(command)].retries, 1);
+}
+
+void StatsPollOffset(int index, int64_t us)
+{
+	SStatsHistogram *h = &l_PollStats[index][us < 0 ? STATS_POLL_EARLY : STATS_POLL_LATE];
+
+	atomicAdd64(&h->count, 1);
+	StatsValue(h, us < 0 ? -us : us);
+}
+
+void StatsSampleAge(int index, int64_t us, int fresh)
+{
+	SStatsHistogram *h = &l_PollStats[index][STATS_SAMPLE_AGE];
+
+	atomicAdd64(&h->count, 1);
+	if (!fresh)
+	{
+		atomicAdd64(&h->timeouts, 1);
+		return;
+	}
+	StatsValue(h, us);
+}
+
+static void StatsLog(SStatsHistogram *h, const char *name)
+{
+	int64_t count = atomicLoad64(&h->count);
+	if (!count)
+		return;
+
+	int64_t replies = StatsValues(h);
+
+	DebugMessage(M64MSG_INFO, "%s: %lld transactions, p50 %u us, p90 %u us, p99 %u us, max %u us, "
+		"%lld bytes, %lld timeouts, %lld short reads, %lld retries",
+		name, (long long) count,
+		StatsPercentile(h, replies, 50), StatsPercentile(h, replies, 90), StatsPercentile(h, replies, 99),
+		(uint32_t) atomicLoad32(&h->max_us), (long long) atomicLoad64(&h->bytes), (long long) atomicLoad64(&h->timeouts),
+		(long long) atomicLoad64(&h->short_reads), (long long) atomicLoad64(&h->retries));
+}
+
+/* rs232 port whose spin counters controller i reports, the first
+   controller on a shared device has them */
+static int StatsSpinPort(int index)
+{
+	SLink *link = controller[index].link;
+
+	if (!link || link->transport.port < 0)
+		return -1;
+	for (int i = 0; i < index; i++)
+		if (controller[i].link == link)
+			return -1;
+	return link->transport.port;
+}
+
+void StatsReport(void)
+{
+	char name[64];
+
+	for (int i = 0; i < 4; i++)
+	{
+		for (int k = 0; k < STATS_COMMANDS; k++)
+		{
+			snprintf(name, sizeof(name), "Controller %i %s", i + 1, l_StatsNames[k]);
+			StatsLog(&l_Stats[i][k], name);
+		}
+	}
+
+	for (int t = 0; t < TRANSPORTS; t++)
+	{
+		snprintf(name, sizeof(name), "Transport %s", TransportName(t));
+		StatsLog(&l_TransportStats[t], name);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		COMSpinStats spin;
+		int port = StatsSpinPort(i);
+
+		if (port < 0 || !comGetSpinStats(port, &spin))
+			continue;
+
+		DebugMessage(M64MSG_INFO, "Controller %i spin wait: budget %i us, %llu waits, %llu spun, %llu caught spinning, "
+			"%llu us spinning, %llu us CPU", i + 1, spin.budgetUs, (unsigned long long) spin.waits, (unsigned long long) spin.spun,
+			(unsigned long long) spin.caught, (unsigned long long) spin.spinUs, (unsigned long long) spin.spinCpuUs);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		SStatsHistogram *early = &l_PollStats[i][STATS_POLL_EARLY];
+		SStatsHistogram *late = &l_PollStats[i][STATS_POLL_LATE];
+		SStatsHistogram *age = &l_PollStats[i][STATS_SAMPLE_AGE];
+		int64_t earlies = StatsValues(early), lates = StatsValues(late), ages = StatsValues(age);
+
+		if (!earlies && !lates && !atomicLoad64(&age->count))
+			continue;
+
+		DebugMessage(M64MSG_INFO, "Controller %i polls: every %i us, %i per period, jitter %i us, "
+			"%lld early p50 %u us p99 %u us, %lld late p50 %u us p99 %u us, sample age p50 %u us p99 %u us max %u us, %lld stale",
+			i + 1, CadencePeriod(i), CadencePolls(i), CadenceJitter(i),
+			(long long) earlies, StatsPercentile(early, earlies, 50), StatsPercentile(early, earlies, 99),
+			(long long) lates, StatsPercentile(late, lates, 50), StatsPercentile(late, lates, 99),
+			StatsPercentile(age, ages, 50), StatsPercentile(age, ages, 99), (uint32_t) atomicLoad32(&age->max_us),
+			(long long) atomicLoad64(&age->timeouts));
+	}
+}
+
+static void StatsWrite(FILE *file, SStatsHistogram *h, const char *key)
+{
+	if (!atomicLoad64(&h->count))
+		return;
+
+	fprintf(file, "total %s %lld %lld %lld %lld %lld %u\n", key,
+		(long long) atomicLoad64(&h->count), (long long) atomicLoad64(&h->bytes), (long long) atomicLoad64(&h->timeouts),
+		(long long) atomicLoad64(&h->short_reads), (long long) atomicLoad64(&h->retries), (uint32_t) atomicLoad32(&h->max_us));
+
+	for (int b = 0; b < STATS_BUCKETS; b++)
+	{
+		int32_t n = atomicLoad32(&h->buckets[b]);
+		if (n)
+			fprintf(file, "bucket %s %u %u %d\n", key, b ? StatsBucketTop(b - 1) + 1 : 0, StatsBucketTop(b), n);
+	}
+}
+
+int StatsDump(const char *path)
+{
+	char key[64];
+
+	FILE *file = fopen(path, "w");
+	if (!file)
+	{
+		DebugMessage(M64MSG_WARNING, "Couldn't write statistics to %s", path);
+		return 0;
+	}
+
+	fprintf(file, "# controller command count bytes timeouts short_reads retries max_us\n");
+	fprintf(file, "# controller command bucket_low_us bucket_high_us count\n");
+	fprintf(file, "# per transport the controller is the transport name and the command is all\n");
+	fprintf(file, "# spin controller budget_us waits spun caught spin_us spin_cpu_us\n");
+	fprintf(file, "# poll_early/poll_late are how far game polls were off the predicted time, sample_age the age\n");
+	fprintf(file, "# of the prefetched state they got, stale samples (direct reads) count as timeouts\n");
+	fprintf(file, "# cadence controller period_us polls jitter_us\n");
+
+	for (int i = 0; i < 4; i++)
+	{
+		for (int k = 0; k < STATS_COMMANDS; k++)
+		{
+			snprintf(key, sizeof(key), "%i %s", i + 1, l_StatsNames[k]);
+			StatsWrite(file, &l_Stats[i][k], key);
+		}
+	}
+
+	for (int t = 0; t < TRANSPORTS; t++)
+	{
+		snprintf(key, sizeof(key), "%s all", TransportName(t));
+		StatsWrite(file, &l_TransportStats[t], key);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		COMSpinStats spin;
+		int port = StatsSpinPort(i);
+
+		if (port >= 0 && comGetSpinStats(port, &spin))
+			fprintf(file, "spin %i %i %llu %llu %llu %llu %llu\n", i + 1, spin.budgetUs, (unsigned long long) spin.waits,
+				(unsigned long long) spin.spun, (unsigned long long) spin.caught, (unsigned long long) spin.spinUs, (unsigned long long) spin.spinCpuUs);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		for (int k = 0; k < STATS_POLLS; k++)
+		{
+			snprintf(key, sizeof(key), "%i %s", i + 1, l_StatsPollNames[k]);
+			StatsWrite(file, &l_PollStats[i][k], key);
+		}
+
+		if (CadencePeriod(i))
+			fprintf(file, "cadence %i %i %i %i\n", i + 1, CadencePeriod(i), CadencePolls(i), CadenceJitter(i));
+	}
+
+	fclose(file);
+	DebugMessage(M64MSG_INFO, "Wrote statistics to %s", path);
+	return 1;
+}
+
+void StatsReset(void)
+{
+	memset((void *) l_Stats, 0, sizeof(l_Stats));
+	memset((void *) l_TransportStats, 0, sizeof(l_TransportStats));
+	memset((void *) l_PollStats, 0, sizeof(l_PollStats));
+}
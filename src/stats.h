@@ -0,0 +1,41 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+/* Per-port, per-command transaction statistics.
+ *
+ * Every transaction that goes over a serial port lands in a log-linear
+ * (HDR style) latency histogram keyed by controller and Joybus command
+ * byte, next to counters for bytes moved, timeouts, short reads and
+ * retries. A second set is kept per transport (serial, tcp, ...) so they
+ * can be compared. The spin-then-block counters of the serial ports
+ * (SpinWait) are reported with them, and so is how far the game's state
+ * polls land from the time the poll cadence predicts and how old the
+ * prefetched state they got was (PrefetchAlign). Recording is a handful of atomic adds, no locks and no
+ * allocation, so it is always on. */
+
+/* Record a finished transaction: cmd is the channel block, res the number
+ * of reply bytes received and us the round trip time */
+extern void StatsRecord(int index, const unsigned char *cmd, int res, int64_t us);
+
+/* Count a command that had to be sent again */
+extern void StatsRetry(int index, unsigned char command);
+
+/* A state poll came us after the predicted time (negative if before) */
+extern void StatsPollOffset(int index, int64_t us);
+
+/* A state poll got a prefetched sample us old, fresh 0 if it was too old
+ * and the state was read directly */
+extern void StatsSampleAge(int index, int64_t us, int fresh);
+
+/* Log a p50/p90/p99/max summary of every port and command seen */
+extern void StatsReport(void);
+
+/* Write the counters and the non-empty histogram buckets to a file */
+extern int StatsDump(const char *path);
+
+/* Clear everything */
+extern void StatsReset(void);
+
+#endif // __STATS_H__
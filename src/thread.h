@@ -0,0 +1,125 @@
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+#include <stdint.h>
+
+/* Minimal threading and atomics layer shared by the plugin's I/O code.
+ * Only what the plugin needs: worker threads with join, plain mutexes,
+ * condition variables to wake idle workers and word-sized atomics for
+ * lock-free hand-off between threads. */
+
+#ifdef _WIN32
+#include <Windows.h>
+
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+#define THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN return 0
+
+static __inline int threadCreate(thread_t *thread, LPTHREAD_START_ROUTINE func, void *arg)
+{
+	*thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+	return *thread != NULL;
+}
+
+static __inline void threadJoin(thread_t thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static __inline void threadYield(void)				{ SwitchToThread(); }
+
+static __inline void mutexInit(mutex_t *m)			{ InitializeCriticalSection(m); }
+static __inline void mutexDestroy(mutex_t *m)		{ DeleteCriticalSection(m); }
+static __inline void mutexLock(mutex_t *m)			{ EnterCriticalSection(m); }
+static __inline int mutexTryLock(mutex_t *m)		{ return TryEnterCriticalSection(m) != 0; }
+static __inline void mutexUnlock(mutex_t *m)		{ LeaveCriticalSection(m); }
+
+static __inline void condInit(cond_t *c)			{ InitializeConditionVariable(c); }
+static __inline void condDestroy(cond_t *c)			{ (void) c; }
+static __inline void condSignal(cond_t *c)			{ WakeConditionVariable(c); }
+
+/* Wait for a signal or until timeout_us passed, mutex must be held */
+static __inline void condWait(cond_t *c, mutex_t *m, int64_t timeout_us)
+{
+	SleepConditionVariableCS(c, m, (DWORD) ((timeout_us + 999) / 1000));
+}
+
+static __inline int32_t atomicLoad32(volatile int32_t *p)				{ return InterlockedCompareExchange((volatile LONG *) p, 0, 0); }
+static __inline void atomicStore32(volatile int32_t *p, int32_t v)		{ InterlockedExchange((volatile LONG *) p, v); }
+static __inline int32_t atomicAdd32(volatile int32_t *p, int32_t v)		{ return InterlockedExchangeAdd((volatile LONG *) p, v) + v; }
+static __inline int64_t atomicLoad64(volatile int64_t *p)				{ return InterlockedCompareExchange64(p, 0, 0); }
+static __inline void atomicStore64(volatile int64_t *p, int64_t v)		{ InterlockedExchange64(p, v); }
+static __inline int64_t atomicAdd64(volatile int64_t *p, int64_t v)		{ return InterlockedExchangeAdd64(p, v) + v; }
+static __inline int atomicCas32(volatile int32_t *p, int32_t expected, int32_t v)	{ return InterlockedCompareExchange((volatile LONG *) p, v, expected) == expected; }
+
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+#define THREAD_FUNC(name) void *name(void *arg)
+#define THREAD_RETURN return NULL
+
+static inline int threadCreate(thread_t *thread, void *(*func)(void *), void *arg)
+{
+	return pthread_create(thread, NULL, func, arg) == 0;
+}
+
+static inline void threadJoin(thread_t thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static inline void threadYield(void)				{ sched_yield(); }
+
+static inline void mutexInit(mutex_t *m)			{ pthread_mutex_init(m, NULL); }
+static inline void mutexDestroy(mutex_t *m)			{ pthread_mutex_destroy(m); }
+static inline void mutexLock(mutex_t *m)			{ pthread_mutex_lock(m); }
+static inline int mutexTryLock(mutex_t *m)			{ return pthread_mutex_trylock(m) == 0; }
+static inline void mutexUnlock(mutex_t *m)			{ pthread_mutex_unlock(m); }
+
+static inline void condInit(cond_t *c)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(c, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static inline void condDestroy(cond_t *c)			{ pthread_cond_destroy(c); }
+static inline void condSignal(cond_t *c)			{ pthread_cond_signal(c); }
+
+/* Wait for a signal or until timeout_us passed, mutex must be held */
+static inline void condWait(cond_t *c, mutex_t *m, int64_t timeout_us)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_us / 1000000;
+	ts.tv_nsec += (timeout_us % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(c, m, &ts);
+}
+
+static inline int32_t atomicLoad32(volatile int32_t *p)				{ return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomicStore32(volatile int32_t *p, int32_t v)	{ __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline int32_t atomicAdd32(volatile int32_t *p, int32_t v)	{ return __atomic_add_fetch(p, v, __ATOMIC_ACQ_REL); }
+static inline int64_t atomicLoad64(volatile int64_t *p)				{ return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomicStore64(volatile int64_t *p, int64_t v)	{ __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline int64_t atomicAdd64(volatile int64_t *p, int64_t v)	{ return __atomic_add_fetch(p, v, __ATOMIC_RELAXED); }
+static inline int atomicCas32(volatile int32_t *p, int32_t expected, int32_t v)	{ return __atomic_compare_exchange_n(p, &expected, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED); }
+
+#endif
+
+#endif // __THREAD_H__
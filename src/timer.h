@@ -0,0 +1,48 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+/* Monotonic clock helpers used for latency measurement and deadlines */
+
+#ifdef _WIN32
+#include <Windows.h>
+
+static __inline int64_t timerNanos(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (int64_t) ((double) now.QuadPart * 1000000000.0 / (double) freq.QuadPart);
+}
+
+static __inline void timerSleepMicros(int64_t us)
+{
+	Sleep((DWORD) ((us + 999) / 1000));
+}
+
+#else
+#include <time.h>
+
+static inline int64_t timerNanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void timerSleepMicros(int64_t us)
+{
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+#endif
+
+#define timerMicros() (timerNanos() / 1000)
+
+#endif // __TIMER_H__
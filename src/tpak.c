@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "plugin.h"
+#include "tpak.h"
+#include "joybus.h"
+
+/* Game Boy cartridge header, as seen in the 32 byte block at 0x0140 */
+#define GB_HEADER_BLOCK			0x0140
+#define GB_HEADER_TYPE			0x07	// 0x0147
+#define GB_HEADER_ROM_SIZE		0x08	// 0x0148
+#define GB_HEADER_CHECKSUM		0x0D	// 0x014D
+#define GB_HEADER_GLOBAL_CHECKSUM	0x0E	// 0x014E, big endian
+
+/* Transfer Pak registers, the low 12 address bits are ignored */
+#define TPAK_POWER		0x8000
+#define TPAK_BANK		0xA000
+#define TPAK_STATUS		0xB000
+#define TPAK_CART		0xC000
+
+#define TPAK_POWER_ON	0x84
+#define TPAK_POWER_OFF	0xFE
+
+#define TPAK_STATUS_CHANGED	0x48	// cartridge pulled / not present
+
+enum { MBC_NONE, MBC_1, MBC_2, MBC_3, MBC_5, MBC_UNKNOWN };
+
+#define TPAK_FILE_MAGIC	"N64TPAK1"
+
+typedef struct
+{
+	char magic[8];
+	uint32_t rom_size;
+	uint16_t global_checksum;
+	uint8_t header_checksum;
+	uint8_t cart_type;
+	uint8_t reserved[48];
+} STpakFileHeader;
+
+typedef struct
+{
+	mutex_t lock;
+	int enabled;
+
+	// Transfer Pak
+	int powered;			// 1 on, 0 off, -1 unknown
+	int bank;			// 16 KB window of the GB address space at 0xC000, -1 unknown
+
+	// cartridge
+	int identified;
+	int mbc;
+	uint32_t rom_size;
+	int rom_bank;		// ROM bank at GB 0x4000-0x7FFF, -1 unknown
+	int mbc_lo;			// MBC registers, -1 after a lost write
+	int mbc_hi;
+	int mbc_mode;
+
+	// cache file: header, valid bitmap, ROM
+	unsigned char *map;
+	size_t map_size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+	uint32_t *valid;
+	unsigned char *rom;
+
+	int hits;
+	int misses;
+} STpak;
+
+static STpak l_Tpak[4];
+static int l_TpakInit = 0;
+static char l_TpakCacheDir[1024] = ".";
+
+#define BIT_TEST(map, n)	((map)[(n) >> 5] & (1u << ((n) & 31)))
+#define BIT_SET(map, n)		((map)[(n) >> 5] |= (1u << ((n) & 31)))
+
+static int TpakMbcType(unsigned char type)
+{
+	switch (type)
+	{
+		case 0x00: case 0x08: case 0x09:
+			return MBC_NONE;
+		case 0x01: case 0x02: case 0x03:
+			return MBC_1;
+		case 0x05: case 0x06:
+			return MBC_2;
+		case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+			return MBC_3;
+		case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+			return MBC_5;
+		default:
+			return MBC_UNKNOWN;
+	}
+}
+
+static void TpakUnmap(STpak *tpak)
+{
+	if (!tpak->map)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(tpak->map);
+	CloseHandle(tpak->mapping);
+	CloseHandle(tpak->file);
+#else
+	munmap(tpak->map, tpak->map_size);
+#endif
+	tpak->map = NULL;
+	tpak->valid = NULL;
+	tpak->rom = NULL;
+}
+
+static unsigned char *TpakMap(STpak *tpak, const char *path, size_t size)
+{
+#ifdef _WIN32
+	tpak->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (tpak->file == INVALID_HANDLE_VALUE)
+		return NULL;
+	tpak->mapping = CreateFileMappingA(tpak->file, NULL, PAGE_READWRITE, 0, (DWORD) size, NULL);
+	if (tpak->mapping == NULL)
+	{
+		CloseHandle(tpak->file);
+		return NULL;
+	}
+	unsigned char *map = (unsigned char *) MapViewOfFile(tpak->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (map == NULL)
+	{
+		CloseHandle(tpak->mapping);
+		CloseHandle(tpak->file);
+	}
+	return map;
+#else
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || ((size_t) st.st_size != size && ftruncate(fd, size) < 0))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return map == MAP_FAILED ? NULL : (unsigned char *) map;
+#endif
+}
+
+/* Map the cache file for the cartridge described by a header block */
+static void TpakOpenCache(STpak *tpak, int index, const unsigned char *header)
+{
+	unsigned char size_code = header[GB_HEADER_ROM_SIZE];
+	if (size_code > 8)
+		return;
+
+	uint32_t rom_size = 0x8000u << size_code;
+	uint16_t global_checksum = (header[GB_HEADER_GLOBAL_CHECKSUM] << 8) | header[GB_HEADER_GLOBAL_CHECKSUM + 1];
+	uint8_t header_checksum = header[GB_HEADER_CHECKSUM];
+
+	STpakFileHeader expect;
+	memset(&expect, 0, sizeof(expect));
+	memcpy(expect.magic, TPAK_FILE_MAGIC, sizeof(expect.magic));
+	expect.rom_size = rom_size;
+	expect.global_checksum = global_checksum;
+	expect.header_checksum = header_checksum;
+	expect.cart_type = header[GB_HEADER_TYPE];
+
+	char path[1200];
+	snprintf(path, sizeof(path), "%s/gb-%04x-%02x.cache", l_TpakCacheDir, global_checksum, header_checksum);
+
+	size_t bitmap = rom_size / JOYBUS_PAK_BLOCK / 8;
+	size_t size = sizeof(STpakFileHeader) + bitmap + rom_size;
+
+	TpakUnmap(tpak);
+#ifdef _WIN32
+	_mkdir(l_TpakCacheDir);
+#else
+	mkdir(l_TpakCacheDir, 0755);
+#endif
+	tpak->map = TpakMap(tpak, path, size);
+	if (!tpak->map)
+	{
+		DebugMessage(M64MSG_WARNING, "Couldn't open Transfer Pak cache %s", path);
+		return;
+	}
+	tpak->map_size = size;
+
+	// new file, or something else that happens to have the same name
+	if (memcmp(tpak->map, &expect, sizeof(expect)) != 0)
+	{
+		memset(tpak->map, 0, sizeof(STpakFileHeader) + bitmap);
+		memcpy(tpak->map, &expect, sizeof(expect));
+	}
+
+	tpak->valid = (uint32_t *) (tpak->map + sizeof(STpakFileHeader));
+	tpak->rom = tpak->map + sizeof(STpakFileHeader) + bitmap;
+	tpak->rom_size = rom_size;
+	tpak->mbc = TpakMbcType(header[GB_HEADER_TYPE]);
+	tpak->identified = 1;
+
+	DebugMessage(M64MSG_INFO, "Transfer Pak %i: cartridge %04x-%02x, %u KB ROM, cache %s",
+		index + 1, global_checksum, header_checksum, rom_size / 1024, path);
+}
+
+/* Offset in the ROM of a GB address, -1 if it is not ROM or we can't tell */
+static int64_t TpakRomOffset(const STpak *tpak, unsigned int gb)
+{
+	if (!tpak->identified || !tpak->map || gb >= 0x8000)
+		return -1;
+
+	if (gb < 0x4000)
+	{
+		// MBC1 in RAM banking mode puts the high bits on bank 0 as well, on big carts
+		if (tpak->mbc == MBC_1 && tpak->mbc_mode)
+		{
+			if (tpak->mbc_mode < 0 || tpak->mbc_hi < 0)
+				return -1;
+			return ((int64_t) (tpak->mbc_hi << 5) * 0x4000 + gb) % tpak->rom_size;
+		}
+		return gb;
+	}
+
+	int bank = tpak->mbc == MBC_NONE ? 1 : tpak->rom_bank;
+	if (bank < 0 || tpak->mbc == MBC_UNKNOWN)
+		return -1;
+
+	return ((int64_t) bank * 0x4000 + (gb - 0x4000)) % tpak->rom_size;
+}
+
+/* Follow the cartridge's bank switching */
+static void TpakMbcWrite(STpak *tpak, unsigned int gb, unsigned char value)
+{
+	switch (tpak->mbc)
+	{
+		case MBC_1:
+			if (gb >= 0x2000 && gb < 0x4000)
+				tpak->mbc_lo = value & 0x1F;
+			else if (gb >= 0x4000 && gb < 0x6000)
+				tpak->mbc_hi = value & 0x03;
+			else if (gb >= 0x6000)
+				tpak->mbc_mode = value & 0x01;
+			else
+				return;
+			// the high bits reach 0x4000 in either mode, the mode only adds bank 0
+			if (tpak->mbc_lo < 0 || tpak->mbc_hi < 0)
+				tpak->rom_bank = -1;
+			else
+				tpak->rom_bank = (tpak->mbc_hi << 5) | (tpak->mbc_lo ? tpak->mbc_lo : 1);
+			break;
+		case MBC_2:
+			if (gb < 0x4000 && (gb & 0x0100))
+				tpak->rom_bank = (value & 0x0F) ? (value & 0x0F) : 1;
+			break;
+		case MBC_3:
+			if (gb >= 0x2000 && gb < 0x4000)
+				tpak->rom_bank = (value & 0x7F) ? (value & 0x7F) : 1;
+			break;
+		case MBC_5:
+			if (gb >= 0x2000 && gb < 0x3000)
+				tpak->mbc_lo = value;
+			else if (gb >= 0x3000 && gb < 0x4000)
+				tpak->mbc_hi = value & 0x01;
+			else
+				return;
+			if (tpak->mbc_lo < 0 || tpak->mbc_hi < 0)
+				tpak->rom_bank = -1;
+			else
+				tpak->rom_bank = (tpak->mbc_hi << 8) | tpak->mbc_lo;
+			break;
+	}
+}
+
+/* A write to the MBC went missing or can't be placed */
+static void TpakMbcLost(STpak *tpak)
+{
+	tpak->rom_bank = -1;
+	tpak->mbc_lo = -1;
+	tpak->mbc_hi = -1;
+	tpak->mbc_mode = -1;
+}
+
+/* The cartridge was power cycled or pulled, we have to see its header again */
+static void TpakForgetCart(STpak *tpak)
+{
+	tpak->identified = 0;
+	tpak->rom_bank = 1;
+	tpak->mbc_lo = 1;
+	tpak->mbc_hi = 0;
+	tpak->mbc_mode = 0;
+}
+
+void TpakSetCacheDir(const char *path)
+{
+	snprintf(l_TpakCacheDir, sizeof(l_TpakCacheDir), "%s", path);
+}
+
+void TpakReset(int index, int enabled)
+{
+	STpak *tpak = &l_Tpak[index];
+
+	if (!l_TpakInit)
+	{
+		for (int i = 0; i < 4; i++)
+			mutexInit(&l_Tpak[i].lock);
+		l_TpakInit = 1;
+	}
+
+	mutexLock(&tpak->lock);
+	TpakUnmap(tpak);
+	TpakForgetCart(tpak);
+	tpak->enabled = enabled;
+	tpak->powered = 0;
+	tpak->bank = -1;
+	tpak->hits = 0;
+	tpak->misses = 0;
+	mutexUnlock(&tpak->lock);
+}
+
+void TpakClose(int index)
+{
+	STpak *tpak = &l_Tpak[index];
+
+	if (!tpak->enabled)
+		return;
+
+	mutexLock(&tpak->lock);
+	if (tpak->hits || tpak->misses)
+		DebugMessage(M64MSG_INFO, "Transfer Pak %i: %i ROM blocks from cache, %i from the cartridge", index + 1, tpak->hits, tpak->misses);
+	TpakUnmap(tpak);
+	TpakForgetCart(tpak);
+	tpak->powered = 0;
+	tpak->bank = -1;
+	tpak->hits = 0;
+	tpak->misses = 0;
+	mutexUnlock(&tpak->lock);
+}
+
+int TpakHandle(int index, unsigned char *cmd)
+{
+	STpak *tpak = &l_Tpak[index];
+	int handled = 0;
+
+	if (!tpak->enabled || !JOYBUS_IS_PAK_READ(cmd))
+		return 0;
+
+	unsigned int address = JOYBUS_PAK_ADDRESS(cmd);
+	if (address < TPAK_CART || !JOYBUS_PAK_ADDRESS_OK(cmd))
+		return 0;
+
+	mutexLock(&tpak->lock);
+
+	if (tpak->powered == 1 && tpak->bank >= 0)
+	{
+		unsigned int gb = tpak->bank * 0x4000 + (address - TPAK_CART);
+		int64_t offset = TpakRomOffset(tpak, gb);
+
+		if (offset >= 0)
+		{
+			if (BIT_TEST(tpak->valid, offset / JOYBUS_PAK_BLOCK))
+			{
+				unsigned char *rx = JOYBUS_RX_DATA(cmd);
+				memcpy(rx, tpak->rom + offset, JOYBUS_PAK_BLOCK);
+				rx[JOYBUS_PAK_BLOCK] = JoybusDataCrc(rx);
+				tpak->hits++;
+				handled = 1;
+			}
+			else
+				tpak->misses++;
+		}
+	}
+
+	mutexUnlock(&tpak->lock);
+	return handled;
+}
+
+void TpakObserve(int index, const unsigned char *cmd)
+{
+	STpak *tpak = &l_Tpak[index];
+
+	if (!tpak->enabled)
+		return;
+
+	int read = JOYBUS_IS_PAK_READ(cmd);
+	if (!read && !JOYBUS_IS_PAK_WRITE(cmd))
+		return;
+
+	unsigned int address = JOYBUS_PAK_ADDRESS(cmd);
+	if (address < TPAK_POWER || !JOYBUS_PAK_ADDRESS_OK(cmd))
+		return;
+
+	const unsigned char *rx = JOYBUS_RX_DATA(cmd);
+	const unsigned char *data = read ? rx : JOYBUS_PAK_DATA(cmd);
+	int ok = !(cmd[1] & JOYBUS_NO_RESPONSE) && rx[read ? JOYBUS_PAK_BLOCK : 0] == JoybusDataCrc(data);
+
+	mutexLock(&tpak->lock);
+
+	if (!ok)
+	{
+		// a lost write leaves us guessing at whatever it was meant to change
+		if (!read && address < TPAK_BANK)
+		{
+			tpak->powered = -1;
+			TpakForgetCart(tpak);
+		}
+		else if (!read && address < TPAK_STATUS)
+			tpak->bank = -1;
+		else if (!read && address >= TPAK_CART && tpak->bank < 2)
+			TpakMbcLost(tpak);	// the MBC is below GB 0x8000, an unknown window may be on it
+	}
+	else if (address < TPAK_BANK)
+	{
+		if (!read && data[0] == TPAK_POWER_ON)
+		{
+			tpak->powered = 1;
+			TpakForgetCart(tpak);
+		}
+		else if (!read && data[0] == TPAK_POWER_OFF)
+		{
+			tpak->powered = 0;
+			TpakForgetCart(tpak);
+		}
+		else if (read && (data[0] == TPAK_POWER_ON || data[0] == 0x00))
+			tpak->powered = data[0] == TPAK_POWER_ON;
+	}
+	else if (address < TPAK_STATUS)
+	{
+		if (!read)
+			tpak->bank = data[0] & 0x03;
+	}
+	else if (address < TPAK_CART)
+	{
+		if (read && (data[0] & TPAK_STATUS_CHANGED))
+			TpakForgetCart(tpak);
+	}
+	else if (tpak->powered != 1 || tpak->bank < 0)
+	{
+		// a cartridge write we can't place may have switched banks
+		if (!read)
+			TpakMbcLost(tpak);
+	}
+	else
+	{
+		unsigned int gb = tpak->bank * 0x4000 + (address - TPAK_CART);
+
+		if (!read)
+		{
+			// every byte is a write, the last one sticks
+			if (gb < 0x8000)
+				TpakMbcWrite(tpak, gb, data[JOYBUS_PAK_BLOCK - 1]);
+		}
+		else if (gb == GB_HEADER_BLOCK)
+		{
+			if (!tpak->identified || !tpak->map || memcmp(tpak->rom + GB_HEADER_BLOCK, data, JOYBUS_PAK_BLOCK) != 0)
+				TpakOpenCache(tpak, index, data);
+		}
+
+		int64_t offset = read ? TpakRomOffset(tpak, gb) : -1;
+		if (offset >= 0)
+		{
+			int block = (int) (offset / JOYBUS_PAK_BLOCK);
+
+			if (BIT_TEST(tpak->valid, block) && memcmp(tpak->rom + offset, data, JOYBUS_PAK_BLOCK) != 0)
+			{
+				// our idea of the banking is off, don't trust anything in there
+				DebugMessage(M64MSG_WARNING, "Transfer Pak %i: cache mismatch at ROM offset %06x, clearing cache", index + 1, (unsigned int) offset);
+				memset(tpak->valid, 0, tpak->rom_size / JOYBUS_PAK_BLOCK / 8);
+			}
+
+			memcpy(tpak->rom + offset, data, JOYBUS_PAK_BLOCK);
+			BIT_SET(tpak->valid, block);
+		}
+	}
+
+	mutexUnlock(&tpak->lock);
+}
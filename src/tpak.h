@@ -0,0 +1,29 @@
+#ifndef __TPAK_H__
+#define __TPAK_H__
+
+/* Persistent cache of Game Boy cartridge ROMs read through the Transfer Pak.
+ *
+ * The plugin follows the Transfer Pak registers (power, bank, access mode)
+ * and the cartridge's MBC bank writes as they go by. Once a cartridge has
+ * been identified from its header, every ROM block read over the wire is
+ * stored in a memory-mapped cache file named after the header checksums,
+ * and later reads of the same block are answered from that file, also in
+ * later sessions. Cartridge RAM and all writes always go to the wire. */
+
+/* Reset the Transfer Pak state of a controller, enabling or disabling the cache */
+extern void TpakReset(int index, int enabled);
+
+/* Set the directory the cache files are kept in */
+extern void TpakSetCacheDir(const char *path);
+
+/* Try to answer a pak read from the cache.
+ * Returns 1 if cmd was handled, 0 if it has to go to the controller. */
+extern int TpakHandle(int index, unsigned char *cmd);
+
+/* Learn from a transaction that went to the controller */
+extern void TpakObserve(int index, const unsigned char *cmd);
+
+/* Unmap the cache file of a controller */
+extern void TpakClose(int index);
+
+#endif // __TPAK_H__
@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "plugin.h"
+#include "joybus.h"
+#include "timer.h"
+#include "trace.h"
+
+/* File layout, all numbers little endian:
+ *   header  "N64TRACE" version block_size blocks, padded to TRACE_HEADER
+ *   blocks  seq (0 unused) used start_us, then used bytes of records
+ * A record is
+ *   varint  us since the previous record of the block
+ *   byte    controller | TRACE_NO_RESPONSE | TRACE_SAME_REQUEST | TRACE_SAME_REPLY
+ *   varint  us until the reply
+ *   [tx_len rx_len tx bytes]  unless TRACE_SAME_REQUEST
+ *   [rx bytes]                unless TRACE_NO_RESPONSE or TRACE_SAME_REPLY */
+
+#define TRACE_MAGIC			"N64TRACE"
+#define TRACE_VERSION		1
+#define TRACE_HEADER		32
+#define TRACE_BLOCK_HEADER	16
+#define TRACE_BLOCK_SIZE	65536
+#define TRACE_RECORD_MAX	(10 + 1 + 5 + 2 + TRACE_MAX_TX + TRACE_MAX_RX)
+#define TRACE_PENDING		16		// commands in a PIF frame
+
+#define TRACE_INDEX			0x03
+#define TRACE_NO_RESPONSE	0x04
+#define TRACE_SAME_REQUEST	0x08
+#define TRACE_SAME_REPLY	0x10
+
+/* What the last record of each controller in a block had, so repeats can be left out */
+typedef struct
+{
+	unsigned char request[2 + TRACE_MAX_TX];
+	int request_len;	// 0 at the start of a block
+	unsigned char reply[TRACE_MAX_RX];
+	int reply_len;		// -1 at the start of a block
+} STraceLast;
+
+typedef struct
+{
+	int index;
+	const unsigned char *cmd;	// in PIF RAM, the reply is there at the end of the frame
+	int64_t start_us, end_us;
+} STracePending;
+
+static struct
+{
+	unsigned char *map;
+	size_t size;
+	uint32_t blocks;
+	uint32_t seq;		// of the block being written
+	unsigned char *block;
+	uint32_t used;
+	int64_t origin_us;	// timerMicros of the start
+	int64_t last_us;	// time of the last record, relative to origin
+	STraceLast last[4];
+	STracePending pending[TRACE_PENDING];
+	int pending_count;
+	unsigned records;
+	char path[1024];
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+} l_Trace;
+
+static void TracePut32(unsigned char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (unsigned char) (v >> (8 * i));
+}
+
+static void TracePut64(unsigned char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (unsigned char) (v >> (8 * i));
+}
+
+static uint32_t TraceGet32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t TraceGet64(const unsigned char *p)
+{
+	return TraceGet32(p) | ((uint64_t) TraceGet32(p + 4) << 32);
+}
+
+static int TracePutVarint(unsigned char *p, uint64_t v)
+{
+	int len = 0;
+	while (v >= 0x80)
+	{
+		p[len++] = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
+	p[len++] = (unsigned char) v;
+	return len;
+}
+
+/* Returns the number of bytes used, 0 if it doesn't end before end */
+static int TraceGetVarint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+	*v = 0;
+	for (int i = 0; i < 10 && p + i < end; i++)
+	{
+		*v |= (uint64_t) (p[i] & 0x7F) << (7 * i);
+		if (!(p[i] & 0x80))
+			return i + 1;
+	}
+	return 0;
+}
+
+static void TraceResetLast(STraceLast *last)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		last[i].request_len = 0;
+		last[i].reply_len = -1;
+	}
+}
+
+/* Move on to the next block of the ring, over the oldest one once it is full */
+static void TraceNextBlock(int64_t time_us)
+{
+	l_Trace.block = l_Trace.map + TRACE_HEADER + (size_t) (l_Trace.seq % l_Trace.blocks) * TRACE_BLOCK_SIZE;
+	l_Trace.seq++;
+	l_Trace.used = 0;
+	l_Trace.last_us = time_us;
+	TraceResetLast(l_Trace.last);
+
+	// invalid until it is set up, for a reader looking at the file meanwhile
+	TracePut32(l_Trace.block, 0);
+	TracePut32(l_Trace.block + 4, 0);
+	TracePut64(l_Trace.block + 8, (uint64_t) time_us);
+	TracePut32(l_Trace.block, l_Trace.seq);
+}
+
+static void TraceEncode(const STracePending *p)
+{
+	const unsigned char *cmd = p->cmd;
+	unsigned char request[2 + TRACE_MAX_TX];
+	int tx_len = JOYBUS_TX_LEN(cmd);
+	int rx_len = JOYBUS_RX_LEN(cmd);
+	int no_response = (cmd[1] & JOYBUS_NO_RESPONSE) != 0;
+	int64_t time_us = p->start_us - l_Trace.origin_us;
+
+	// the game's request, without the flags the plugin put into it
+	request[0] = (unsigned char) tx_len;
+	request[1] = (unsigned char) rx_len;
+	memcpy(request + 2, cmd + 2, tx_len);
+
+	if (!l_Trace.block || l_Trace.used + TRACE_RECORD_MAX > TRACE_BLOCK_SIZE - TRACE_BLOCK_HEADER)
+		TraceNextBlock(time_us);
+
+	STraceLast *last = &l_Trace.last[p->index];
+	unsigned char *out = l_Trace.block + TRACE_BLOCK_HEADER + l_Trace.used;
+	unsigned char flags = (unsigned char) p->index;
+	int len = 0;
+
+	if (no_response)
+		flags |= TRACE_NO_RESPONSE;
+	if (last->request_len == 2 + tx_len && memcmp(last->request, request, 2 + tx_len) == 0)
+		flags |= TRACE_SAME_REQUEST;
+	if (!no_response && last->reply_len == rx_len && memcmp(last->reply, JOYBUS_RX_DATA(cmd), rx_len) == 0)
+		flags |= TRACE_SAME_REPLY;
+
+	len += TracePutVarint(out + len, (uint64_t) (time_us > l_Trace.last_us ? time_us - l_Trace.last_us : 0));
+	out[len++] = flags;
+	len += TracePutVarint(out + len, (uint64_t) (p->end_us > p->start_us ? p->end_us - p->start_us : 0));
+
+	if (!(flags & TRACE_SAME_REQUEST))
+	{
+		memcpy(out + len, request, 2 + tx_len);
+		len += 2 + tx_len;
+		memcpy(last->request, request, 2 + tx_len);
+		last->request_len = 2 + tx_len;
+	}
+
+	if (!no_response && !(flags & TRACE_SAME_REPLY))
+	{
+		memcpy(out + len, JOYBUS_RX_DATA(cmd), rx_len);
+		len += rx_len;
+		memcpy(last->reply, JOYBUS_RX_DATA(cmd), rx_len);
+		last->reply_len = rx_len;
+	}
+
+	if (time_us > l_Trace.last_us)
+		l_Trace.last_us = time_us;
+	l_Trace.used += len;
+	TracePut32(l_Trace.block + 4, l_Trace.used);
+	l_Trace.records++;
+}
+
+static void TraceFlush(int batched)
+{
+	int64_t now = timerMicros();
+
+	for (int i = 0; i < l_Trace.pending_count; i++)
+	{
+		if (batched)
+			l_Trace.pending[i].end_us = now;
+		TraceEncode(&l_Trace.pending[i]);
+	}
+	l_Trace.pending_count = 0;
+}
+
+static void TraceUnmap(void)
+{
+#ifdef _WIN32
+	if (l_Trace.map)
+		UnmapViewOfFile(l_Trace.map);
+	if (l_Trace.mapping)
+		CloseHandle(l_Trace.mapping);
+	if (l_Trace.file && l_Trace.file != INVALID_HANDLE_VALUE)
+		CloseHandle(l_Trace.file);
+	l_Trace.mapping = l_Trace.file = NULL;
+#else
+	if (l_Trace.map)
+		munmap(l_Trace.map, l_Trace.size);
+#endif
+	l_Trace.map = NULL;
+}
+
+int TraceStart(const char *path, int size_kb)
+{
+	TraceStop();
+	memset(&l_Trace, 0, sizeof(l_Trace));
+
+	l_Trace.blocks = (uint32_t) ((int64_t) size_kb * 1024 / TRACE_BLOCK_SIZE);
+	if (l_Trace.blocks < 2)
+		l_Trace.blocks = 2;
+	l_Trace.size = TRACE_HEADER + (size_t) l_Trace.blocks * TRACE_BLOCK_SIZE;
+
+#ifdef _WIN32
+	l_Trace.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (l_Trace.file != INVALID_HANDLE_VALUE)
+		l_Trace.mapping = CreateFileMappingA(l_Trace.file, NULL, PAGE_READWRITE, 0, (DWORD) l_Trace.size, NULL);
+	if (l_Trace.mapping)
+		l_Trace.map = MapViewOfFile(l_Trace.mapping, FILE_MAP_WRITE, 0, 0, l_Trace.size);
+#else
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0 && ftruncate(fd, (off_t) l_Trace.size) == 0)
+	{
+		void *map = mmap(NULL, l_Trace.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		l_Trace.map = map == MAP_FAILED ? NULL : map;
+	}
+	if (fd >= 0)
+		close(fd);
+#endif
+
+	if (!l_Trace.map)
+	{
+		TraceUnmap();
+		DebugMessage(M64MSG_WARNING, "Couldn't create the trace file %s", path);
+		return 0;
+	}
+
+	memcpy(l_Trace.map, TRACE_MAGIC, 8);
+	TracePut32(l_Trace.map + 8, TRACE_VERSION);
+	TracePut32(l_Trace.map + 12, TRACE_BLOCK_SIZE);
+	TracePut32(l_Trace.map + 16, l_Trace.blocks);
+
+	snprintf(l_Trace.path, sizeof(l_Trace.path), "%s", path);
+	l_Trace.origin_us = timerMicros();
+	DebugMessage(M64MSG_INFO, "Tracing Joybus traffic to %s (%u KB)", path, (unsigned) (l_Trace.size / 1024));
+	return 1;
+}
+
+void TraceStop(void)
+{
+	if (!l_Trace.map)
+		return;
+
+	TraceFlush(0);
+	TraceUnmap();
+	DebugMessage(M64MSG_INFO, "Traced %u commands to %s", l_Trace.records, l_Trace.path);
+}
+
+int TraceActive(void)
+{
+	return l_Trace.map != NULL;
+}
+
+void TraceCommand(int index, const unsigned char *cmd, int64_t start_us)
+{
+	if (!l_Trace.map)
+		return;
+
+	// a frame with more commands than there are slots, the replies are in already
+	if (l_Trace.pending_count == TRACE_PENDING)
+		TraceFlush(0);
+
+	STracePending *p = &l_Trace.pending[l_Trace.pending_count++];
+	p->index = index & TRACE_INDEX;
+	p->cmd = cmd;
+	p->start_us = start_us;
+	p->end_us = timerMicros();
+}
+
+void TraceFrameEnd(int batched)
+{
+	if (l_Trace.map)
+		TraceFlush(batched);
+}
+
+/* Append the records of one block, returns 0 if it is damaged */
+static int TraceDecodeBlock(const unsigned char *block, STraceRecord **records, int *count, int *capacity)
+{
+	const unsigned char *p = block + TRACE_BLOCK_HEADER;
+	const unsigned char *end = p + TraceGet32(block + 4);
+	int64_t time_us = (int64_t) TraceGet64(block + 8);
+	STraceLast last[4];
+	uint64_t v;
+	int len;
+
+	TraceResetLast(last);
+
+	while (p < end)
+	{
+		if (*count == *capacity)
+		{
+			int grown = *capacity ? *capacity * 2 : 4096;
+			STraceRecord *r = realloc(*records, grown * sizeof(STraceRecord));
+			if (!r)
+				return 0;
+			*records = r;
+			*capacity = grown;
+		}
+
+		STraceRecord *r = &(*records)[*count];
+		memset(r, 0, sizeof(STraceRecord));
+
+		if (!(len = TraceGetVarint(p, end, &v)))
+			return 0;
+		p += len;
+		time_us += (int64_t) v;
+		r->time_us = time_us;
+
+		if (p >= end)
+			return 0;
+		unsigned char flags = *p++;
+		r->index = flags & TRACE_INDEX;
+		r->no_response = (flags & TRACE_NO_RESPONSE) != 0;
+		STraceLast *l = &last[r->index];
+
+		if (!(len = TraceGetVarint(p, end, &v)))
+			return 0;
+		p += len;
+		r->duration_us = (int) v;
+
+		if (!(flags & TRACE_SAME_REQUEST))
+		{
+			if (end - p < 2 || p[0] > TRACE_MAX_TX || p[1] > TRACE_MAX_RX || end - p < 2 + p[0])
+				return 0;
+			l->request_len = 2 + p[0];
+			memcpy(l->request, p, l->request_len);
+			p += l->request_len;
+		}
+		if (!l->request_len)
+			return 0;
+		memcpy(r->cmd, l->request, l->request_len);
+
+		int rx_len = JOYBUS_RX_LEN(r->cmd);
+		if (r->no_response)
+			r->cmd[1] |= JOYBUS_NO_RESPONSE;
+		else if (flags & TRACE_SAME_REPLY)
+		{
+			if (l->reply_len != rx_len)
+				return 0;
+			memcpy(JOYBUS_RX_DATA(r->cmd), l->reply, rx_len);
+		}
+		else
+		{
+			if (end - p < rx_len)
+				return 0;
+			memcpy(JOYBUS_RX_DATA(r->cmd), p, rx_len);
+			memcpy(l->reply, p, rx_len);
+			l->reply_len = rx_len;
+			p += rx_len;
+		}
+
+		(*count)++;
+	}
+
+	return 1;
+}
+
+static int TraceCompareBlocks(const void *a, const void *b)
+{
+	uint32_t sa = TraceGet32(*(const unsigned char **) a);
+	uint32_t sb = TraceGet32(*(const unsigned char **) b);
+	return sa < sb ? -1 : sa > sb;
+}
+
+int TraceLoad(const char *path, STraceRecord **records)
+{
+	unsigned char header[TRACE_HEADER];
+	unsigned char *data = NULL;
+	const unsigned char **order = NULL;
+	int count = 0, capacity = 0, used = 0;
+
+	*records = NULL;
+
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return -1;
+
+	if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, TRACE_MAGIC, 8) != 0
+		|| TraceGet32(header + 8) != TRACE_VERSION || TraceGet32(header + 12) != TRACE_BLOCK_SIZE)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	uint32_t blocks = TraceGet32(header + 16);
+	data = malloc((size_t) blocks * TRACE_BLOCK_SIZE);
+	order = malloc(blocks * sizeof(*order));
+	if (!data || !order || fread(data, TRACE_BLOCK_SIZE, blocks, f) != blocks)
+	{
+		fclose(f);
+		free(data);
+		free(order);
+		return -1;
+	}
+	fclose(f);
+
+	// oldest block first, a ring that wrapped starts in the middle
+	for (uint32_t i = 0; i < blocks; i++)
+	{
+		unsigned char *block = data + (size_t) i * TRACE_BLOCK_SIZE;
+		if (TraceGet32(block) && TraceGet32(block + 4) <= TRACE_BLOCK_SIZE - TRACE_BLOCK_HEADER)
+			order[used++] = block;
+	}
+	qsort(order, used, sizeof(*order), TraceCompareBlocks);
+
+	for (int i = 0; i < used; i++)
+		if (!TraceDecodeBlock(order[i], records, &count, &capacity))
+			DebugMessage(M64MSG_WARNING, "Trace %s has a damaged block, skipped the rest of it", path);
+
+	free(data);
+	free(order);
+	return count;
+}
@@ -0,0 +1,45 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* Joybus traffic capture.
+ *
+ * With TraceFile set, every command the game hands to ReadController is
+ * appended to a memory-mapped ring file together with its reply, the
+ * controller and when it happened, so a session can be replayed later
+ * without the hardware (see transport-replay.c). The file is cut into
+ * blocks that each decode on their own; when it is full the oldest block
+ * is overwritten. Records are delta and varint encoded, and a request or
+ * reply that is the same as the last one of its controller is left out,
+ * so a state poll usually takes 4 bytes. */
+
+#define TRACE_MAX_TX	63
+#define TRACE_MAX_RX	63
+
+typedef struct
+{
+	int64_t time_us;	// since the start of the trace
+	int duration_us;	// until the reply was there
+	int index;			// controller 0 to 3
+	int no_response;
+	unsigned char cmd[2 + TRACE_MAX_TX + TRACE_MAX_RX];	// channel block like in PIF RAM, reply included
+} STraceRecord;
+
+/* Start capturing to path, a ring of size_kb kilobytes. Returns 1 on success */
+extern int TraceStart(const char *path, int size_kb);
+extern void TraceStop(void);
+extern int TraceActive(void);
+
+/* A command was handled by ReadController, it started at start_us.
+   The reply is taken when the PIF frame ends. */
+extern void TraceCommand(int index, const unsigned char *cmd, int64_t start_us);
+
+/* End of the PIF frame, with batched set the replies only arrived now */
+extern void TraceFrameEnd(int batched);
+
+/* Read a trace oldest record first, records is allocated and freed by the
+   caller. Returns the number of records, -1 if path isn't a trace. */
+extern int TraceLoad(const char *path, STraceRecord **records);
+
+#endif // __TRACE_H__
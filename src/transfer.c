@@ -0,0 +1,663 @@
+#include <string.h>
+
+#include "plugin.h"
+#include "transfer.h"
+#include "joybus.h"
+#include "frame.h"
+#include "mempak.h"
+#include "tpak.h"
+#include "rumble.h"
+#include "stats.h"
+#include "transport.h"
+#include "timer.h"
+
+static void TransferLock(SController *c)
+{
+	atomicAdd32(&c->waiters, 1);
+	mutexLock(&c->link->lock);
+	atomicAdd32(&c->waiters, -1);
+}
+
+/* Let the pak mirrors learn from a finished transaction */
+static void TransferObserve(SController *c, const unsigned char *cmd)
+{
+	int index = (int) (c - controller);
+
+	MempakObserve(index, cmd);
+	TpakObserve(index, cmd);
+	RumbleObserve(index, cmd);
+}
+
+/* Deadline tracker for the size of a command */
+static SRttTracker *TransferRtt(SController *c, const unsigned char *cmd)
+{
+	return &c->rtt[RttClass(2 + JOYBUS_TX_LEN(cmd) + JOYBUS_RX_LEN(cmd))];
+}
+
+/* The plain protocol can't tell a late reply from the next one: after a
+ * miss, drop whatever arrives until the line has been quiet for the
+ * deadline that was missed. Only what is there already is dropped, nothing
+ * is waited for: until then commands are answered with "no response".
+ * Returns 1 once the link is back in sync, lock must be held. */
+static int TransferResync(SController *c)
+{
+	SLink *link = c->link;
+	unsigned char stale[64];
+
+	while (link->resync)
+	{
+		if (timerMicros() >= link->resync)
+		{
+			link->resync = 0;
+			break;
+		}
+
+		int ready = TransportPoll(&link->transport, 0);
+		int got = ready > 0 ? TransportRead(&link->transport, stale, sizeof(stale), 0) : 0;
+
+		// the device went away, the hotplug thread starts it over
+		if (ready < 0 || got < 0)
+			link->resync = 0;
+		else if (got > 0)
+			link->resync = timerMicros() + link->quiet;
+		else
+			return 0;
+	}
+	return 1;
+}
+
+/* A reply was missed or didn't add up */
+static void TransferMiss(SController *c, const unsigned char *cmd)
+{
+	RttMiss(TransferRtt(c, cmd));
+
+	if (c->link->framed)
+		return;
+
+	TransportFlush(&c->link->transport);
+	c->link->quiet = RttDeadline(TransferRtt(c, cmd));
+	c->link->resync = timerMicros() + c->link->quiet;
+}
+
+/* A pak read of the plain protocol whose data CRC is neither right nor
+   inverted (no pak) is some other reply, the stream is off */
+static int TransferShifted(SController *c, const unsigned char *cmd, const char *buffer)
+{
+	if (c->link->framed || !JOYBUS_IS_PAK_READ(cmd) || JOYBUS_RX_LEN(cmd) != JOYBUS_PAK_BLOCK + 1)
+		return 0;
+
+	unsigned char crc = JoybusDataCrc((const unsigned char *) buffer);
+	unsigned char got = (unsigned char) buffer[JOYBUS_PAK_BLOCK];
+	return got != crc && got != (unsigned char) ~crc;
+}
+
+/* Put a command on the wire, lock must be held. With defer set, a frame
+ * for a shared link is only queued, TransferWriteLink sends it.
+ * Returns its sequence number, always 0 for the legacy protocol. */
+static unsigned char TransferWrite(SController *c, const unsigned char *cmd, int defer)
+{
+	SLink *link = c->link;
+
+	if (!link->framed)
+	{
+		TransportWrite(&link->transport, cmd, 2 + JOYBUS_TX_LEN(cmd));
+		return 0;
+	}
+
+	unsigned char frame[FRAME_SIZE(FRAME_MAX)];
+	int len = FrameEncode(frame, ++link->seq, (unsigned char) c->channel, cmd);
+
+	if (defer && link->users > 1 && link->tx_len + len <= (int) sizeof(link->tx))
+	{
+		memcpy(link->tx + link->tx_len, frame, len);
+		link->tx_len += len;
+	}
+	else
+		TransportWrite(&link->transport, frame, len);
+
+	return link->seq;
+}
+
+/* Send the frames queued on a link in one write, lock must be held */
+static void TransferWriteLink(SLink *link)
+{
+	if (!link->tx_len)
+		return;
+
+	TransportWrite(&link->transport, link->tx, link->tx_len);
+	link->tx_len = 0;
+}
+
+/* Wait for the reply frame of sequence number seq, lock must be held.
+ * Replies for the other controllers on the link are queued for them.
+ * Returns the reply length, -1 if it didn't arrive before deadline. */
+static int TransferFrameReply(SController *c, unsigned char seq, char *buffer, int size, int64_t deadline)
+{
+	SLink *link = c->link;
+	SFrameQueue *queue = &link->queue[c->channel];
+	SFrame frame;
+
+	while (FramePop(queue, &frame) || FrameRead(&link->transport, &link->parser, &frame, deadline) > 0)
+	{
+		if (frame.channel != c->channel)
+		{
+			if (frame.channel < 4)
+				FramePush(&link->queue[frame.channel], &frame);
+			continue;
+		}
+
+		signed char age = (signed char) (seq - frame.seq);
+
+		// a late reply of something we already gave up on
+		if (age > 0)
+			continue;
+
+		// replies come back in order, ours got lost on the way
+		if (age < 0)
+		{
+			FramePushFront(queue, &frame);
+			return -1;
+		}
+
+		int len = frame.len < size ? frame.len : size;
+		memcpy(buffer, frame.payload, len);
+		return len;
+	}
+
+	return -1;
+}
+
+/* Fill in the reply of a transaction sent at start, res bytes of it are in buffer */
+static int TransferResult(SController *c, unsigned char *cmd, int64_t start, const char *buffer, int res)
+{
+	const unsigned char rx_len = JOYBUS_RX_LEN(cmd);
+	int64_t elapsed = timerMicros() - start;
+
+	if (res == rx_len && TransferShifted(c, cmd, buffer))
+		res = -1;
+
+	StatsRecord((int) (c - controller), cmd, res, elapsed);
+
+	if (res == rx_len)
+		RttRecord(TransferRtt(c, cmd), elapsed);
+	else
+		TransferMiss(c, cmd);	// a late or partial reply must not poison the next one
+
+	// the command may still have reached the pak, the mirrors forget what it could have changed
+	if (res != rx_len)
+	{
+		cmd[1] |= JOYBUS_NO_RESPONSE;
+		TransferObserve(c, cmd);
+		return res < 0 ? 0 : res;
+	}
+
+	memcpy(JOYBUS_RX_DATA(cmd), buffer, rx_len);
+	TransferObserve(c, cmd);
+	return res;
+}
+
+/* Read the reply of a transaction sent at start, lock must be held */
+static int TransferReply(SController *c, unsigned char *cmd, int64_t start, unsigned char seq)
+{
+	const unsigned char rx_len = JOYBUS_RX_LEN(cmd);
+
+	char buffer[64];
+	memset(buffer, 0, sizeof(buffer));
+
+	int res;
+	if (c->link->framed)
+		res = TransferFrameReply(c, seq, buffer, rx_len, timerMicros() + RttDeadline(TransferRtt(c, cmd)));
+	else
+		res = TransportRead(&c->link->transport, (unsigned char *) buffer, rx_len, RttDeadline(TransferRtt(c, cmd)));
+
+	return TransferResult(c, cmd, start, buffer, res);
+}
+
+/* Throw away the reply of the outstanding split-phase command, lock must be held */
+static void TransferDrain(SController *c)
+{
+	if (!c->pending_len)
+		return;
+
+	// a framed reply carries its sequence number and is dropped when it shows up
+	if (!c->link->framed)
+		TransferReply(c, c->pending, c->pending_start, 0);
+	c->pending_len = 0;
+}
+
+/* Write a command whose reply is collected later, lock must be held.
+ * Returns 0 if the plain protocol is still resyncing and nothing went out. */
+static int TransferSend(SController *c, const unsigned char *cmd, int defer)
+{
+	const int len = 2 + JOYBUS_TX_LEN(cmd);
+
+	if (!c->link->framed && !TransferResync(c))
+		return 0;
+
+	// keep the whole block, the reply part is reused to drain a stale reply
+	memcpy(c->pending, cmd, len + JOYBUS_RX_LEN(cmd));
+	c->pending_len = len;
+	c->pending_start = timerMicros();
+	c->pending_seq = TransferWrite(c, cmd, defer);
+	return 1;
+}
+
+static int TransferLocked(SController *c, unsigned char *cmd)
+{
+	int64_t start = timerMicros();
+
+	// the plain protocol has nothing else on the link, request and reply go in one step
+	if (!c->link->framed)
+	{
+		char buffer[64];
+		memset(buffer, 0, sizeof(buffer));
+
+		// still dropping the replies of a miss, don't hold the emulator up
+		if (!TransferResync(c))
+		{
+			cmd[1] |= JOYBUS_NO_RESPONSE;
+			return 0;
+		}
+
+		int res = TransportTransact(&c->link->transport, cmd, 2 + JOYBUS_TX_LEN(cmd), (unsigned char *) buffer, JOYBUS_RX_LEN(cmd), RttDeadline(TransferRtt(c, cmd)));
+		return TransferResult(c, cmd, start, buffer, res);
+	}
+
+	unsigned char seq = TransferWrite(c, cmd, 0);
+	return TransferReply(c, cmd, start, seq);
+}
+
+int ControllerTransfer(int index, unsigned char *cmd)
+{
+	SController *c = &controller[index];
+
+	TransferLock(c);
+	TransferDrain(c);
+	int res = TransferLocked(c, cmd);
+	mutexUnlock(&c->link->lock);
+
+	return res;
+}
+
+void ControllerTransferPipeline(int index, unsigned char **cmds, int count)
+{
+	SController *c = &controller[index];
+
+	TransferLock(c);
+	TransferDrain(c);
+
+	for (int first = 0; first < count; first += FRAME_PIPELINE)
+	{
+		int n = count - first < FRAME_PIPELINE ? count - first : FRAME_PIPELINE;
+		unsigned char seq[FRAME_PIPELINE];
+		int64_t start[FRAME_PIPELINE];
+
+		if (!c->link->framed)
+		{
+			for (int i = 0; i < n; i++)
+				TransferLocked(c, cmds[first + i]);
+			continue;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			start[i] = timerMicros();
+			seq[i] = TransferWrite(c, cmds[first + i], 0);
+		}
+		// time each one from the previous reply, not from when it was queued
+		int64_t previous = 0;
+		for (int i = 0; i < n; i++)
+		{
+			TransferReply(c, cmds[first + i], start[i] > previous ? start[i] : previous, seq[i]);
+			previous = timerMicros();
+		}
+	}
+
+	mutexUnlock(&c->link->lock);
+}
+
+/* Background transactions in flight, the link lock is held meanwhile */
+typedef struct
+{
+	unsigned char *cmd;
+	int64_t start;
+	int64_t deadline;
+	unsigned char seq;
+	char buffer[64];
+	int received;
+} SStarted;
+
+static SStarted l_Started[4];
+
+int ControllerStart(int index, unsigned char *cmd)
+{
+	SController *c = &controller[index];
+	SStarted *started = &l_Started[index];
+
+	// the emulation thread wants the port or has a command outstanding on it
+	if (atomicLoad32(&c->waiters) || !mutexTryLock(&c->link->lock))
+		return 0;
+	if (c->pending_len)
+	{
+		mutexUnlock(&c->link->lock);
+		return 0;
+	}
+	// or the line is still settling after a miss, the command gets no response
+	if (!c->link->framed && !TransferResync(c))
+	{
+		mutexUnlock(&c->link->lock);
+		return -1;
+	}
+
+	memset(started->buffer, 0, sizeof(started->buffer));
+	started->cmd = cmd;
+	started->received = 0;
+	started->start = timerMicros();
+	started->deadline = started->start + RttDeadline(TransferRtt(c, cmd));
+	started->seq = TransferWrite(c, cmd, 0);
+	return 1;
+}
+
+int ControllerFinish(int index, int *res)
+{
+	SController *c = &controller[index];
+	SStarted *started = &l_Started[index];
+	const int rx_len = JOYBUS_RX_LEN(started->cmd);
+	int got;
+
+	// take what is there, don't wait for the rest
+	if (c->link->framed)
+	{
+		got = TransferFrameReply(c, started->seq, started->buffer, rx_len, 0);
+		if (got >= 0)
+			started->received = got;
+	}
+	else
+	{
+		got = TransportRead(&c->link->transport, (unsigned char *) started->buffer + started->received, rx_len - started->received, 0);
+		if (got > 0)
+			started->received += got;
+	}
+
+	int done = c->link->framed ? got >= 0 : started->received == rx_len;
+	int lost = TransportLost(&c->link->transport);
+	if (!done && !lost && timerMicros() < started->deadline)
+		return 0;
+
+	// like a blocking read: a short read of the plain protocol, -1 otherwise
+	got = done || (!c->link->framed && !lost) ? started->received : -1;
+	*res = TransferResult(c, started->cmd, started->start, started->buffer, got);
+	mutexUnlock(&c->link->lock);
+	return 1;
+}
+
+int64_t ControllerDeadline(int index)
+{
+	return l_Started[index].deadline;
+}
+
+int ControllerIdle(int index)
+{
+	SController *c = &controller[index];
+	SLink *link = c->link;
+
+	if (atomicLoad32(&c->waiters) || !mutexTryLock(&link->lock))
+		return 0;
+
+	// a split-phase reply is on its way, it is the emulation thread's
+	for (int i = 0; i < 4; i++)
+	{
+		if (controller[i].link == link && controller[i].pending_len)
+		{
+			mutexUnlock(&link->lock);
+			return 0;
+		}
+	}
+
+	if (link->framed)
+	{
+		SFrame frame;
+		while (FrameRead(&link->transport, &link->parser, &frame, 0) > 0)
+			if (frame.channel < 4)
+				FramePush(&link->queue[frame.channel], &frame);
+	}
+	else
+	{
+		unsigned char stale[64];
+
+		// the rest of a missed reply, the line isn't quiet yet
+		if (TransportRead(&link->transport, stale, sizeof(stale), 0) > 0)
+			link->resync = timerMicros() + link->quiet;
+	}
+
+	mutexUnlock(&link->lock);
+	return 1;
+}
+
+void ControllerIssue(int index, const unsigned char *cmd)
+{
+	SController *c = &controller[index];
+
+	TransferLock(c);
+	TransferDrain(c);
+	TransferSend(c, cmd, 0);
+	mutexUnlock(&c->link->lock);
+}
+
+int ControllerComplete(int index, unsigned char *cmd)
+{
+	SController *c = &controller[index];
+	int res = 0;
+
+	TransferLock(c);
+
+	if (c->pending_len)
+	{
+		// the game rewrote the command after it was issued, the reply we
+		// are waiting for is for something else
+		if (c->pending_len == 2 + JOYBUS_TX_LEN(cmd) && memcmp(c->pending, cmd, c->pending_len) == 0)
+		{
+			TransferReply(c, cmd, c->pending_start, c->pending_seq);
+			c->pending_len = 0;
+			res = 1;
+		}
+		else
+		{
+			TransferDrain(c);
+			StatsRetry(index, cmd[2]);
+		}
+	}
+
+	mutexUnlock(&c->link->lock);
+	return res;
+}
+
+void ControllerCancel(int index)
+{
+	SController *c = &controller[index];
+
+	TransferLock(c);
+	TransferDrain(c);
+	mutexUnlock(&c->link->lock);
+}
+
+/* PIF frame batching */
+typedef struct
+{
+	int64_t frames;
+	int64_t elapsed_us;		// first write to last reply
+	int64_t serial_us;		// sum of the individual round trips
+	int64_t max_elapsed_us;
+} SBatchStats;
+
+static unsigned char *l_BatchCmd[4];
+static int64_t l_BatchStart;
+static SBatchStats l_BatchStats;
+
+void ControllerBatch(int index, unsigned char *cmd)
+{
+	SController *c = &controller[index];
+
+	// same channel twice before the end of the frame, finish the first one
+	if (l_BatchCmd[index])
+		ControllerFlushBatch();
+
+	// frames for a shared link go out together when the batch is flushed
+	TransferLock(c);
+	TransferDrain(c);
+	int sent = TransferSend(c, cmd, 1);
+	mutexUnlock(&c->link->lock);
+
+	if (!sent)
+	{
+		cmd[1] |= JOYBUS_NO_RESPONSE;
+		return;
+	}
+
+	int first = 1;
+	for (int i = 0; i < 4; i++)
+		if (l_BatchCmd[i])
+			first = 0;
+	if (first)
+		l_BatchStart = c->pending_start;
+
+	l_BatchCmd[index] = cmd;
+}
+
+void ControllerFlushBatch(void)
+{
+	int slot[4], count = 0;
+	int received[4] = { 0 };
+	char buffer[4][64];
+
+	// always lock in index order, controllers on a shared link take its lock once
+	for (int i = 0; i < 4; i++)
+	{
+		if (!l_BatchCmd[i])
+			continue;
+
+		int shared = 0;
+		for (int k = 0; k < count; k++)
+			if (controller[slot[k]].link == controller[i].link)
+				shared = 1;
+		if (!shared)
+		{
+			TransferLock(&controller[i]);
+			TransferWriteLink(controller[i].link);
+		}
+		slot[count++] = i;
+	}
+	if (!count)
+		return;
+
+	int64_t serial_us = 0;
+	int remaining = 0;
+	for (int k = 0; k < count; k++)
+		remaining |= 1 << k;
+
+	// one wait across every port of the frame instead of one per port
+	while (remaining)
+	{
+		STransport *transports[4];
+		int which[4], n = 0;
+		int64_t now = timerMicros();
+		int64_t wait = INT64_MAX;
+
+		for (int k = 0; k < count; k++)
+		{
+			if (!(remaining & (1 << k)))
+				continue;
+			SController *c = &controller[slot[k]];
+			int64_t left = c->pending_start + RttDeadline(TransferRtt(c, c->pending)) - now;
+			if (c->link->queue[c->channel].count)
+				left = 0;	// already read while waiting for another port
+			if (left < wait)
+				wait = left;
+			transports[n] = &c->link->transport;
+			which[n++] = k;
+		}
+
+		int ready = TransportWaitAny(transports, n, wait > 0 ? (int) wait : 0);
+		if (ready < 0)
+			ready = ~0;		// let the reads report the error
+		for (int j = 0; j < n; j++)
+		{
+			SController *c = &controller[slot[which[j]]];
+			if (c->link->queue[c->channel].count)
+				ready |= 1 << j;
+		}
+		now = timerMicros();
+
+		for (int j = 0; j < n; j++)
+		{
+			int k = which[j];
+			SController *c = &controller[slot[k]];
+			unsigned char *cmd = l_BatchCmd[slot[k]];
+			const int rx_len = JOYBUS_RX_LEN(cmd);
+			int failed = 0;
+
+			if (received[k] < rx_len && (ready & (1 << j)))
+			{
+				if (c->link->framed)
+				{
+					// only take what is already there
+					int res = TransferFrameReply(c, c->pending_seq, buffer[k], rx_len, now);
+					if (res >= 0)
+					{
+						received[k] = res;
+						failed = res < rx_len;
+					}
+				}
+				else
+				{
+					int res = TransportRead(&c->link->transport, (unsigned char *) buffer[k] + received[k], rx_len - received[k], 0);
+					if (res < 0)
+						failed = 1;
+					else
+						received[k] += res;
+				}
+			}
+
+			if (received[k] != rx_len && !failed && c->pending_start + RttDeadline(TransferRtt(c, cmd)) > now)
+				continue;
+
+			if (TransferResult(c, cmd, c->pending_start, buffer[k], received[k]) == rx_len)
+				serial_us += now - c->pending_start;
+
+			c->pending_len = 0;
+			remaining &= ~(1 << k);
+		}
+	}
+
+	for (int k = 0; k < count; k++)
+	{
+		int shared = 0;
+		for (int j = 0; j < k; j++)
+			if (controller[slot[j]].link == controller[slot[k]].link)
+				shared = 1;
+		if (!shared)
+			mutexUnlock(&controller[slot[k]].link->lock);
+		l_BatchCmd[slot[k]] = NULL;
+	}
+
+	int64_t elapsed = timerMicros() - l_BatchStart;
+	l_BatchStats.frames++;
+	l_BatchStats.elapsed_us += elapsed;
+	l_BatchStats.serial_us += serial_us;
+	if (elapsed > l_BatchStats.max_elapsed_us)
+		l_BatchStats.max_elapsed_us = elapsed;
+}
+
+void ControllerBatchReport(void)
+{
+	if (l_BatchStats.frames)
+	{
+		int64_t avg = l_BatchStats.elapsed_us / l_BatchStats.frames;
+		int64_t serial = l_BatchStats.serial_us / l_BatchStats.frames;
+
+		DebugMessage(M64MSG_INFO, "Batched %lld PIF frames: %lld us per frame (max %lld us), %lld us if serialized",
+			(long long) l_BatchStats.frames, (long long) avg, (long long) l_BatchStats.max_elapsed_us, (long long) serial);
+	}
+
+	memset(&l_BatchStats, 0, sizeof(l_BatchStats));
+}
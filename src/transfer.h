@@ -0,0 +1,59 @@
+#ifndef __TRANSFER_H__
+#define __TRANSFER_H__
+
+#include <stdint.h>
+
+/* Joybus transactions on a controller's serial port.
+ *
+ * A transaction is the PIF channel block as the core hands it over: the
+ * tx bytes are written as-is and rx_len reply bytes are read back into the
+ * block. If the reply doesn't arrive before the port's deadline, the no
+ * response bit is set in cmd[1]. */
+
+/* Perform one transaction from the emulation thread.
+ * Returns the number of reply bytes received. */
+extern int ControllerTransfer(int index, unsigned char *cmd);
+
+/* Background transactions for the I/O thread, which doesn't wait on a
+ * single port. ControllerStart sends cmd and keeps the port locked, it
+ * returns 0 without touching the port while the emulation thread wants it
+ * or has a split-phase transaction outstanding, and -1 while the plain
+ * protocol is still resyncing after a miss. ControllerFinish takes
+ * whatever part of the reply has arrived; it returns 1 once cmd is filled
+ * in like by ControllerTransfer (res is the number of reply bytes) and the
+ * port is unlocked, or 0 before the reply is complete and the deadline
+ * returned by ControllerDeadline (us, timerMicros) has passed. */
+extern int ControllerStart(int index, unsigned char *cmd);
+extern int ControllerFinish(int index, int *res);
+extern int64_t ControllerDeadline(int index);
+
+/* Take the bytes that arrived on a port with nothing in flight: replies
+ * of the framed protocol are queued for their channel, the rest of a late
+ * plain reply is dropped and keeps the link resyncing. Returns 0 without
+ * touching the port if someone else has it. */
+extern int ControllerIdle(int index);
+
+/* Perform several transactions from the emulation thread. With the framed
+ * protocol up to FRAME_PIPELINE of them are on the wire at once, otherwise
+ * this is the same as a ControllerTransfer for each. */
+extern void ControllerTransferPipeline(int index, unsigned char **cmds, int count);
+
+/* Split-phase transactions: ControllerIssue sends the command right away,
+ * ControllerComplete collects the reply later. ControllerComplete returns 1
+ * if cmd matched the outstanding command and was filled in, 0 if the caller
+ * has to fall back to ControllerTransfer. */
+extern void ControllerIssue(int index, const unsigned char *cmd);
+extern int ControllerComplete(int index, unsigned char *cmd);
+
+/* Drop any outstanding split-phase transaction */
+extern void ControllerCancel(int index);
+
+/* PIF frame batching: ControllerBatch sends a channel's command right away,
+ * ControllerFlushBatch waits for the replies of every channel sent since the
+ * last flush at once. ControllerBatchReport logs and resets the per-frame
+ * timing counters. */
+extern void ControllerBatch(int index, unsigned char *cmd);
+extern void ControllerFlushBatch(void);
+extern void ControllerBatchReport(void);
+
+#endif // __TRANSFER_H__
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "plugin.h"
+#include "timer.h"
+#include "transport.h"
+
+/* Fault injection: fault:<faults>@<uri> passes everything through to the
+ * transport named by uri and breaks it on a seeded schedule, so the same
+ * seed gives the same faults for the same traffic. <faults> is a comma
+ * separated list of
+ *   seed=N        schedule (default 1)
+ *   after=N       leave the first N writes alone, e.g. for the handshake
+ *   drop=P        probability that a received byte is lost
+ *   extra=P       probability that a read gets a stray byte
+ *   corrupt=P     probability that a read has a bit flipped in its last
+ *                 byte (the CRC of pak replies and frames)
+ *   stall=P       probability that the device stops answering for a while,
+ *   stallms=N     that long (default 20)
+ *   disconnect=P  probability per write that the device goes away (it can
+ *                 be opened again right away, for the hotplug code)
+ * e.g. fault:seed=7,drop=0.001,stall=0.01,stallms=30@pty:/dev/ttyACM99 */
+
+#define FAULT_PENDING	64
+
+typedef struct
+{
+	STransport inner;
+	uint32_t rng;
+	int after;
+	double drop, extra, corrupt, stall, disconnect;
+	int stall_ms;
+	int64_t stall_until;	// us, nothing arrives before
+	int writes;
+	unsigned char pending[FAULT_PENDING];	// received, not handed out yet
+	int pending_len;
+	// what was done, logged on close
+	int dropped, extras, corrupted, stalls, disconnects;
+} SFault;
+
+static uint32_t l_FaultOpens = 0;
+
+/* xorshift32, the same sequence on every system */
+static uint32_t FaultRandom(SFault *f)
+{
+	f->rng ^= f->rng << 13;
+	f->rng ^= f->rng >> 17;
+	f->rng ^= f->rng << 5;
+	return f->rng;
+}
+
+static int FaultHit(SFault *f, double p)
+{
+	if (p <= 0 || f->writes <= f->after)
+		return 0;
+	return FaultRandom(f) < p * 4294967296.0;
+}
+
+/* Split the address into the fault settings and the inner uri */
+static int FaultParse(const char *address, SFault *f, char *uri, size_t size)
+{
+	char spec[256];
+
+	const char *at = strchr(address, '@');
+	if (!at || (size_t) (at - address) >= sizeof(spec))
+		return 0;
+	snprintf(spec, sizeof(spec), "%.*s", (int) (at - address), address);
+	snprintf(uri, size, "%s", at + 1);
+
+	if (!f)
+		return 1;
+
+	memset(f, 0, sizeof(SFault));
+	f->rng = 1;
+	f->stall_ms = 20;
+
+	// not strtok, the hotplug thread parses too
+	for (char *item = spec, *next; item; item = next)
+	{
+		next = strchr(item, ',');
+		if (next)
+			*next++ = 0;
+
+		char *value = strchr(item, '=');
+		if (!value)
+			return 0;
+		*value++ = 0;
+
+		if (strcmp(item, "seed") == 0)
+			f->rng = (uint32_t) strtoul(value, NULL, 10);
+		else if (strcmp(item, "after") == 0)
+			f->after = atoi(value);
+		else if (strcmp(item, "drop") == 0)
+			f->drop = atof(value);
+		else if (strcmp(item, "extra") == 0)
+			f->extra = atof(value);
+		else if (strcmp(item, "corrupt") == 0)
+			f->corrupt = atof(value);
+		else if (strcmp(item, "stall") == 0)
+			f->stall = atof(value);
+		else if (strcmp(item, "stallms") == 0)
+			f->stall_ms = atoi(value);
+		else if (strcmp(item, "disconnect") == 0)
+			f->disconnect = atof(value);
+		else
+			return 0;
+	}
+
+	// spread small seeds over all bits, and give every reopen a schedule
+	// of its own so a device that comes back doesn't fail the same way again
+	f->rng = (f->rng + l_FaultOpens++) * 2654435761u ^ 0x9E3779B9u;
+	if (!f->rng)
+		f->rng = 1;
+	for (int i = 0; i < 8; i++)
+		FaultRandom(f);
+	return 1;
+}
+
+static int FaultOpen(STransport *t, int baud)
+{
+	char uri[sizeof(t->address)];
+	SFault *f = malloc(sizeof(SFault));
+
+	if (!f || !FaultParse(t->address, f, uri, sizeof(uri)) || !TransportOpen(&f->inner, uri, baud))
+	{
+		if (f)
+			DebugMessage(M64MSG_ERROR, "Can't open fault:%s, expected fault:<faults>@<uri>", t->address);
+		free(f);
+		return 0;
+	}
+
+	t->data = f;
+	t->port = f->inner.port;
+	t->fd = f->inner.fd;
+	return 1;
+}
+
+static void FaultClose(STransport *t)
+{
+	SFault *f = t->data;
+
+	if (!f)
+		return;
+
+	DebugMessage(M64MSG_INFO, "Faults on %s: %d bytes dropped, %d stray bytes, %d corrupted, %d stalls, %d disconnects",
+		f->inner.address, f->dropped, f->extras, f->corrupted, f->stalls, f->disconnects);
+
+	TransportClose(&f->inner);
+	free(f);
+	t->data = NULL;
+}
+
+static int FaultWrite(STransport *t, const unsigned char *data, int len)
+{
+	SFault *f = t->data;
+
+	if (t->lost)
+		return -1;
+
+	f->writes++;
+	if (FaultHit(f, f->disconnect))
+	{
+		f->disconnects++;
+		t->lost = 1;
+		return -1;
+	}
+
+	if (FaultHit(f, f->stall))
+	{
+		f->stalls++;
+		f->stall_until = timerMicros() + f->stall_ms * 1000;
+	}
+
+	return TransportWrite(&f->inner, data, len);
+}
+
+static int FaultRead(STransport *t, unsigned char *data, int len, int timeout_us)
+{
+	SFault *f = t->data;
+	int64_t deadline = timerMicros() + timeout_us;
+	int got = 0;
+
+	if (t->lost)
+		return -1;
+
+	// the device is hung, nothing comes in until it is back
+	if (f->stall_until)
+	{
+		int64_t now = timerMicros();
+		if (timeout_us >= 0 && deadline < f->stall_until)
+		{
+			if (deadline > now)
+				timerSleepMicros(deadline - now);
+			return 0;
+		}
+		if (f->stall_until > now)
+			timerSleepMicros(f->stall_until - now);
+		f->stall_until = 0;
+	}
+
+	while (got < len)
+	{
+		if (f->pending_len > 0)
+		{
+			data[got++] = f->pending[0];
+			memmove(f->pending, f->pending + 1, --f->pending_len);
+			continue;
+		}
+
+		int wait = -1;
+		if (timeout_us >= 0)
+		{
+			int64_t left = deadline - timerMicros();
+			wait = left > 0 ? (int) left : 0;
+		}
+
+		int res = TransportRead(&f->inner, data + got, len - got, wait);
+		if (res < 0)
+			return got ? got : -1;
+		if (res == 0)
+			break;
+
+		// lose some of what came in
+		int kept = 0;
+		for (int i = 0; i < res; i++)
+		{
+			if (FaultHit(f, f->drop))
+				f->dropped++;
+			else
+				data[got + kept++] = data[got + i];
+		}
+		got += kept;
+	}
+
+	if (got > 0 && FaultHit(f, f->corrupt))
+	{
+		f->corrupted++;
+		data[got - 1] ^= (unsigned char) (1 << (FaultRandom(f) % 8));
+	}
+
+	// a stray byte somewhere, the last real one comes with the next read
+	if (got > 0 && f->pending_len < FAULT_PENDING && FaultHit(f, f->extra))
+	{
+		int at = (int) (FaultRandom(f) % got);
+		f->extras++;
+		memmove(f->pending + 1, f->pending, f->pending_len++);
+		f->pending[0] = data[got - 1];
+		memmove(data + at + 1, data + at, got - 1 - at);
+		data[at] = (unsigned char) FaultRandom(f);
+	}
+
+	return got;
+}
+
+static int FaultPoll(STransport *t, int timeout_us)
+{
+	SFault *f = t->data;
+
+	if (t->lost)
+		return -1;
+	if (f->pending_len > 0)
+		return 1;
+	return TransportPoll(&f->inner, timeout_us);
+}
+
+static void FaultFlush(STransport *t)
+{
+	SFault *f = t->data;
+
+	f->pending_len = 0;
+	TransportFlush(&f->inner);
+}
+
+static int FaultLost(STransport *t)
+{
+	SFault *f = t->data;
+	return t->lost || TransportLost(&f->inner);
+}
+
+static int FaultPresent(STransport *t)
+{
+	char uri[sizeof(t->address)];
+
+	return FaultParse(t->address, NULL, uri, sizeof(uri)) && TransportPresent(uri);
+}
+
+static int FaultHandle(STransport *t)
+{
+	SFault *f = t->data;
+	return f->inner.ops ? f->inner.ops->handle(&f->inner) : -1;
+}
+
+const STransportOps TransportFault =
+{
+	"fault", TRANSPORT_FAULT,
+	FaultOpen, FaultClose, FaultWrite, FaultRead, FaultPoll, FaultFlush, FaultLost, FaultPresent, FaultHandle
+};
@@ -0,0 +1,310 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "transport.h"
+
+/* Descriptor based transports: TCP and Unix sockets to a bridge process,
+ * and pseudo terminals. They only differ in how they are opened. */
+
+#define TRANSPORT_CONNECT_TIMEOUT	500		// ms
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static int64_t FdMicros(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int FdWait(int fd, short events, int timeout_us)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	int res;
+	do {
+#ifdef __linux__
+		struct timespec ts;
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000;
+		res = ppoll(&pfd, 1, timeout_us < 0 ? NULL : &ts, NULL);
+#else
+		res = poll(&pfd, 1, timeout_us < 0 ? -1 : (timeout_us + 999) / 1000);
+#endif
+	} while (res < 0 && errno == EINTR);
+
+	if (res <= 0)
+		return res;
+	if (!(pfd.revents & events))
+		return -1;
+	return 1;
+}
+
+/* The other end is gone for good, not just busy */
+static int FdGone(int err)
+{
+	return err != EAGAIN && err != EWOULDBLOCK && err != EINTR;
+}
+
+static void FdClose(STransport *t)
+{
+	if (t->fd >= 0)
+		close(t->fd);
+	t->fd = -1;
+}
+
+static int FdWrite(STransport *t, const unsigned char *data, int len)
+{
+	int sent = 0;
+
+	while (sent < len)
+	{
+		ssize_t res = t->ops == &TransportPty ? write(t->fd, data + sent, len - sent)
+			: send(t->fd, data + sent, len - sent, MSG_NOSIGNAL);
+		if (res < 0)
+		{
+			if (!FdGone(errno) && FdWait(t->fd, POLLOUT, TRANSPORT_CONNECT_TIMEOUT * 1000) > 0)
+				continue;
+			t->lost = 1;
+			return sent ? sent : -1;
+		}
+		sent += (int) res;
+	}
+
+	return sent;
+}
+
+static int FdRead(STransport *t, unsigned char *data, int len, int timeout_us)
+{
+	int64_t deadline = FdMicros() + timeout_us;
+	int got = 0;
+
+	while (got < len)
+	{
+		int wait = -1;
+		if (timeout_us >= 0)
+		{
+			int64_t left = deadline - FdMicros();
+			// past the deadline, still take whatever is already there
+			wait = left > 0 ? (int) left : 0;
+		}
+
+		int ready = FdWait(t->fd, POLLIN, wait);
+		if (ready < 0)
+		{
+			t->lost = 1;
+			return -1;
+		}
+		if (ready == 0)
+			break;
+
+		ssize_t res = read(t->fd, data + got, len - got);
+		if (res < 0)
+		{
+			if (!FdGone(errno))
+				continue;
+			t->lost = 1;
+			return -1;
+		}
+		// readable but nothing to read: the other end hung up
+		if (res == 0)
+		{
+			t->lost = 1;
+			return -1;
+		}
+		got += (int) res;
+	}
+
+	return got;
+}
+
+static int FdPoll(STransport *t, int timeout_us)
+{
+	return FdWait(t->fd, POLLIN, timeout_us);
+}
+
+static void FdFlush(STransport *t)
+{
+	unsigned char drop[256];
+
+	if (t->ops == &TransportPty)
+	{
+		tcflush(t->fd, TCIFLUSH);
+		return;
+	}
+
+	while (recv(t->fd, drop, sizeof(drop), MSG_DONTWAIT) > 0)
+		;
+}
+
+static int FdLost(STransport *t)
+{
+	return t->lost;
+}
+
+static int FdHandle(STransport *t)
+{
+	return t->fd;
+}
+
+/* TCP, address is host:port or [v6 address]:port */
+
+static int TcpConnect(const struct addrinfo *ai)
+{
+	int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+	if (fd < 0)
+		return -1;
+
+	// don't let a dead host hold up the caller for the system's connect timeout
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	int res = connect(fd, ai->ai_addr, ai->ai_addrlen);
+	if (res < 0 && errno == EINPROGRESS && FdWait(fd, POLLOUT, TRANSPORT_CONNECT_TIMEOUT * 1000) > 0)
+	{
+		int err = 0;
+		socklen_t size = sizeof(err);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size);
+		res = err ? -1 : 0;
+	}
+	if (res < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, flags);
+
+	// every message is a few bytes that have to go out right away
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static int TcpOpen(STransport *t, int baud)
+{
+	char host[256];
+	(void) baud;
+
+	snprintf(host, sizeof(host), "%s", t->address);
+	char *colon = strrchr(host, ':');
+	if (!colon)
+		return 0;
+	*colon = 0;
+	const char *port = colon + 1;
+
+	char *name = host;
+	if (name[0] == '[' && colon > host && colon[-1] == ']')
+	{
+		colon[-1] = 0;
+		name++;
+	}
+
+	struct addrinfo hints, *list;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(name, port, &hints, &list) != 0)
+		return 0;
+
+	for (struct addrinfo *ai = list; ai && t->fd < 0; ai = ai->ai_next)
+		t->fd = TcpConnect(ai);
+
+	freeaddrinfo(list);
+	return t->fd >= 0;
+}
+
+static int TcpPresent(STransport *t)
+{
+	// nothing to look at, connecting will tell
+	(void) t;
+	return 1;
+}
+
+const STransportOps TransportTcp =
+{
+	"tcp", TRANSPORT_TCP,
+	TcpOpen, FdClose, FdWrite, FdRead, FdPoll, FdFlush, FdLost, TcpPresent, FdHandle
+};
+
+/* Unix domain stream socket, address is its path */
+
+static int UnixOpen(STransport *t, int baud)
+{
+	struct sockaddr_un addr;
+	(void) baud;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(t->address) >= sizeof(addr.sun_path))
+		return 0;
+	strcpy(addr.sun_path, t->address);
+
+	t->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (t->fd < 0)
+		return 0;
+
+	if (connect(t->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		FdClose(t);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int PathPresent(STransport *t)
+{
+	return access(t->address, F_OK) == 0;
+}
+
+const STransportOps TransportUnix =
+{
+	"unix", TRANSPORT_UNIX,
+	UnixOpen, FdClose, FdWrite, FdRead, FdPoll, FdFlush, FdLost, PathPresent, FdHandle
+};
+
+/* Pseudo terminal, address is the path of the slave side (or a link to it) */
+
+static int PtyOpen(STransport *t, int baud)
+{
+	(void) baud;
+
+	t->fd = open(t->address, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (t->fd < 0)
+		return 0;
+
+	// raw bytes, the rate means nothing to a pty
+	struct termios config;
+	if (tcgetattr(t->fd, &config) == 0)
+	{
+		cfmakeraw(&config);
+		config.c_cc[VMIN] = 0;
+		config.c_cc[VTIME] = 0;
+		tcsetattr(t->fd, TCSANOW, &config);
+	}
+
+	return 1;
+}
+
+const STransportOps TransportPty =
+{
+	"pty", TRANSPORT_PTY,
+	PtyOpen, FdClose, FdWrite, FdRead, FdPoll, FdFlush, FdLost, PathPresent, FdHandle
+};
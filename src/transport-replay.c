@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "plugin.h"
+#include "joybus.h"
+#include "timer.h"
+#include "trace.h"
+#include "transport.h"
+
+/* Replay: replay:[<settings>@]<trace> stands in for an adapter speaking
+ * the plain protocol and answers from a TraceFile. Every command written
+ * to it is looked up from where the last one was found on (wrapping
+ * around), and the recorded reply comes back after the recorded time.
+ * <settings> is a comma separated list of
+ *   speed=N       time the replies N times faster, 0 answers right away (default 1)
+ *   controller=N  only use the records of controller N (1 to 4), for traces
+ *                 of several controllers
+ * e.g. replay:speed=0,controller=1@/tmp/session.trace
+ * Commands that are not in the trace go unanswered, like the framed
+ * protocol probe, so the plugin stays on the plain protocol. */
+
+#define REPLAY_BUFFER	256
+
+typedef struct
+{
+	STraceRecord *records;
+	int count;
+	int next;			// where the search for the next command starts
+	double speed;
+	int index;			// controller, -1 for all
+	unsigned char in[REPLAY_BUFFER];	// written, not a whole command yet
+	int in_len;
+	unsigned char out[REPLAY_BUFFER];	// reply, not read yet
+	int out_len;
+	int64_t due;		// us, the reply isn't there before
+	int matched, missed;
+} SReplay;
+
+/* Split the address into the settings and the trace path */
+static int ReplayParse(const char *address, SReplay *r, char *path, size_t size)
+{
+	char spec[256];
+
+	const char *at = strchr(address, '@');
+	if (!at)
+	{
+		snprintf(path, size, "%s", address);
+		spec[0] = 0;
+	}
+	else
+	{
+		if ((size_t) (at - address) >= sizeof(spec))
+			return 0;
+		snprintf(spec, sizeof(spec), "%.*s", (int) (at - address), address);
+		snprintf(path, size, "%s", at + 1);
+	}
+
+	if (!r)
+		return 1;
+
+	memset(r, 0, sizeof(SReplay));
+	r->speed = 1;
+	r->index = -1;
+
+	// not strtok, the hotplug thread parses too
+	for (char *item = spec, *next; *item; item = next)
+	{
+		next = strchr(item, ',');
+		if (next)
+			*next++ = 0;
+		else
+			next = item + strlen(item);
+
+		char *value = strchr(item, '=');
+		if (!value)
+			return 0;
+		*value++ = 0;
+
+		if (strcmp(item, "speed") == 0)
+			r->speed = atof(value);
+		else if (strcmp(item, "controller") == 0)
+			r->index = atoi(value) - 1;
+		else
+			return 0;
+	}
+
+	return r->speed >= 0 && r->index >= -1 && r->index < 4;
+}
+
+/* Find the record of a command, the next one in the trace that has the same request */
+static STraceRecord *ReplayFind(SReplay *r, const unsigned char *cmd)
+{
+	int len = 2 + JOYBUS_TX_LEN(cmd);
+
+	for (int n = 0; n < r->count; n++)
+	{
+		STraceRecord *record = &r->records[(r->next + n) % r->count];
+
+		if (r->index >= 0 && record->index != r->index)
+			continue;
+		if (record->cmd[0] != JOYBUS_TX_LEN(cmd) || JOYBUS_RX_LEN(record->cmd) != JOYBUS_RX_LEN(cmd) || memcmp(record->cmd + 2, cmd + 2, len - 2) != 0)
+			continue;
+
+		r->next = (r->next + n + 1) % r->count;
+		return record;
+	}
+
+	return NULL;
+}
+
+/* Answer the whole commands written so far */
+static void ReplayAnswer(SReplay *r)
+{
+	int pos = 0;
+
+	while (r->in_len - pos >= 2 && r->in_len - pos >= 2 + JOYBUS_TX_LEN(r->in + pos))
+	{
+		const unsigned char *cmd = r->in + pos;
+		STraceRecord *record = ReplayFind(r, cmd);
+		int rx_len = JOYBUS_RX_LEN(cmd);
+
+		pos += 2 + JOYBUS_TX_LEN(cmd);
+
+		if (!record)
+		{
+			r->missed++;
+			continue;
+		}
+		r->matched++;
+
+		if (record->no_response || r->out_len + rx_len > REPLAY_BUFFER)
+			continue;
+
+		memcpy(r->out + r->out_len, JOYBUS_RX_DATA(record->cmd), rx_len);
+		r->out_len += rx_len;
+
+		int64_t due = timerMicros() + (r->speed > 0 ? (int64_t) (record->duration_us / r->speed) : 0);
+		if (due > r->due)
+			r->due = due;
+	}
+
+	memmove(r->in, r->in + pos, r->in_len - pos);
+	r->in_len -= pos;
+}
+
+static int ReplayOpen(STransport *t, int baud)
+{
+	char path[sizeof(t->address)];
+	SReplay *r = malloc(sizeof(SReplay));
+
+	(void) baud;
+
+	if (!r || !ReplayParse(t->address, r, path, sizeof(path)))
+	{
+		if (r)
+			DebugMessage(M64MSG_ERROR, "Can't open replay:%s, expected replay:[speed=N,controller=N@]<trace>", t->address);
+		free(r);
+		return 0;
+	}
+
+	r->count = TraceLoad(path, &r->records);
+	if (r->count <= 0)
+	{
+		DebugMessage(M64MSG_ERROR, "%s is not a trace or has no records", path);
+		free(r->records);
+		free(r);
+		return 0;
+	}
+
+	DebugMessage(M64MSG_INFO, "Replaying %i commands from %s", r->count, path);
+	t->data = r;
+	return 1;
+}
+
+static void ReplayClose(STransport *t)
+{
+	SReplay *r = t->data;
+
+	if (!r)
+		return;
+
+	DebugMessage(M64MSG_INFO, "Replay of %s: %i commands answered, %i not in the trace", t->address, r->matched, r->missed);
+
+	free(r->records);
+	free(r);
+	t->data = NULL;
+}
+
+static int ReplayWrite(STransport *t, const unsigned char *data, int len)
+{
+	SReplay *r = t->data;
+
+	// a command that can't be whole, the adapter would have lost track too
+	if (r->in_len + len > REPLAY_BUFFER)
+		r->in_len = 0;
+	if (len > REPLAY_BUFFER)
+		return len;
+
+	memcpy(r->in + r->in_len, data, len);
+	r->in_len += len;
+	ReplayAnswer(r);
+	return len;
+}
+
+/* Wait for the reply to be due, returns 1 if it is */
+static int ReplayWait(SReplay *r, int timeout_us)
+{
+	int64_t now = timerMicros();
+
+	if (!r->out_len)
+	{
+		// nothing is coming, take as long as the adapter would unless in a hurry
+		if (timeout_us > 0 && r->speed > 0)
+			timerSleepMicros(timeout_us);
+		return 0;
+	}
+
+	if (r->due > now)
+	{
+		if (timeout_us >= 0 && r->due > now + timeout_us)
+		{
+			timerSleepMicros(timeout_us);
+			return 0;
+		}
+		timerSleepMicros(r->due - now);
+	}
+
+	return 1;
+}
+
+static int ReplayRead(STransport *t, unsigned char *data, int len, int timeout_us)
+{
+	SReplay *r = t->data;
+
+	if (!ReplayWait(r, timeout_us))
+		return 0;
+
+	if (len > r->out_len)
+		len = r->out_len;
+	memcpy(data, r->out, len);
+	memmove(r->out, r->out + len, r->out_len - len);
+	r->out_len -= len;
+	return len;
+}
+
+static int ReplayPoll(STransport *t, int timeout_us)
+{
+	return ReplayWait(t->data, timeout_us);
+}
+
+static void ReplayFlush(STransport *t)
+{
+	SReplay *r = t->data;
+
+	r->in_len = 0;
+	r->out_len = 0;
+}
+
+static int ReplayLost(STransport *t)
+{
+	return t->lost;
+}
+
+static int ReplayPresent(STransport *t)
+{
+	char path[sizeof(t->address)];
+
+	if (!ReplayParse(t->address, NULL, path, sizeof(path)))
+		return 0;
+
+	FILE *f = fopen(path, "rb");
+	if (f)
+		fclose(f);
+	return f != NULL;
+}
+
+static int ReplayHandle(STransport *t)
+{
+	(void) t;
+	return -1;
+}
+
+const STransportOps TransportReplay =
+{
+	"replay", TRANSPORT_REPLAY,
+	ReplayOpen, ReplayClose, ReplayWrite, ReplayRead, ReplayPoll, ReplayFlush, ReplayLost, ReplayPresent, ReplayHandle
+};
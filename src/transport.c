@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "transport.h"
+#include "rs232.h"
+#include "timer.h"
+
+#define TRANSPORT_MAXWAIT	32
+#define TRANSPORT_POLL_INTERVAL	100	// us between polls of transports without a descriptor
+
+/* rs232 ports */
+
+static int SerialFind(const char *name)
+{
+	// the index from startup is reused, only rescan for a device plugged in since
+	int port = comFindPort(name);
+	if (port < 0 && comEnumerate() > 0)
+		port = comFindPort(name);
+	return port;
+}
+
+static int SerialOpen(STransport *t, int baud)
+{
+	t->port = SerialFind(t->address);
+	return t->port >= 0 && comOpen(t->port, baud);
+}
+
+static void SerialClose(STransport *t)
+{
+	comClose(t->port);
+}
+
+static int SerialWrite(STransport *t, const unsigned char *data, int len)
+{
+	return comWrite(t->port, (const char *) data, len);
+}
+
+static int SerialRead(STransport *t, unsigned char *data, int len, int timeout_us)
+{
+	return comReadTimeout(t->port, (char *) data, len, timeout_us);
+}
+
+static int SerialTransact(STransport *t, const unsigned char *tx, int tx_len, unsigned char *rx, int rx_len, int timeout_us)
+{
+	return comTransact(t->port, (const char *) tx, tx_len, (char *) rx, rx_len, timeout_us);
+}
+
+static int SerialPoll(STransport *t, int timeout_us)
+{
+	return comWaitAny(&t->port, 1, timeout_us);
+}
+
+static void SerialFlush(STransport *t)
+{
+	comFlush(t->port);
+}
+
+static int SerialLost(STransport *t)
+{
+	return comIsLost(t->port);
+}
+
+static int SerialPresent(STransport *t)
+{
+	// it may come back as another tty, look the name up again
+	comEnumerate();
+	int port = comFindPort(t->address);
+	if (port < 0)
+		return 0;
+#ifdef _WIN32
+	return 1;
+#else
+	return access(comGetInternalName(port), F_OK) == 0;
+#endif
+}
+
+static int SerialHandle(STransport *t)
+{
+	return comGetHandle(t->port);
+}
+
+static const STransportOps TransportSerial =
+{
+	"serial", TRANSPORT_SERIAL,
+	SerialOpen, SerialClose, SerialWrite, SerialRead, SerialPoll, SerialFlush, SerialLost, SerialPresent, SerialHandle,
+	SerialTransact
+};
+
+static const STransportOps *l_Transports[] =
+{
+	&TransportSerial,
+#ifndef _WIN32
+	&TransportTcp,
+	&TransportUnix,
+	&TransportPty,
+#endif
+	&TransportFault,
+	&TransportReplay,
+};
+
+#define TRANSPORT_COUNT	((int) (sizeof(l_Transports) / sizeof(l_Transports[0])))
+
+/* Split uri into transport and address, no known scheme means a serial port */
+static const STransportOps *TransportParse(const char *uri, char *address, size_t size)
+{
+	const char *colon = strchr(uri, ':');
+
+	for (int i = 0; colon && i < TRANSPORT_COUNT; i++)
+	{
+		if (strlen(l_Transports[i]->scheme) == (size_t) (colon - uri) && strncmp(uri, l_Transports[i]->scheme, colon - uri) == 0)
+		{
+			snprintf(address, size, "%s", colon + 1);
+			return l_Transports[i];
+		}
+	}
+
+	snprintf(address, size, "%s", uri);
+	return &TransportSerial;
+}
+
+int TransportOpen(STransport *t, const char *uri, int baud)
+{
+	memset(t, 0, sizeof(STransport));
+	t->port = -1;
+	t->fd = -1;
+
+	const STransportOps *ops = TransportParse(uri, t->address, sizeof(t->address));
+	if (!ops->open(t, baud))
+	{
+		t->port = -1;
+		t->fd = -1;
+		return 0;
+	}
+
+	t->ops = ops;
+	return 1;
+}
+
+void TransportClose(STransport *t)
+{
+	if (!t->ops)
+		return;
+
+	t->ops->close(t);
+	t->ops = NULL;
+}
+
+int TransportWrite(STransport *t, const unsigned char *data, int len)
+{
+	return t->ops ? t->ops->write(t, data, len) : 0;
+}
+
+int TransportRead(STransport *t, unsigned char *data, int len, int timeout_us)
+{
+	return t->ops ? t->ops->read(t, data, len, timeout_us) : 0;
+}
+
+int TransportTransact(STransport *t, const unsigned char *tx, int tx_len, unsigned char *rx, int rx_len, int timeout_us)
+{
+	if (!t->ops)
+		return 0;
+	if (t->ops->transact)
+		return t->ops->transact(t, tx, tx_len, rx, rx_len, timeout_us);
+
+	t->ops->write(t, tx, tx_len);
+	return rx_len ? t->ops->read(t, rx, rx_len, timeout_us) : 0;
+}
+
+int TransportPoll(STransport *t, int timeout_us)
+{
+	return t->ops ? t->ops->poll(t, timeout_us) : -1;
+}
+
+void TransportFlush(STransport *t)
+{
+	if (t->ops)
+		t->ops->flush(t);
+}
+
+int TransportLost(STransport *t)
+{
+	return t->ops ? t->ops->lost(t) : 0;
+}
+
+int TransportPresent(const char *uri)
+{
+	STransport t;
+	memset(&t, 0, sizeof(t));
+	t.port = -1;
+	t.fd = -1;
+
+	const STransportOps *ops = TransportParse(uri, t.address, sizeof(t.address));
+	return ops->present(&t);
+}
+
+int TransportMatch(STransport *t, const char *uri)
+{
+	char address[sizeof(t->address)];
+
+	const STransportOps *ops = TransportParse(uri, address, sizeof(address));
+	if (ops != t->ops)
+		return 0;
+
+	// a port can go by several names
+	if (ops == &TransportSerial)
+		return comFindPort(address) == t->port;
+
+	return strcmp(address, t->address) == 0;
+}
+
+/* Ask each transport in turn until one has data */
+static int TransportWaitPoll(STransport **transports, int count, int timeout_us)
+{
+	int64_t deadline = timerMicros() + timeout_us;
+
+	for (;;)
+	{
+		int mask = 0;
+		for (int i = 0; i < count; i++)
+			if (TransportPoll(transports[i], 0) > 0)
+				mask |= 1 << i;
+
+		if (mask || (timeout_us >= 0 && timerMicros() >= deadline))
+			return mask;
+		timerSleepMicros(TRANSPORT_POLL_INTERVAL);
+	}
+}
+
+int TransportWaitAny(STransport **transports, int count, int timeout_us)
+{
+	int serial = 1;
+	if (count > TRANSPORT_MAXWAIT)
+		count = TRANSPORT_MAXWAIT;
+	for (int i = 0; i < count; i++)
+		if (transports[i]->ops != &TransportSerial)
+			serial = 0;
+
+	// serial ports only, rs232 knows how to wait on them everywhere
+	if (serial)
+	{
+		int ports[TRANSPORT_MAXWAIT];
+		for (int i = 0; i < count; i++)
+			ports[i] = transports[i]->port;
+		return comWaitAny(ports, count, timeout_us);
+	}
+
+	// a transport without a descriptor (replay) can only be asked
+	for (int i = 0; i < count; i++)
+		if (!transports[i]->ops || transports[i]->ops->handle(transports[i]) < 0)
+			return TransportWaitPoll(transports, count, timeout_us);
+
+#ifndef _WIN32
+	struct pollfd pfd[TRANSPORT_MAXWAIT];
+	for (int i = 0; i < count; i++)
+	{
+		pfd[i].fd = transports[i]->ops ? transports[i]->ops->handle(transports[i]) : -1;
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+	}
+
+	int res;
+	do {
+#ifdef __linux__
+		struct timespec ts;
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000;
+		res = ppoll(pfd, count, timeout_us < 0 ? NULL : &ts, NULL);
+#else
+		res = poll(pfd, count, timeout_us < 0 ? -1 : (timeout_us + 999) / 1000);
+#endif
+	} while (res < 0 && errno == EINTR);
+
+	if (res < 0)
+		return -1;
+
+	int mask = 0;
+	for (int i = 0; i < count; i++)
+		if (pfd[i].revents)
+			mask |= 1 << i;
+	return mask;
+#else
+	return -1;
+#endif
+}
+
+const char *TransportName(int kind)
+{
+	static const char *names[TRANSPORTS] = { "serial", "tcp", "unix", "pty", "fault", "replay" };
+	return kind >= 0 && kind < TRANSPORTS ? names[kind] : "?";
+}
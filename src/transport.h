@@ -0,0 +1,80 @@
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+/* Transports carry the bytes of a link to the adapter. The Serial setting
+ * of a controller picks one by URI scheme:
+ *   serial:/dev/ttyACM0     rs232 port, also without the scheme (ttyACM0, COM3, by-id names)
+ *   tcp:host:port           adapter on another machine, behind a TCP bridge
+ *   unix:/run/n64io.sock    bridge process on this machine
+ *   pty:/tmp/n64io          pseudo terminal of a local process (simulator), no line settings
+ *   fault:drop=0.01@<uri>   another transport with faults injected, see transport-fault.c
+ *   replay:/tmp/s.trace     answers from a TraceFile instead of an adapter, see transport-replay.c
+ * Only serial, fault and replay exist on Windows. Reads and writes behave like
+ * comReadTimeout and comWrite. */
+
+enum { TRANSPORT_SERIAL, TRANSPORT_TCP, TRANSPORT_UNIX, TRANSPORT_PTY, TRANSPORT_FAULT, TRANSPORT_REPLAY, TRANSPORTS };
+
+typedef struct STransportOps STransportOps;
+
+typedef struct
+{
+	const STransportOps *ops;	// NULL while closed
+	int port;			// rs232 port index of a serial transport, -1 otherwise
+	int fd;				// descriptor of the other transports, -1 if closed
+	int lost;			// hangup or I/O error, has to be opened again
+	char address[256];	// URI without the scheme
+	void *data;			// state of transports that need more, freed by close
+} STransport;
+
+struct STransportOps
+{
+	const char *scheme;
+	int kind;
+	int (*open)(STransport *t, int baud);	// t->address is set, returns 1 on success
+	void (*close)(STransport *t);
+	int (*write)(STransport *t, const unsigned char *data, int len);
+	int (*read)(STransport *t, unsigned char *data, int len, int timeout_us);
+	int (*poll)(STransport *t, int timeout_us);	// 1 readable, 0 timeout, -1 error
+	void (*flush)(STransport *t);	// drop received data not read yet
+	int (*lost)(STransport *t);
+	int (*present)(STransport *t);	// the device is there to be opened (again)
+	int (*handle)(STransport *t);	// pollable descriptor, -1 if there is none (poll is asked then)
+	int (*transact)(STransport *t, const unsigned char *tx, int tx_len, unsigned char *rx, int rx_len, int timeout_us);	// optional, write then read in one go
+};
+
+#ifndef _WIN32
+extern const STransportOps TransportTcp;
+extern const STransportOps TransportUnix;
+extern const STransportOps TransportPty;
+#endif
+extern const STransportOps TransportFault;
+extern const STransportOps TransportReplay;
+
+/* Open the transport named by uri, baud only matters to serial ports.
+   Returns 1 on success, t is closed otherwise. */
+extern int TransportOpen(STransport *t, const char *uri, int baud);
+extern void TransportClose(STransport *t);
+
+extern int TransportWrite(STransport *t, const unsigned char *data, int len);
+extern int TransportRead(STransport *t, unsigned char *data, int len, int timeout_us);
+extern int TransportPoll(STransport *t, int timeout_us);
+
+/* Write a request and read its reply, one step for transports that can
+   (io_uring serial ports), a write and a read for the others */
+extern int TransportTransact(STransport *t, const unsigned char *tx, int tx_len, unsigned char *rx, int rx_len, int timeout_us);
+extern void TransportFlush(STransport *t);
+extern int TransportLost(STransport *t);
+
+/* The device uri names can be opened, e.g. it was plugged back in */
+extern int TransportPresent(const char *uri);
+
+/* t is open on the device uri names */
+extern int TransportMatch(STransport *t, const char *uri);
+
+/* Wait until one of several transports has data, bit mask like comWaitAny */
+extern int TransportWaitAny(STransport **transports, int count, int timeout_us);
+
+/* Scheme of a transport kind, for logs and statistics */
+extern const char *TransportName(int kind);
+
+#endif // __TRANSPORT_H__
@@ -0,0 +1,663 @@
+/* rs232-bench: microbenchmark of src/rs232/rs232-linux.c on its own.
+ *
+ * For every rate of the _BaudFlag table (and one that needs BOTHER) the
+ * port is opened through comOpen and timed with comTransact, once per
+ * backend asked for with -k (poll, uring, sqpoll):
+ *   rtt     state polls (3 bytes out, 4 back), latency percentiles
+ *   pak     pak reads (5 bytes out, 33 back), bytes per second
+ *   stream  16 blocks of 63 bytes in flight, bytes per second
+ * With -s the reads spin before sleeping (comSetSpinLimit), and the
+ * spin budget, catches and CPU time go with the results.
+ * The system calls rs232 makes are counted per transaction. They are
+ * caught with the linker's --wrap, so only calls from rs232 are counted.
+ *
+ * The other end is a pty answering like the legacy firmware, or a real
+ * device: an adapter (rtt only, at its own rate) or a loopback plug (-l).
+ * Results go to a JSON file; -b compares them with a saved one and exits
+ * with 1 if anything got slower by more than the threshold. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "rs232.h"
+
+#define BENCH_VERSION		2
+#define BENCH_MAX_RATES		48
+#define BENCH_MAX_RESULTS	(BENCH_MAX_RATES * 3)
+#define BENCH_STREAM_BLOCK	63		// largest legacy block
+#define BENCH_STREAM_DEPTH	16
+#define BENCH_TIMEOUT		100000	// us, a reply that takes longer is lost
+
+extern int _BaudFlag(int BaudRate);
+
+/* System calls made by rs232, see the Makefile for the --wrap list */
+
+enum { SYS_READ, SYS_WRITE, SYS_POLL, SYS_PPOLL, SYS_IOCTL, SYS_TCFLUSH, SYS_TCDRAIN, SYS_TCSETATTR, SYS_OPEN, SYS_CLOSE, SYS_URING, SYS_COUNT };
+
+static const char *l_SysNames[SYS_COUNT] = { "read", "write", "poll", "ppoll", "ioctl", "tcflush", "tcdrain", "tcsetattr", "open", "close", "io_uring" };
+static uint64_t l_Sys[SYS_COUNT];
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo, const sigset_t *sigmask);
+int __real_ioctl(int fd, unsigned long request, void *arg);
+int __real_tcflush(int fd, int queue);
+int __real_tcdrain(int fd);
+int __real_tcsetattr(int fd, int actions, const struct termios *config);
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+long __real_syscall(long number, ...);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) { l_Sys[SYS_READ]++; return __real_read(fd, buf, count); }
+ssize_t __wrap_write(int fd, const void *buf, size_t count) { l_Sys[SYS_WRITE]++; return __real_write(fd, buf, count); }
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) { l_Sys[SYS_POLL]++; return __real_poll(fds, nfds, timeout); }
+int __wrap_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo, const sigset_t *sigmask) { l_Sys[SYS_PPOLL]++; return __real_ppoll(fds, nfds, tmo, sigmask); }
+int __wrap_ioctl(int fd, unsigned long request, void *arg) { l_Sys[SYS_IOCTL]++; return __real_ioctl(fd, request, arg); }
+int __wrap_tcflush(int fd, int queue) { l_Sys[SYS_TCFLUSH]++; return __real_tcflush(fd, queue); }
+int __wrap_tcdrain(int fd) { l_Sys[SYS_TCDRAIN]++; return __real_tcdrain(fd); }
+int __wrap_tcsetattr(int fd, int actions, const struct termios *config) { l_Sys[SYS_TCSETATTR]++; return __real_tcsetattr(fd, actions, config); }
+int __wrap_close(int fd) { l_Sys[SYS_CLOSE]++; return __real_close(fd); }
+
+int __wrap_open(const char *path, int flags, ...)
+{
+	va_list args;
+	va_start(args, flags);
+	int mode = (flags & O_CREAT) ? va_arg(args, int) : 0;
+	va_end(args);
+
+	l_Sys[SYS_OPEN]++;
+	return __real_open(path, flags, mode);
+}
+
+/* rs232-uring.c only makes io_uring calls through syscall() */
+long __wrap_syscall(long number, ...)
+{
+	long arg[6];
+	va_list args;
+	va_start(args, number);
+	for (int i = 0; i < 6; i++)
+		arg[i] = va_arg(args, long);
+	va_end(args);
+
+	l_Sys[SYS_URING]++;
+	return __real_syscall(number, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
+}
+
+static uint64_t SysTotal(const uint64_t *counts)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < SYS_COUNT; i++)
+		total += counts[i];
+	return total;
+}
+
+/* Results */
+
+static const char *l_BackendNames[] = { "poll", "uring", "sqpoll" };
+
+typedef struct
+{
+	int baud;
+	int backend;		// COM_BACKEND_
+	int actual;			// rate the port reports after opening
+	int ok;
+	uint64_t setup_syscalls;
+	int transactions;
+	int lost;
+	double rtt_mean, rtt_p50, rtt_p90, rtt_p99, rtt_max;	// us
+	double syscalls_per_transaction;
+	uint64_t syscalls[SYS_COUNT];
+	double pak_bytes_per_sec;
+	double stream_bytes_per_sec;
+	COMSpinStats spin;	// of the rtt test
+} SBenchResult;
+
+static const int l_StandardRates[] =
+{
+	50, 75, 110, 134, 150, 200, 300, 600, 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600,
+	115200, 230400, 460800, 500000, 576000, 921600, 1000000, 1152000, 1500000, 2000000,
+	2500000, 3000000, 3500000, 4000000,
+	250000,		// no Bxxx constant, goes through termios2
+};
+
+static int l_Loopback = 0;
+static int l_Adapter = 0;
+static int l_Transactions = 2000;
+static int l_Spin = 0;		// us, comSetSpinLimit
+static double l_Threshold = 20.0;	// percent
+
+static int64_t BenchMicros(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The pty end: answers each block like the legacy firmware, rx_len bytes */
+
+typedef struct
+{
+	int fd;
+	volatile int running;
+} SPeer;
+
+static int PeerRead(SPeer *peer, unsigned char *data, int len)
+{
+	int got = 0;
+
+	while (got < len)
+	{
+		struct pollfd pfd = { peer->fd, POLLIN, 0 };
+		if (!peer->running)
+			return 0;
+		if (__real_poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		// between two rates nobody has the slave open, the master reads EIO
+		ssize_t res = __real_read(peer->fd, data + got, len - got);
+		if (res <= 0)
+		{
+			usleep(1000);
+			continue;
+		}
+		got += (int) res;
+	}
+
+	return 1;
+}
+
+static void *PeerMain(void *arg)
+{
+	SPeer *peer = arg;
+	unsigned char block[2 + 64];
+	unsigned char reply[64];
+
+	memset(reply, 0x5A, sizeof(reply));
+
+	while (peer->running)
+	{
+		if (!PeerRead(peer, block, 2) || !PeerRead(peer, block + 2, block[0] & 0x3F))
+			break;
+
+		int len = block[1] & 0x3F;
+		if (len > 0 && __real_write(peer->fd, reply, len) != len)
+			break;
+	}
+
+	return NULL;
+}
+
+/* One transaction: a legacy block out, its reply back */
+static int BenchTransaction(int port, int tx_len, int rx_len)
+{
+	unsigned char block[2 + 64];
+	unsigned char reply[2 + 64];
+
+	block[0] = (unsigned char) tx_len;
+	block[1] = (unsigned char) rx_len;
+	block[2] = 0x01;
+	memset(block + 3, 0, tx_len - 1);
+
+	const int expect = l_Loopback ? 2 + tx_len : rx_len;
+	return comTransact(port, (const char *) block, 2 + tx_len, (char *) reply, expect, BENCH_TIMEOUT) == expect;
+}
+
+static int CompareDouble(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void BenchRtt(int port, SBenchResult *r)
+{
+	double *times = malloc(sizeof(double) * l_Transactions);
+	double total = 0;
+	int done = 0;
+
+	uint64_t before[SYS_COUNT];
+	memcpy(before, l_Sys, sizeof(before));
+	comSetSpinLimit(port, l_Spin);
+
+	for (int i = 0; i < l_Transactions; i++)
+	{
+		int64_t start = BenchMicros();
+		if (!BenchTransaction(port, 1, 4))
+		{
+			r->lost++;
+			comFlush(port);
+			continue;
+		}
+		times[done] = (double) (BenchMicros() - start);
+		total += times[done++];
+	}
+
+	for (int i = 0; i < SYS_COUNT; i++)
+		r->syscalls[i] = l_Sys[i] - before[i];
+	comGetSpinStats(port, &r->spin);
+
+	r->transactions = done;
+	if (done > 0)
+	{
+		qsort(times, done, sizeof(double), CompareDouble);
+		r->rtt_mean = total / done;
+		r->rtt_p50 = times[done / 2];
+		r->rtt_p90 = times[done * 90 / 100];
+		r->rtt_p99 = times[done * 99 / 100];
+		r->rtt_max = times[done - 1];
+		r->syscalls_per_transaction = (double) SysTotal(r->syscalls) / l_Transactions;
+	}
+
+	free(times);
+}
+
+static void BenchPak(int port, SBenchResult *r)
+{
+	const int count = l_Transactions / 4;
+	int64_t bytes = 0;
+
+	int64_t start = BenchMicros();
+	for (int i = 0; i < count; i++)
+		if (BenchTransaction(port, 3, 33))
+			bytes += 5 + (l_Loopback ? 5 : 33);
+	int64_t elapsed = BenchMicros() - start;
+
+	r->pak_bytes_per_sec = elapsed > 0 ? bytes * 1e6 / elapsed : 0;
+}
+
+static void BenchStream(int port, SBenchResult *r)
+{
+	const int rounds = l_Transactions / BENCH_STREAM_DEPTH;
+	unsigned char block[2 + BENCH_STREAM_BLOCK];
+	unsigned char reply[(2 + BENCH_STREAM_BLOCK) * BENCH_STREAM_DEPTH];
+	int64_t bytes = 0;
+
+	block[0] = BENCH_STREAM_BLOCK;
+	block[1] = BENCH_STREAM_BLOCK;
+	memset(block + 2, 0x33, BENCH_STREAM_BLOCK);
+
+	const int expect = (l_Loopback ? 2 + BENCH_STREAM_BLOCK : BENCH_STREAM_BLOCK) * BENCH_STREAM_DEPTH;
+
+	int64_t start = BenchMicros();
+	for (int i = 0; i < rounds; i++)
+	{
+		for (int j = 0; j < BENCH_STREAM_DEPTH; j++)
+			comWrite(port, (const char *) block, sizeof(block));
+		int got = comReadTimeout(port, (char *) reply, expect, BENCH_TIMEOUT);
+		if (got > 0)
+			bytes += got;
+		bytes += sizeof(block) * BENCH_STREAM_DEPTH;
+	}
+	int64_t elapsed = BenchMicros() - start;
+
+	r->stream_bytes_per_sec = elapsed > 0 ? bytes * 1e6 / elapsed : 0;
+}
+
+static void BenchRate(const char *device, int baud, int backend, SBenchResult *r)
+{
+	memset(r, 0, sizeof(SBenchResult));
+	r->baud = baud;
+	r->backend = backend;
+
+	int port = comFindPort(device);
+	uint64_t before = SysTotal(l_Sys);
+	comSetBackend(backend);
+	if (port < 0 || !comOpen(port, baud))
+		return;
+	r->setup_syscalls = SysTotal(l_Sys) - before;
+	r->actual = comGetBaudRate(port);
+	// no io_uring here, the numbers would be the poll ones
+	if (comGetBackend(port) != backend)
+	{
+		comClose(port);
+		return;
+	}
+	r->ok = 1;
+
+	// an adapter resets when the port is opened
+	if (l_Adapter)
+		usleep(2000000);
+	comFlush(port);
+
+	BenchRtt(port, r);
+	if (!l_Adapter)
+	{
+		BenchPak(port, r);
+		BenchStream(port, r);
+	}
+
+	comClose(port);
+}
+
+/* JSON */
+
+static void WriteJson(FILE *file, const char *device, const SBenchResult *results, int count)
+{
+	fprintf(file, "{\n  \"version\": %d,\n  \"device\": \"%s\",\n  \"transactions\": %d,\n  \"results\": [\n", BENCH_VERSION, device, l_Transactions);
+
+	for (int i = 0; i < count; i++)
+	{
+		const SBenchResult *r = &results[i];
+
+		fprintf(file, "    { \"baud\": %d, \"backend\": \"%s\", \"actual\": %d, \"ok\": %d, \"setup_syscalls\": %llu, \"lost\": %d,\n",
+			r->baud, l_BackendNames[r->backend], r->actual, r->ok, (unsigned long long) r->setup_syscalls, r->lost);
+		fprintf(file, "      \"rtt_mean_us\": %.2f, \"rtt_p50_us\": %.2f, \"rtt_p90_us\": %.2f, \"rtt_p99_us\": %.2f, \"rtt_max_us\": %.2f,\n",
+			r->rtt_mean, r->rtt_p50, r->rtt_p90, r->rtt_p99, r->rtt_max);
+		fprintf(file, "      \"syscalls_per_transaction\": %.3f, \"syscalls\": {", r->syscalls_per_transaction);
+		for (int s = 0; s < SYS_COUNT; s++)
+			fprintf(file, "%s \"%s\": %llu", s ? "," : "", l_SysNames[s], (unsigned long long) r->syscalls[s]);
+		fprintf(file, " },\n      \"spin_budget_us\": %d, \"spin_caught\": %llu, \"spin_us\": %llu, \"spin_cpu_us\": %llu,\n",
+			r->spin.budgetUs, (unsigned long long) r->spin.caught, (unsigned long long) r->spin.spinUs, (unsigned long long) r->spin.spinCpuUs);
+		fprintf(file, "      \"pak_bytes_per_sec\": %.0f, \"stream_bytes_per_sec\": %.0f }%s\n",
+			r->pak_bytes_per_sec, r->stream_bytes_per_sec, i + 1 < count ? "," : "");
+	}
+
+	fprintf(file, "  ]\n}\n");
+}
+
+/* Value of "key": in text, searching from the start of the result object */
+static double JsonNumber(const char *text, const char *key)
+{
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+
+	const char *at = strstr(text, pattern);
+	return at ? strtod(at + strlen(pattern), NULL) : 0;
+}
+
+/* Backend of a result object, files from before -k are all poll */
+static int JsonBackend(const char *text)
+{
+	const char *at = strstr(text, "\"backend\": \"");
+	if (!at)
+		return COM_BACKEND_POLL;
+	at += strlen("\"backend\": \"");
+
+	for (int i = 0; i < (int) (sizeof(l_BackendNames) / sizeof(l_BackendNames[0])); i++)
+		if (strncmp(at, l_BackendNames[i], strlen(l_BackendNames[i])) == 0 && at[strlen(l_BackendNames[i])] == '"')
+			return i;
+	return -1;
+}
+
+/* Read back the results of a file written by WriteJson */
+static int ReadJson(const char *path, SBenchResult *results, int max)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return -1;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *text = calloc(1, size + 1);
+	if (fread(text, 1, size, file) != (size_t) size)
+		size = 0;
+	fclose(file);
+
+	int count = 0;
+	const char *at = strstr(text, "\"results\"");
+	while (at && count < max && (at = strstr(at, "{ \"baud\":")) != NULL)
+	{
+		// cut the object off at its end so lookups don't run into the next one
+		const char *end = strstr(at, "}\n");
+		char object[1024];
+		snprintf(object, sizeof(object), "%.*s", end ? (int) (end - at) : (int) strlen(at), at);
+
+		SBenchResult *r = &results[count++];
+		memset(r, 0, sizeof(SBenchResult));
+		r->baud = (int) JsonNumber(object, "baud");
+		r->backend = JsonBackend(object);
+		r->ok = (int) JsonNumber(object, "ok");
+		r->setup_syscalls = (uint64_t) JsonNumber(object, "setup_syscalls");
+		r->rtt_p50 = JsonNumber(object, "rtt_p50_us");
+		r->rtt_p99 = JsonNumber(object, "rtt_p99_us");
+		r->syscalls_per_transaction = JsonNumber(object, "syscalls_per_transaction");
+		r->pak_bytes_per_sec = JsonNumber(object, "pak_bytes_per_sec");
+		r->stream_bytes_per_sec = JsonNumber(object, "stream_bytes_per_sec");
+		at = end ? end : at + 1;
+	}
+
+	free(text);
+	return count;
+}
+
+/* Worse by more than the threshold, lower_better tells which way is worse */
+static int Regressed(const char *what, int baud, double base, double now, int lower_better)
+{
+	if (base <= 0)
+		return 0;
+
+	double change = (now - base) * 100.0 / base;
+	int worse = lower_better ? change > l_Threshold : -change > l_Threshold;
+	if (worse)
+		fprintf(stderr, "  %7d %-26s %12.2f -> %12.2f (%+.1f%%)\n", baud, what, base, now, change);
+	return worse;
+}
+
+static int Compare(const char *path, const SBenchResult *results, int count)
+{
+	SBenchResult base[BENCH_MAX_RESULTS];
+	int bases = ReadJson(path, base, BENCH_MAX_RESULTS);
+	int regressions = 0;
+
+	if (bases < 0)
+	{
+		fprintf(stderr, "rs232-bench: can't read baseline %s\n", path);
+		return -1;
+	}
+
+	fprintf(stderr, "compared with %s, threshold %.0f%%:\n", path, l_Threshold);
+	for (int i = 0; i < count; i++)
+	{
+		const SBenchResult *r = &results[i];
+		const SBenchResult *b = NULL;
+
+		for (int j = 0; j < bases; j++)
+			if (base[j].baud == r->baud && base[j].backend == r->backend)
+				b = &base[j];
+		if (!b || !b->ok)
+			continue;
+
+		if (!r->ok)
+		{
+			fprintf(stderr, "  %7d %s doesn't open any more\n", r->baud, l_BackendNames[r->backend]);
+			regressions++;
+			continue;
+		}
+
+		regressions += Regressed("rtt p50 (us)", r->baud, b->rtt_p50, r->rtt_p50, 1);
+		regressions += Regressed("rtt p99 (us)", r->baud, b->rtt_p99, r->rtt_p99, 1);
+		regressions += Regressed("syscalls per transaction", r->baud, b->syscalls_per_transaction, r->syscalls_per_transaction, 1);
+		regressions += Regressed("setup syscalls", r->baud, (double) b->setup_syscalls, (double) r->setup_syscalls, 1);
+		regressions += Regressed("pak bytes/s", r->baud, b->pak_bytes_per_sec, r->pak_bytes_per_sec, 0);
+		regressions += Regressed("stream bytes/s", r->baud, b->stream_bytes_per_sec, r->stream_bytes_per_sec, 0);
+	}
+
+	fprintf(stderr, "%d regressions\n", regressions);
+	return regressions;
+}
+
+/* Main */
+
+static int ParseRates(const char *list, int *rates)
+{
+	int count = 0;
+	char copy[512];
+	snprintf(copy, sizeof(copy), "%s", list);
+
+	for (char *save = NULL, *item = strtok_r(copy, ",", &save); item && count < BENCH_MAX_RATES; item = strtok_r(NULL, ",", &save))
+		rates[count++] = atoi(item);
+	return count;
+}
+
+static int ParseBackends(const char *list, int *backends)
+{
+	int count = 0;
+	char copy[64];
+	snprintf(copy, sizeof(copy), "%s", list);
+
+	for (char *save = NULL, *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save))
+	{
+		int i;
+		for (i = 0; i < (int) (sizeof(l_BackendNames) / sizeof(l_BackendNames[0])); i++)
+			if (strcmp(item, l_BackendNames[i]) == 0)
+				break;
+		if (i == (int) (sizeof(l_BackendNames) / sizeof(l_BackendNames[0])) || count == 3)
+			return 0;
+		backends[count++] = i;
+	}
+	return count;
+}
+
+static void Usage(void)
+{
+	fprintf(stderr,
+		"usage: rs232-bench [options]\n"
+		"  -d DEVICE  real device instead of a pty, an n64io adapter (rtt only)\n"
+		"  -l         the device has a loopback plug, every rate and test works\n"
+		"  -r RATES   comma separated rates (default: the _BaudFlag table and 250000,\n"
+		"             the adapter's 115200 with -d)\n"
+		"  -k LIST    comma separated backends: poll, uring, sqpoll (default poll)\n"
+		"  -n COUNT   transactions per rate (default 2000)\n"
+		"  -s US      spin up to US microseconds for a reply before sleeping (default 0)\n"
+		"  -o FILE    JSON results (default rs232-bench.json)\n"
+		"  -b FILE    compare with a baseline written by -o, exit 1 on a regression\n"
+		"  -t PCT     regression threshold in percent (default 20)\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = NULL;
+	const char *output = "rs232-bench.json";
+	const char *baseline = NULL;
+	int rates[BENCH_MAX_RATES];
+	int count = 0;
+	int backends[3] = { COM_BACKEND_POLL };
+	int backend_count = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:lr:k:n:s:o:b:t:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': device = optarg; break;
+			case 'l': l_Loopback = 1; break;
+			case 'r': count = ParseRates(optarg, rates); break;
+			case 'k':
+				backend_count = ParseBackends(optarg, backends);
+				if (!backend_count)
+				{
+					Usage();
+					return 1;
+				}
+				break;
+			case 'n': l_Transactions = atoi(optarg); break;
+			case 's': l_Spin = atoi(optarg); break;
+			case 'o': output = optarg; break;
+			case 'b': baseline = optarg; break;
+			case 't': l_Threshold = atof(optarg); break;
+			default: Usage(); return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (l_Transactions < BENCH_STREAM_DEPTH * 4)
+		l_Transactions = BENCH_STREAM_DEPTH * 4;
+	l_Adapter = device && !l_Loopback;
+
+	if (!count && l_Adapter)
+		rates[count++] = 115200;
+	if (!count)
+	{
+		for (int i = 0; i < (int) (sizeof(l_StandardRates) / sizeof(l_StandardRates[0])); i++)
+		{
+			int rate = l_StandardRates[i];
+			// what the table knows on this system, plus the termios2 path
+			if (_BaudFlag(rate) != -1 || rate == 250000)
+				rates[count++] = rate;
+		}
+	}
+
+	SPeer peer = { -1, 1 };
+	pthread_t thread;
+	char name[256];
+
+	if (!device)
+	{
+		peer.fd = posix_openpt(O_RDWR | O_NOCTTY);
+		if (peer.fd < 0 || grantpt(peer.fd) < 0 || unlockpt(peer.fd) < 0)
+		{
+			perror("rs232-bench: posix_openpt");
+			return 1;
+		}
+		snprintf(name, sizeof(name), "%s", ptsname(peer.fd));
+
+		// the master side is raw too, or the line discipline echoes
+		struct termios config;
+		if (tcgetattr(peer.fd, &config) == 0)
+		{
+			cfmakeraw(&config);
+			__real_tcsetattr(peer.fd, TCSANOW, &config);
+		}
+
+		pthread_create(&thread, NULL, PeerMain, &peer);
+		device = name;
+	}
+
+	// comOpen talks on stdout
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	// every backend on the same rate one after the other, on the same pty
+	int results_count = count * backend_count;
+	SBenchResult *results = calloc(results_count, sizeof(SBenchResult));
+	for (int i = 0; i < results_count; i++)
+	{
+		BenchRate(device, rates[i / backend_count], backends[i % backend_count], &results[i]);
+		const SBenchResult *r = &results[i];
+		if (!r->ok)
+			fprintf(stderr, "%8d %-6s  can't open %s\n", r->baud, l_BackendNames[r->backend], device);
+		else
+			fprintf(stderr, "%8d %-6s  rtt p50 %7.1f p99 %7.1f max %8.1f us  %5.2f syscalls/tx  setup %2llu  pak %8.0f B/s  stream %9.0f B/s%s\n",
+				r->baud, l_BackendNames[r->backend], r->rtt_p50, r->rtt_p99, r->rtt_max, r->syscalls_per_transaction, (unsigned long long) r->setup_syscalls,
+				r->pak_bytes_per_sec, r->stream_bytes_per_sec, r->lost ? "  (lost replies)" : "");
+		if (r->ok && r->spin.spun)
+			fprintf(stderr, "                 spin budget %d us, caught %llu of %llu, %.1f us CPU/tx\n", r->spin.budgetUs,
+				(unsigned long long) r->spin.caught, (unsigned long long) r->spin.waits, (double) r->spin.spinCpuUs / l_Transactions);
+	}
+
+	if (peer.fd >= 0)
+	{
+		peer.running = 0;
+		pthread_join(thread, NULL);
+		__real_close(peer.fd);
+	}
+	comTerminate();
+
+	FILE *file = fopen(output, "w");
+	if (!file)
+	{
+		perror("rs232-bench: writing the results");
+		return 1;
+	}
+	WriteJson(file, device, results, results_count);
+	fclose(file);
+
+	int res = 0;
+	if (baseline)
+		res = Compare(baseline, results, results_count) != 0;
+
+	free(results);
+	return res;
+}
@@ -0,0 +1,143 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "core.h"
+#include "main/util.h"
+#include "osal/files.h"
+
+static char l_Folder[1024] = ".";
+static int l_Verbosity = M64MSG_WARNING;
+
+void CoreSetFolder(const char *path)
+{
+	snprintf(l_Folder, sizeof(l_Folder), "%s", path);
+}
+
+void CoreSetVerbosity(int level)
+{
+	l_Verbosity = level;
+}
+
+/* api/callbacks.c */
+
+void DebugMessage(int level, const char *message, ...)
+{
+	va_list args;
+
+	if (level > l_Verbosity)
+		return;
+
+	va_start(args, message);
+	fprintf(stderr, "Core: ");
+	vfprintf(stderr, message, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+/* main/util.c */
+
+static char *TrimSpace(char *str)
+{
+	while (isspace((unsigned char) *str))
+		str++;
+
+	char *end = str + strlen(str);
+	while (end > str && isspace((unsigned char) end[-1]))
+		*--end = 0;
+
+	return str;
+}
+
+ini_line ini_parse_line(char **lineptr)
+{
+	ini_line l = { INI_TRASH, NULL, NULL };
+	char *line = *lineptr;
+
+	char *eol = strchr(line, '\n');
+	if (eol)
+	{
+		*eol = 0;
+		*lineptr = eol + 1;
+	}
+	else
+		*lineptr = line + strlen(line);
+
+	line = TrimSpace(line);
+
+	if (*line == 0)
+		l.type = INI_BLANK;
+	else if (*line == '#' || *line == ';')
+	{
+		l.type = INI_COMMENT;
+		l.value = TrimSpace(line + 1);
+	}
+	else if (*line == '[')
+	{
+		char *end = strchr(line, ']');
+		if (end)
+		{
+			*end = 0;
+			l.type = INI_SECTION;
+			l.name = TrimSpace(line + 1);
+		}
+	}
+	else
+	{
+		char *equal = strchr(line, '=');
+		if (equal)
+		{
+			*equal = 0;
+			l.type = INI_PROPERTY;
+			l.name = TrimSpace(line);
+			l.value = TrimSpace(equal + 1);
+		}
+	}
+
+	return l;
+}
+
+char *combinepath(const char *path, const char *file)
+{
+	size_t size = strlen(path) + strlen(file) + 2;
+	char *result = malloc(size);
+
+	if (result)
+		snprintf(result, size, "%s/%s", path, file);
+	return result;
+}
+
+/* osal/files_unix.c */
+
+const char *osal_get_shared_filepath(const char *filename, const char *firstsearch, const char *secondsearch)
+{
+	static char path[2048];
+	(void) firstsearch;
+	(void) secondsearch;
+
+	snprintf(path, sizeof(path), "%s/%s", l_Folder, filename);
+	return path;
+}
+
+const char *osal_get_user_configpath(void)
+{
+	return l_Folder;
+}
+
+const char *osal_get_user_datapath(void)
+{
+	return l_Folder;
+}
+
+const char *osal_get_user_cachepath(void)
+{
+	return l_Folder;
+}
+
+int osal_mkdirp(const char *dirpath, int mode)
+{
+	return mkdir(dirpath, mode) == 0 ? 0 : 1;
+}
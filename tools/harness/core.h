@@ -0,0 +1,18 @@
+#ifndef __HARNESS_CORE_H__
+#define __HARNESS_CORE_H__
+
+/* Stub mupen64plus core: the real config API (api/config.c and api/common.c
+ * from src/mupen64plus) on top of the few core internals they need */
+
+#include "m64p_types.h"
+
+/* Folder for mupen64plus.cfg and the cache, set before ConfigInit */
+extern void CoreSetFolder(const char *path);
+
+/* Messages of the config code, level as in m64p_msg_level */
+extern void CoreSetVerbosity(int level);
+
+extern m64p_error ConfigInit(const char *ConfigDirOverride, const char *DataDirOverride);
+extern m64p_error ConfigShutdown(void);
+
+#endif // __HARNESS_CORE_H__
@@ -0,0 +1,730 @@
+/* n64io-harness: drives the built plugin like mupen64plus would.
+ *
+ * Loads the plugin .so, starts it against the stub core (the real config
+ * code of the core, see core.h), then runs PIF frames at the VI rate of an
+ * NTSC (60 Hz) or PAL (50 Hz) console following the polling pattern of a
+ * kind of game, and reports how long each frame spent inside the plugin.
+ * Settings of the Input-Serial section are given as Key=Value arguments,
+ * so together with n64io-sim it runs without any hardware:
+ *
+ *   ./n64io-sim -l /tmp/n64io -p mpk:test.mpk &
+ *   ./n64io-harness -s pakscan ./mupen64plus-input-serial-x86_64.so Enabled1=1 Serial1=pty:/tmp/n64io */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define M64P_CORE_PROTOTYPES 1
+#include "m64p_config.h"
+#include "m64p_plugin.h"
+#include "m64p_types.h"
+
+#include "core.h"
+#include "joybus.h"
+
+#define HARNESS_CMD		64		// room for a channel block with its reply
+#define HARNESS_PIF_MAX	16		// PIF exchanges in one VI frame
+
+typedef m64p_error (*ptr_PluginStartupFunc)(m64p_dynlib_handle, void *, void (*)(void *, int, const char *));
+typedef m64p_error (*ptr_PluginShutdownFunc)(void);
+typedef void (*ptr_InitiateControllersFunc)(CONTROL_INFO);
+typedef int (*ptr_RomOpenFunc)(void);
+typedef void (*ptr_RomClosedFunc)(void);
+typedef void (*ptr_ControllerCommandFunc)(int, unsigned char *);
+typedef void (*ptr_ReadControllerFunc)(int, unsigned char *);
+
+typedef struct
+{
+	ptr_PluginStartupFunc PluginStartup;
+	ptr_PluginShutdownFunc PluginShutdown;
+	ptr_InitiateControllersFunc InitiateControllers;
+	ptr_RomOpenFunc RomOpen;
+	ptr_RomClosedFunc RomClosed;
+	ptr_ControllerCommandFunc ControllerCommand;
+	ptr_ReadControllerFunc ReadController;
+} SPlugin;
+
+/* One PIF exchange: a block per channel, empty if cmd[0] == 0 */
+typedef struct
+{
+	unsigned char cmd[4][HARNESS_CMD];
+} SPif;
+
+typedef struct SScript SScript;
+
+struct SScript
+{
+	const char *name;
+	const char *description;
+	// fill in the PIF exchanges of VI frame n, returns how many
+	int (*frame)(int n, SPif *pif);
+	// optional, sees every command of channel c once it is done, returns 0
+	// if the reply is wrong
+	int (*check)(int c, const unsigned char *cmd);
+};
+
+typedef struct
+{
+	int64_t plugin_ns;	// inside the plugin during this VI frame
+	int exchanges;
+	int no_response;
+	int bad_crc;
+	int wrong;		// replies the script's check turned down
+} SFrameResult;
+
+static SPlugin l_Plugin;
+static CONTROL l_Controls[4];
+static int l_Verbose = 0;
+
+static int64_t HarnessNanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void HarnessSleepUntil(int64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Commands the games send */
+
+static void PifState(unsigned char *cmd)
+{
+	cmd[0] = 1;
+	cmd[1] = 4;
+	cmd[2] = JOYBUS_CMD_STATE;
+	memset(cmd + 3, 0xFF, 4);
+}
+
+static void PifInfo(unsigned char *cmd)
+{
+	cmd[0] = 1;
+	cmd[1] = 3;
+	cmd[2] = JOYBUS_CMD_INFO;
+	memset(cmd + 3, 0xFF, 3);
+}
+
+static void PifRead(unsigned char *cmd, unsigned int address)
+{
+	JoybusPakRead(cmd, address);
+	memset(JOYBUS_RX_DATA(cmd), 0xFF, 1 + JOYBUS_PAK_BLOCK);
+}
+
+static void PifWrite(unsigned char *cmd, unsigned int address, unsigned char value)
+{
+	unsigned char data[JOYBUS_PAK_BLOCK];
+
+	memset(data, value, sizeof(data));
+	JoybusPakWrite(cmd, address, data);
+	JOYBUS_RX_DATA(cmd)[0] = 0xFF;
+}
+
+/* The same command for every controller */
+static void PifAll(SPif *pif, void (*make)(unsigned char *))
+{
+	for (int i = 0; i < 4; i++)
+		make(pif->cmd[i]);
+}
+
+/* Scripts */
+
+/* Most games: controller state once per frame, status now and then */
+static int ScriptButtons(int n, SPif *pif)
+{
+	PifAll(&pif[0], n % 60 == 0 ? PifInfo : PifState);
+	return 1;
+}
+
+/* Controller Pak manager: reads the whole pak, a few blocks per frame,
+   and keeps polling the buttons */
+static int ScriptPakScan(int n, SPif *pif)
+{
+	const int per_frame = 4;
+	int count = 0;
+
+	PifAll(&pif[count++], PifState);
+
+	for (int i = 0; i < per_frame; i++)
+	{
+		unsigned int block = (unsigned int) (n * per_frame + i) % (0x8000 / JOYBUS_PAK_BLOCK);
+		for (int c = 0; c < 4; c++)
+			PifRead(pif[count].cmd[c], block * JOYBUS_PAK_BLOCK);
+		count++;
+	}
+
+	return count;
+}
+
+/* Transfer Pak game booting: power on, select the cartridge bank, check
+   the status, read the header and then the first ROM banks */
+static int ScriptTpakBoot(int n, SPif *pif)
+{
+	const int per_frame = 8;
+	int count = 0;
+
+	PifAll(&pif[count++], PifState);
+
+	for (int c = 0; c < 4; c++)
+	{
+		for (int i = 0; i < per_frame; i++)
+		{
+			int step = n * per_frame + i;
+			unsigned char *cmd = pif[1 + i].cmd[c];
+
+			if (step == 0)
+				PifWrite(cmd, 0x8000, 0x84);
+			else if (step == 1)
+				PifRead(cmd, 0x8000);
+			else if (step == 2)
+				PifWrite(cmd, 0xA000, 0x00);
+			else if (step == 3)
+				PifWrite(cmd, 0xB000, 0x01);
+			else if (step == 4)
+				PifRead(cmd, 0xB000);
+			else if (step < 8)
+				PifRead(cmd, 0xC100 + (step - 5) * JOYBUS_PAK_BLOCK);
+			else
+			{
+				// two 16 KB GB banks through the 0xC000 window, then over again
+				int block = (step - 8) % 1024;
+				if (block % 512 == 0)
+					PifWrite(cmd, 0xA000, (unsigned char) (block / 512));
+				else
+					PifRead(cmd, 0xC000 + (block % 512) * JOYBUS_PAK_BLOCK);
+			}
+		}
+	}
+
+	return count + per_frame;
+}
+
+/* Test cartridge of the mbc1 script: 1 MB MBC1, every 32 byte block starts
+   with its ROM bank and the rest follows from its offset */
+#define MBC1_ROM_SIZE	0x100000
+#define MBC1_BANK_STEPS	24
+#define MBC1_PER_FRAME	8
+
+static unsigned char Mbc1RomByte(uint32_t offset)
+{
+	if ((offset & 0x1F) == 0)
+		return (unsigned char) (offset >> 14);
+	return (unsigned char) ((offset >> 5) + (offset & 0x1F));
+}
+
+static int Mbc1WriteRom(const char *path)
+{
+	unsigned char *rom = malloc(MBC1_ROM_SIZE);
+	unsigned int sum = 0;
+
+	for (uint32_t i = 0; i < MBC1_ROM_SIZE; i++)
+		rom[i] = Mbc1RomByte(i);
+
+	memset(rom + 0x134, 0, 0x1C);
+	memcpy(rom + 0x134, "N64IO MBC1", 10);
+	rom[0x147] = 0x01;	// MBC1
+	rom[0x148] = 0x05;	// 1 MB
+	rom[0x149] = 0x00;	// no RAM
+
+	unsigned char check = 0;
+	for (int i = 0x134; i < 0x14D; i++)
+		check = (unsigned char) (check - rom[i] - 1);
+	rom[0x14D] = check;
+
+	for (uint32_t i = 0; i < MBC1_ROM_SIZE; i++)
+		if (i != 0x14E && i != 0x14F)
+			sum += rom[i];
+	rom[0x14E] = (unsigned char) (sum >> 8);
+	rom[0x14F] = (unsigned char) sum;
+
+	FILE *file = fopen(path, "wb");
+	int ok = file && fwrite(rom, 1, MBC1_ROM_SIZE, file) == MBC1_ROM_SIZE;
+	if (file && fclose(file) != 0)
+		ok = 0;
+	if (!ok)
+		perror("n64io-harness: writing the test cartridge");
+
+	free(rom);
+	return ok;
+}
+
+/* The cartridge as the replies tell it, per channel: 0xC000 window and MBC1
+   registers, -1 when a write to it went missing */
+typedef struct
+{
+	int window;
+	int lo;
+	int hi;
+	int mode;
+} SMbc1Cart;
+
+static SMbc1Cart l_Mbc1Carts[4] = { { -1, -1, -1, -1 }, { -1, -1, -1, -1 }, { -1, -1, -1, -1 }, { -1, -1, -1, -1 } };
+
+/* One step of the mbc1 script. After the boot every bank is selected in
+   mode 1 through the MBC registers (GB 0x2000, 0x4000 and 0x6000 through
+   the 0xC000 window) and read at 0x4000, then the 0x0000 region, which mode
+   1 moves to bank 0x20 on the upper half. Each bank comes right after the
+   one 512 KB below, which it would be mixed up with. */
+static void Mbc1Step(int step, unsigned char *cmd)
+{
+	if (step == 0)
+		PifWrite(cmd, 0x8000, 0x84);
+	else if (step == 1)
+		PifWrite(cmd, 0xA000, 0x00);
+	else if (step == 2)
+		PifWrite(cmd, 0xB000, 0x01);
+	else if (step == 3)
+		PifRead(cmd, 0xB000);
+	else if (step == 4)
+		PifRead(cmd, 0xC140);
+	else
+	{
+		int index = (step - 5) / MBC1_BANK_STEPS % 0x40;
+		int s = (step - 5) % MBC1_BANK_STEPS;
+		int bank = (index >> 1) | ((index & 1) << 5);
+
+		if (s == 0 || s == 19)
+			PifWrite(cmd, 0xA000, 0x00);
+		else if (s == 1)
+			PifWrite(cmd, 0xE000, (unsigned char) (bank & 0x1F));
+		else if (s == 2)
+			PifWrite(cmd, 0xA000, 0x01);
+		else if (s == 3)
+			PifWrite(cmd, 0xC000, (unsigned char) (bank >> 5));
+		else if (s == 4)
+			PifWrite(cmd, 0xE000, 0x01);
+		else if (s < 19)
+			PifRead(cmd, 0xC000 + (s - 5) * 0x400);
+		else
+			PifRead(cmd, 0xD000 + (s - 20) * 0x400);
+	}
+}
+
+/* Transfer Pak with the big MBC1 cartridge of -g, 8 blocks a frame */
+static int ScriptMbc1(int n, SPif *pif)
+{
+	PifAll(&pif[0], PifState);
+
+	for (int c = 0; c < 4; c++)
+		for (int i = 0; i < MBC1_PER_FRAME; i++)
+			Mbc1Step(n * MBC1_PER_FRAME + i, pif[1 + i].cmd[c]);
+
+	return 1 + MBC1_PER_FRAME;
+}
+
+/* Follows the writes and checks the ROM reads against the cartridge they
+   add up to. A game would retry a lost write, the script goes on, so unless
+   landed says the lost ones were carried out anyway, whatever a lost write
+   touched isn't checked until it is written again. */
+static int Mbc1Check(int c, const unsigned char *cmd, int landed)
+{
+	SMbc1Cart *cart = &l_Mbc1Carts[c];
+	int lost = (cmd[1] & JOYBUS_NO_RESPONSE) != 0 && !landed;
+	int read = JOYBUS_IS_PAK_READ(cmd);
+
+	if (!read && !JOYBUS_IS_PAK_WRITE(cmd))
+		return 1;
+
+	unsigned int address = JOYBUS_PAK_ADDRESS(cmd);
+	if (!read)
+	{
+		int value = JOYBUS_PAK_DATA(cmd)[JOYBUS_PAK_BLOCK - 1];
+
+		if (!landed && JOYBUS_RX_DATA(cmd)[0] != JoybusDataCrc(JOYBUS_PAK_DATA(cmd)))
+			lost = 1;
+
+		if (address >= 0xA000 && address < 0xB000)
+			cart->window = lost ? -1 : value & 0x03;
+		else if (address >= 0xC000 && cart->window < 0)
+			cart->lo = cart->hi = cart->mode = -1;
+		else if (address >= 0xC000)
+		{
+			unsigned int gb = cart->window * 0x4000 + (address - 0xC000);
+			if (gb >= 0x2000 && gb < 0x4000)
+				cart->lo = lost ? -1 : value & 0x1F;
+			else if (gb >= 0x4000 && gb < 0x6000)
+				cart->hi = lost ? -1 : value & 0x03;
+			else if (gb >= 0x6000 && gb < 0x8000)
+				cart->mode = lost ? -1 : value & 0x01;
+		}
+		return 1;
+	}
+
+	if ((cmd[1] & JOYBUS_NO_RESPONSE) || address < 0xC000 || cart->window < 0)
+		return 1;
+
+	unsigned int gb = cart->window * 0x4000 + (address - 0xC000);
+	int64_t offset;
+	if (gb < 0x150 || gb >= 0x8000)
+		return 1;	// the header isn't made of the pattern
+	if (gb < 0x4000 && !cart->mode)
+		offset = gb;
+	else if (gb < 0x4000 && cart->mode > 0 && cart->hi >= 0)
+		offset = (int64_t) (cart->hi << 5) * 0x4000 + gb;
+	else if (gb >= 0x4000 && cart->hi >= 0 && cart->lo >= 0)
+		offset = (int64_t) ((cart->hi << 5) | (cart->lo ? cart->lo : 1)) * 0x4000 + (gb - 0x4000);
+	else
+		return 1;
+
+	const unsigned char *rx = JOYBUS_RX_DATA(cmd);
+	for (int b = 0; b < JOYBUS_PAK_BLOCK; b++)
+		if (rx[b] != Mbc1RomByte((uint32_t) (offset + b)))
+			return 0;
+	return 1;
+}
+
+static int CheckMbc1(int c, const unsigned char *cmd)
+{
+	return Mbc1Check(c, cmd, 0);
+}
+
+/* Against n64io-sim -D with Framing, where every write reaches the
+   cartridge and only some replies are lost */
+static int CheckMbc1Lost(int c, const unsigned char *cmd)
+{
+	return Mbc1Check(c, cmd, 1);
+}
+
+/* Rumble: enable the pak, then switch the motor every quarter second */
+static int ScriptRumble(int n, SPif *pif)
+{
+	int count = 0;
+
+	PifAll(&pif[count++], PifState);
+
+	for (int c = 0; c < 4; c++)
+	{
+		unsigned char *cmd = pif[count].cmd[c];
+
+		if (n == 0)
+			PifWrite(cmd, 0x8000, 0xFE);
+		else if (n == 1)
+			PifWrite(cmd, 0x8000, 0x80);
+		else if (n == 2)
+			PifRead(cmd, 0x8000);
+		else if (n % 15 == 0)
+			PifWrite(cmd, 0xC000, (unsigned char) ((n / 15) & 1));
+		else
+			PifState(cmd);
+	}
+
+	return count + 1;
+}
+
+static const SScript l_Scripts[] =
+{
+	{ "buttons", "controller state every frame, status every second", ScriptButtons },
+	{ "pakscan", "Controller Pak manager reading the whole pak, 4 blocks a frame", ScriptPakScan },
+	{ "tpak", "Transfer Pak boot and ROM reads, 8 blocks a frame", ScriptTpakBoot },
+	{ "rumble", "Rumble Pak init, motor switched every 15 frames", ScriptRumble },
+	{ "mbc1", "Transfer Pak with the 1 MB MBC1 cartridge of -g in mode 1, checks the data", ScriptMbc1, CheckMbc1 },
+	{ "mbc1lost", "mbc1 where writes without a reply still count (n64io-sim -D, Framing)", ScriptMbc1, CheckMbc1Lost },
+};
+
+#define SCRIPTS	((int) (sizeof(l_Scripts) / sizeof(l_Scripts[0])))
+
+/* Running it */
+
+static void HarnessDebug(void *context, int level, const char *message)
+{
+	(void) context;
+	if (level <= M64MSG_WARNING || l_Verbose)
+		fprintf(stderr, "Input-Serial: %s\n", message);
+}
+
+static int HarnessLoad(const char *path)
+{
+	void *so = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!so)
+	{
+		fprintf(stderr, "n64io-harness: %s\n", dlerror());
+		return 0;
+	}
+
+	l_Plugin.PluginStartup = (ptr_PluginStartupFunc) dlsym(so, "PluginStartup");
+	l_Plugin.PluginShutdown = (ptr_PluginShutdownFunc) dlsym(so, "PluginShutdown");
+	l_Plugin.InitiateControllers = (ptr_InitiateControllersFunc) dlsym(so, "InitiateControllers");
+	l_Plugin.RomOpen = (ptr_RomOpenFunc) dlsym(so, "RomOpen");
+	l_Plugin.RomClosed = (ptr_RomClosedFunc) dlsym(so, "RomClosed");
+	l_Plugin.ControllerCommand = (ptr_ControllerCommandFunc) dlsym(so, "ControllerCommand");
+	l_Plugin.ReadController = (ptr_ReadControllerFunc) dlsym(so, "ReadController");
+
+	if (!l_Plugin.PluginStartup || !l_Plugin.PluginShutdown || !l_Plugin.InitiateControllers || !l_Plugin.RomOpen
+		|| !l_Plugin.RomClosed || !l_Plugin.ControllerCommand || !l_Plugin.ReadController)
+	{
+		fprintf(stderr, "n64io-harness: %s is not an input plugin\n", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Key=Value into Input-Serial, typed the way the core reads mupen64plus.cfg */
+static int HarnessSetting(const char *setting)
+{
+	char name[256];
+	m64p_handle section;
+
+	const char *equal = strchr(setting, '=');
+	if (!equal || equal == setting || (size_t) (equal - setting) >= sizeof(name))
+	{
+		fprintf(stderr, "n64io-harness: expected Key=Value, got %s\n", setting);
+		return 0;
+	}
+	snprintf(name, sizeof(name), "%.*s", (int) (equal - setting), setting);
+	const char *value = equal + 1;
+
+	if (ConfigOpenSection("Input-Serial", &section) != M64ERR_SUCCESS)
+		return 0;
+
+	char *end;
+	long number = strtol(value, &end, 10);
+
+	if (strcasecmp(value, "true") == 0 || strcasecmp(value, "false") == 0)
+	{
+		int flag = strcasecmp(value, "true") == 0;
+		return ConfigSetParameter(section, name, M64TYPE_BOOL, &flag) == M64ERR_SUCCESS;
+	}
+	if (*value && !*end)
+	{
+		int integer = (int) number;
+		return ConfigSetParameter(section, name, M64TYPE_INT, &integer) == M64ERR_SUCCESS;
+	}
+	return ConfigSetParameter(section, name, M64TYPE_STRING, value) == M64ERR_SUCCESS;
+}
+
+/* One PIF exchange the way the core does it: every channel block is handed
+   to ControllerCommand, then to ReadController, then the end of the frame */
+static void HarnessExchange(const SScript *script, SPif *pif, SFrameResult *result)
+{
+	int64_t start = HarnessNanos();
+
+	for (int i = 0; i < 4; i++)
+		if (l_Controls[i].Present && pif->cmd[i][0])
+			l_Plugin.ControllerCommand(i, pif->cmd[i]);
+
+	for (int i = 0; i < 4; i++)
+		if (l_Controls[i].Present && pif->cmd[i][0])
+			l_Plugin.ReadController(i, pif->cmd[i]);
+
+	l_Plugin.ReadController(-1, NULL);
+
+	result->plugin_ns += HarnessNanos() - start;
+	result->exchanges++;
+
+	for (int i = 0; i < 4; i++)
+	{
+		unsigned char *cmd = pif->cmd[i];
+
+		if (!l_Controls[i].Present || !cmd[0])
+			continue;
+
+		if (cmd[1] & JOYBUS_NO_RESPONSE)
+			result->no_response++;
+		else if (JOYBUS_IS_PAK_READ(cmd) && JOYBUS_RX_DATA(cmd)[JOYBUS_PAK_BLOCK] != JoybusDataCrc(JOYBUS_RX_DATA(cmd)))
+		{
+			result->bad_crc++;
+			continue;
+		}
+
+		if (script->check && !script->check(i, cmd))
+			result->wrong++;
+	}
+}
+
+static int CompareTimes(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static void HarnessReport(const SScript *script, int hz, const SFrameResult *results, int frames, int64_t late)
+{
+	int64_t *times = malloc(sizeof(int64_t) * frames);
+	int64_t total = 0;
+	int exchanges = 0, no_response = 0, bad_crc = 0, wrong = 0, over = 0;
+	const int64_t budget = 1000000000 / hz;
+
+	for (int i = 0; i < frames; i++)
+	{
+		times[i] = results[i].plugin_ns;
+		total += results[i].plugin_ns;
+		exchanges += results[i].exchanges;
+		no_response += results[i].no_response;
+		bad_crc += results[i].bad_crc;
+		wrong += results[i].wrong;
+		if (results[i].plugin_ns > budget)
+			over++;
+	}
+	qsort(times, frames, sizeof(int64_t), CompareTimes);
+
+	printf("script %s, %d frames at %d Hz, %d PIF exchanges\n", script->name, frames, hz, exchanges);
+	printf("plugin time per frame: avg %lld us, p50 %lld us, p90 %lld us, p99 %lld us, max %lld us\n",
+		(long long) (total / frames / 1000),
+		(long long) (times[frames / 2] / 1000),
+		(long long) (times[frames * 90 / 100] / 1000),
+		(long long) (times[frames * 99 / 100] / 1000),
+		(long long) (times[frames - 1] / 1000));
+	printf("frames over the %lld us budget: %d, frames started late: %lld\n", (long long) (budget / 1000), over, (long long) late);
+	printf("no response: %d, bad pak data CRC: %d", no_response, bad_crc);
+	if (script->check)
+		printf(", wrong data: %d", wrong);
+	printf("\n");
+
+	free(times);
+}
+
+static void HarnessUsage(void)
+{
+	fprintf(stderr,
+		"usage: n64io-harness [options] plugin.so [Key=Value ...]\n"
+		"  -s SCRIPT  polling pattern to play (default buttons):\n");
+	for (int i = 0; i < SCRIPTS; i++)
+		fprintf(stderr, "               %-8s %s\n", l_Scripts[i].name, l_Scripts[i].description);
+	fprintf(stderr,
+		"  -r HZ      VI rate, 60 (NTSC, default) or 50 (PAL)\n"
+		"  -f FRAMES  frames to run (default 600)\n"
+		"  -c DIR     folder for mupen64plus.cfg and the cache (default: a new temporary one)\n"
+		"  -o FILE    write the time inside the plugin of every frame to FILE\n"
+		"  -v         show all plugin messages\n"
+		"  -g FILE    write the cartridge of the mbc1 script to FILE (for n64io-sim -p tpak:FILE) and exit\n"
+		"Key=Value set options of the Input-Serial section, e.g. Enabled1=true Serial1=pty:/tmp/n64io\n");
+}
+
+int main(int argc, char **argv)
+{
+	const SScript *script = &l_Scripts[0];
+	const char *folder = NULL;
+	const char *output = NULL;
+	char temp[] = "/tmp/n64io-harness-XXXXXX";
+	int hz = 60;
+	int frames = 600;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:r:f:c:o:g:vh")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				script = NULL;
+				for (int i = 0; i < SCRIPTS; i++)
+					if (strcmp(optarg, l_Scripts[i].name) == 0)
+						script = &l_Scripts[i];
+				if (!script)
+				{
+					HarnessUsage();
+					return 1;
+				}
+				break;
+			case 'r': hz = atoi(optarg); break;
+			case 'f': frames = atoi(optarg); break;
+			case 'c': folder = optarg; break;
+			case 'o': output = optarg; break;
+			case 'v': l_Verbose = 1; break;
+			case 'g': return Mbc1WriteRom(optarg) ? 0 : 1;
+			default: HarnessUsage(); return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind >= argc || (hz != 50 && hz != 60) || frames < 1)
+	{
+		HarnessUsage();
+		return 1;
+	}
+
+	if (!folder && !(folder = mkdtemp(temp)))
+	{
+		perror("n64io-harness: mkdtemp");
+		return 1;
+	}
+	CoreSetFolder(folder);
+	CoreSetVerbosity(l_Verbose ? M64MSG_VERBOSE : M64MSG_WARNING);
+
+	if (ConfigInit(folder, NULL) != M64ERR_SUCCESS)
+		return 1;
+
+	for (int i = optind + 1; i < argc; i++)
+		if (!HarnessSetting(argv[i]))
+			return 1;
+
+	if (!HarnessLoad(argv[optind]))
+		return 1;
+
+	// the plugin looks the config API up in the program, which is the core
+	m64p_error res = l_Plugin.PluginStartup(dlopen(NULL, RTLD_NOW), NULL, HarnessDebug);
+	if (res != M64ERR_SUCCESS)
+	{
+		fprintf(stderr, "n64io-harness: PluginStartup failed (%d)\n", res);
+		return 1;
+	}
+
+	CONTROL_INFO info;
+	memset(&info, 0, sizeof(info));
+	memset(l_Controls, 0, sizeof(l_Controls));
+	info.Controls = l_Controls;
+	l_Plugin.InitiateControllers(info);
+
+	int present = 0;
+	for (int i = 0; i < 4; i++)
+		present += l_Controls[i].Present;
+	if (!present)
+		fprintf(stderr, "n64io-harness: no controller is enabled, set Enabled1=true and Serial1\n");
+
+	l_Plugin.RomOpen();
+
+	SFrameResult *results = calloc(frames, sizeof(SFrameResult));
+	const int64_t period = 1000000000 / hz;
+	int64_t next = HarnessNanos();
+	int64_t late = 0;
+
+	for (int n = 0; n < frames; n++)
+	{
+		SPif pif[HARNESS_PIF_MAX];
+
+		// the VI interrupt, the game polls right after it
+		if (HarnessNanos() > next + period / 2)
+			late++;
+		HarnessSleepUntil(next);
+		next += period;
+
+		memset(pif, 0, sizeof(pif));
+		int count = script->frame(n, pif);
+		for (int i = 0; i < count; i++)
+			HarnessExchange(script, &pif[i], &results[n]);
+	}
+
+	l_Plugin.RomClosed();
+	l_Plugin.PluginShutdown();
+
+	HarnessReport(script, hz, results, frames, late);
+
+	if (output)
+	{
+		FILE *file = fopen(output, "w");
+		if (file)
+		{
+			fprintf(file, "# frame plugin_us exchanges no_response bad_crc wrong\n");
+			for (int n = 0; n < frames; n++)
+				fprintf(file, "%d %.1f %d %d %d %d\n", n, results[n].plugin_ns / 1000.0, results[n].exchanges, results[n].no_response, results[n].bad_crc, results[n].wrong);
+			fclose(file);
+		}
+		else
+			perror("n64io-harness: writing the frame times");
+	}
+
+	free(results);
+	ConfigShutdown();
+	return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __HARNESS_UTIL_H__
+#define __HARNESS_UTIL_H__
+
+/* The parts of the core's main/util.h that api/config.c uses */
+
+typedef enum
+{
+	INI_BLANK,
+	INI_COMMENT,
+	INI_SECTION,
+	INI_PROPERTY,
+	INI_TRASH
+} ini_line_type;
+
+typedef struct
+{
+	ini_line_type type;
+	char *name;
+	char *value;
+} ini_line;
+
+/* Parse the line at *lineptr in place and move *lineptr to the next one */
+extern ini_line ini_parse_line(char **lineptr);
+
+/* path/file, malloc'd */
+extern char *combinepath(const char *path, const char *file);
+
+#endif // __HARNESS_UTIL_H__
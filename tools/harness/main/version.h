@@ -0,0 +1,14 @@
+#ifndef __HARNESS_VERSION_H__
+#define __HARNESS_VERSION_H__
+
+/* Versions the stub core reports, new enough for the plugin */
+
+#define MUPEN_CORE_NAME			"Input-Serial test harness"
+#define MUPEN_CORE_VERSION		0x020600
+
+#define FRONTEND_API_VERSION	0x020106
+#define CONFIG_API_VERSION		0x020302
+#define DEBUG_API_VERSION		0x020001
+#define VIDEXT_API_VERSION		0x030300
+
+#endif // __HARNESS_VERSION_H__
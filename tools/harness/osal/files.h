@@ -0,0 +1,12 @@
+#ifndef __HARNESS_FILES_H__
+#define __HARNESS_FILES_H__
+
+/* The core's osal/files.h, all user folders are the harness config folder */
+
+extern const char *osal_get_shared_filepath(const char *filename, const char *firstsearch, const char *secondsearch);
+extern const char *osal_get_user_configpath(void);
+extern const char *osal_get_user_datapath(void);
+extern const char *osal_get_user_cachepath(void);
+extern int osal_mkdirp(const char *dirpath, int mode);
+
+#endif // __HARNESS_FILES_H__
@@ -0,0 +1,8 @@
+#ifndef __HARNESS_PREPROC_H__
+#define __HARNESS_PREPROC_H__
+
+#include <strings.h>
+
+#define osal_insensitive_strcmp(x, y) strcasecmp(x, y)
+
+#endif // __HARNESS_PREPROC_H__
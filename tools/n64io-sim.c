@@ -0,0 +1,835 @@
+/* n64io-sim: simulated adapter firmware on a pseudo terminal.
+ *
+ * Speaks the same bytes as the stump/n64io firmware so the plugin can be
+ * run and timed without hardware: the legacy protocol (raw PIF channel
+ * blocks, exactly rx_len reply bytes) and, after the probe 03 00 FE 'N' 'F',
+ * the framed protocol of src/frame.h with one controller per channel.
+ * Each controller can carry a Controller Pak backed by a .mpk file, a Rumble
+ * Pak or a Transfer Pak with a Game Boy ROM and its .sav. Replies are held
+ * back by a per-transaction and a per-byte latency, optionally rounded up
+ * to USB frames, to model the adapter, the baud rate and the USB bridge.
+ *
+ * Point the plugin at it with Serial = <the -l link> or pty:<path>. Closing
+ * the port resets the firmware to the legacy protocol, like the reset an
+ * Arduino does when the port is opened. SIGUSR1 unplugs it and plugs it
+ * back in on a new pty. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "joybus.h"
+#include "frame.h"
+
+#define SIM_VERSION			1		// framed protocol version in the hello frame
+#define SIM_CONTROLLERS		4
+#define MEMPAK_SIZE			0x8000
+
+static const unsigned char l_Probe[] = { 0x03, 0x00, 0xFE, 'N', 'F' };
+
+enum { PAK_NONE, PAK_MEMPAK, PAK_RUMBLE, PAK_TPAK };
+enum { MBC_NONE, MBC_1, MBC_2, MBC_3, MBC_5 };
+
+/* Game Boy cartridge in a Transfer Pak */
+typedef struct
+{
+	unsigned char *rom;
+	uint32_t rom_size;
+	unsigned char *ram;
+	uint32_t ram_size;
+	int ram_fd;			// .sav, written through, -1 if none
+	int mbc;
+	int ram_enabled;
+	int rom_lo;
+	int rom_hi;
+	int ram_bank;
+	int mode;
+} SCart;
+
+typedef struct
+{
+	int pak;
+
+	// Controller Pak
+	unsigned char mempak[MEMPAK_SIZE];
+	int mempak_fd;
+
+	// Rumble Pak
+	int rumble_enabled;
+	int motor;
+
+	// Transfer Pak
+	int tpak_power;
+	int tpak_bank;
+	int tpak_access;
+	int tpak_reset;		// reported once in the status register after power on
+	SCart cart;
+
+	int address_error;	// last pak address had a bad CRC
+	uint32_t polls;
+} SSimController;
+
+static SSimController l_Controllers[SIM_CONTROLLERS];
+static int l_Count = 1;
+
+static int l_ByteUs = 0;
+static int l_TransactionUs = 0;
+static int l_UsbFrameUs = 0;
+static int l_LegacyOnly = 0;
+static int l_Animate = 0;
+static int l_Verbose = 0;
+static int l_DropWrites = 0;	// carry out every Nth pak write without answering it, 0 never
+static int l_PakWrites = 0;
+
+static const char *l_Link = NULL;
+static int l_Master = -1;
+static int l_Framed = 0;
+static int64_t l_BusyUntil = 0;
+
+static volatile sig_atomic_t l_Running = 1;
+static volatile sig_atomic_t l_Replug = 0;
+
+static int64_t l_Transactions = 0;
+static int64_t l_Resyncs = 0;
+
+static int64_t SimMicros(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void SimSleepUntil(int64_t us)
+{
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && l_Running)
+		;
+}
+
+/* Game Boy cartridge */
+
+static int CartMbc(unsigned char type)
+{
+	if (type >= 0x01 && type <= 0x03) return MBC_1;
+	if (type >= 0x05 && type <= 0x06) return MBC_2;
+	if (type >= 0x0F && type <= 0x13) return MBC_3;
+	if (type >= 0x19 && type <= 0x1E) return MBC_5;
+	return MBC_NONE;
+}
+
+static uint32_t CartRamSize(const SCart *cart, unsigned char code)
+{
+	static const uint32_t sizes[] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+
+	if (cart->mbc == MBC_2)
+		return 0x200;
+	return code < sizeof(sizes) / sizeof(sizes[0]) ? sizes[code] : 0;
+}
+
+static int CartRomBank(const SCart *cart)
+{
+	switch (cart->mbc)
+	{
+		case MBC_1:	return ((cart->rom_hi << 5) | (cart->rom_lo ? cart->rom_lo : 1));
+		case MBC_2:	return cart->rom_lo ? cart->rom_lo : 1;
+		case MBC_3:	return cart->rom_lo ? cart->rom_lo : 1;
+		case MBC_5:	return (cart->rom_hi << 8) | cart->rom_lo;
+		default:	return 1;
+	}
+}
+
+static int CartRamOffset(const SCart *cart, uint16_t address)
+{
+	if (cart->mbc == MBC_2)
+		return address & 0x1FF;
+
+	int bank = cart->mbc == MBC_1 ? (cart->mode ? cart->rom_hi : 0) : cart->ram_bank;
+	return (int) ((bank * 0x2000 + (address - 0xA000)) % cart->ram_size);
+}
+
+static unsigned char CartRead(const SCart *cart, uint16_t address)
+{
+	if (!cart->rom)
+		return 0xFF;
+
+	// MBC1 in mode 1 puts the high bits on bank 0 too
+	if (address < 0x4000 && cart->mbc == MBC_1 && cart->mode)
+		return cart->rom[((cart->rom_hi << 5) * 0x4000 + address) % cart->rom_size];
+	if (address < 0x4000)
+		return cart->rom[address % cart->rom_size];
+
+	if (address < 0x8000)
+		return cart->rom[(CartRomBank(cart) * 0x4000 + (address - 0x4000)) % cart->rom_size];
+
+	if (address >= 0xA000 && address < 0xC000)
+	{
+		// RTC registers of MBC3 read as 0
+		if (!cart->ram_enabled || !cart->ram_size || (cart->mbc == MBC_3 && cart->ram_bank >= 0x08))
+			return cart->mbc == MBC_3 && cart->ram_enabled ? 0x00 : 0xFF;
+		unsigned char value = cart->ram[CartRamOffset(cart, address)];
+		return cart->mbc == MBC_2 ? (value | 0xF0) : value;
+	}
+
+	return 0xFF;
+}
+
+static void CartWrite(SCart *cart, uint16_t address, unsigned char value)
+{
+	if (!cart->rom)
+		return;
+
+	if (address >= 0xA000 && address < 0xC000)
+	{
+		if (!cart->ram_enabled || !cart->ram_size || (cart->mbc == MBC_3 && cart->ram_bank >= 0x08))
+			return;
+		int offset = CartRamOffset(cart, address);
+		cart->ram[offset] = cart->mbc == MBC_2 ? (value & 0x0F) : value;
+		if (cart->ram_fd >= 0 && pwrite(cart->ram_fd, cart->ram + offset, 1, offset) != 1)
+			perror("n64io-sim: writing the .sav");
+		return;
+	}
+
+	if (address >= 0x8000)
+		return;
+
+	switch (cart->mbc)
+	{
+		case MBC_1:
+			if (address < 0x2000)		cart->ram_enabled = (value & 0x0F) == 0x0A;
+			else if (address < 0x4000)	cart->rom_lo = value & 0x1F;
+			else if (address < 0x6000)	cart->rom_hi = value & 0x03;
+			else						cart->mode = value & 0x01;
+			break;
+		case MBC_2:
+			if (address >= 0x4000)
+				break;
+			if (address & 0x100)		cart->rom_lo = value & 0x0F;
+			else						cart->ram_enabled = (value & 0x0F) == 0x0A;
+			break;
+		case MBC_3:
+			if (address < 0x2000)		cart->ram_enabled = (value & 0x0F) == 0x0A;
+			else if (address < 0x4000)	cart->rom_lo = value & 0x7F;
+			else if (address < 0x6000)	cart->ram_bank = value;
+			break;
+		case MBC_5:
+			if (address < 0x2000)		cart->ram_enabled = (value & 0x0F) == 0x0A;
+			else if (address < 0x3000)	cart->rom_lo = value;
+			else if (address < 0x4000)	cart->rom_hi = value & 0x01;
+			else if (address < 0x6000)	cart->ram_bank = value & 0x0F;
+			break;
+	}
+}
+
+static unsigned char *SimLoad(const char *path, uint32_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return NULL;
+
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	unsigned char *data = length > 0 ? malloc(length) : NULL;
+	if (data && fread(data, 1, length, file) != (size_t) length)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+
+	*size = data ? (uint32_t) length : 0;
+	return data;
+}
+
+static int CartLoad(SCart *cart, const char *rom, const char *sav)
+{
+	memset(cart, 0, sizeof(SCart));
+	cart->ram_fd = -1;
+
+	cart->rom = SimLoad(rom, &cart->rom_size);
+	if (!cart->rom || cart->rom_size < 0x150)
+	{
+		fprintf(stderr, "n64io-sim: can't read Game Boy ROM %s\n", rom);
+		return 0;
+	}
+
+	cart->mbc = CartMbc(cart->rom[0x147]);
+	cart->ram_size = CartRamSize(cart, cart->rom[0x149]);
+	if (!cart->ram_size)
+		return 1;
+
+	cart->ram = calloc(1, cart->ram_size);
+	if (!sav)
+		return 1;
+
+	cart->ram_fd = open(sav, O_RDWR | O_CREAT, 0644);
+	if (cart->ram_fd < 0 || pread(cart->ram_fd, cart->ram, cart->ram_size, 0) < 0)
+	{
+		perror("n64io-sim: opening the .sav");
+		return 1;
+	}
+
+	// a new save starts out the size of the cartridge RAM
+	struct stat st;
+	if (fstat(cart->ram_fd, &st) == 0 && st.st_size < (off_t) cart->ram_size && ftruncate(cart->ram_fd, cart->ram_size) < 0)
+		perror("n64io-sim: sizing the .sav");
+	return 1;
+}
+
+/* Paks */
+
+static int SimPakRead(SSimController *c, uint16_t address, unsigned char *data)
+{
+	memset(data, 0, JOYBUS_PAK_BLOCK);
+
+	switch (c->pak)
+	{
+		case PAK_MEMPAK:
+			if (address < MEMPAK_SIZE)
+				memcpy(data, c->mempak + address, JOYBUS_PAK_BLOCK);
+			break;
+
+		case PAK_RUMBLE:
+			if (address >= 0x8000 && address < 0x9000 && c->rumble_enabled)
+				memset(data, 0x80, JOYBUS_PAK_BLOCK);
+			break;
+
+		case PAK_TPAK:
+			if (address >= 0x8000 && address < 0x9000)
+				memset(data, c->tpak_power ? 0x84 : 0x00, JOYBUS_PAK_BLOCK);
+			else if (address >= 0xA000 && address < 0xB000 && c->tpak_power)
+				memset(data, c->tpak_bank, JOYBUS_PAK_BLOCK);
+			else if (address >= 0xB000 && address < 0xC000 && c->tpak_power)
+			{
+				unsigned char status = c->tpak_access ? 0x89 : 0x80;
+				if (c->tpak_reset)
+					status |= 0x04;
+				if (!c->cart.rom)
+					status |= 0x48;
+				c->tpak_reset = 0;
+				memset(data, status, JOYBUS_PAK_BLOCK);
+			}
+			else if (address >= 0xC000 && c->tpak_power && c->tpak_access)
+			{
+				uint16_t gb = (uint16_t) (c->tpak_bank * 0x4000 + (address - 0xC000));
+				for (int i = 0; i < JOYBUS_PAK_BLOCK; i++)
+					data[i] = CartRead(&c->cart, (uint16_t) (gb + i));
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return c->pak != PAK_NONE;
+}
+
+static int SimPakWrite(SSimController *c, uint16_t address, const unsigned char *data)
+{
+	switch (c->pak)
+	{
+		case PAK_MEMPAK:
+			if (address >= MEMPAK_SIZE)
+				break;
+			memcpy(c->mempak + address, data, JOYBUS_PAK_BLOCK);
+			if (c->mempak_fd >= 0 && pwrite(c->mempak_fd, data, JOYBUS_PAK_BLOCK, address) != JOYBUS_PAK_BLOCK)
+				perror("n64io-sim: writing the .mpk");
+			break;
+
+		case PAK_RUMBLE:
+			if (address >= 0x8000 && address < 0x9000)
+				c->rumble_enabled = data[0] == 0x80;
+			else if (address >= 0xC000 && c->motor != (data[0] & 1))
+			{
+				c->motor = data[0] & 1;
+				if (l_Verbose)
+					fprintf(stderr, "motor %s\n", c->motor ? "on" : "off");
+			}
+			break;
+
+		case PAK_TPAK:
+			if (address >= 0x8000 && address < 0x9000)
+			{
+				if (data[0] == 0x84 && !c->tpak_power)
+					c->tpak_reset = 1;
+				if (data[0] == 0x84 || data[0] == 0xFE)
+					c->tpak_power = data[0] == 0x84;
+			}
+			else if (address >= 0xA000 && address < 0xB000 && c->tpak_power)
+				c->tpak_bank = data[0] & 0x03;
+			else if (address >= 0xB000 && address < 0xC000 && c->tpak_power)
+				c->tpak_access = data[0] & 0x01;
+			else if (address >= 0xC000 && c->tpak_power && c->tpak_access)
+			{
+				uint16_t gb = (uint16_t) (c->tpak_bank * 0x4000 + (address - 0xC000));
+				for (int i = 0; i < JOYBUS_PAK_BLOCK; i++)
+					CartWrite(&c->cart, (uint16_t) (gb + i), data[i]);
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return c->pak != PAK_NONE;
+}
+
+/* Answer one PIF channel block: tx bytes in, reply bytes out */
+static int SimCommand(SSimController *c, const unsigned char *tx, int tx_len, unsigned char *rx)
+{
+	if (tx_len < 1)
+		return 0;
+
+	switch (tx[0])
+	{
+		case JOYBUS_CMD_RESET:
+			c->motor = 0;
+			// fall through
+		case JOYBUS_CMD_INFO:
+			rx[0] = 0x05;
+			rx[1] = 0x00;
+			rx[2] = (c->pak != PAK_NONE ? JOYBUS_STATUS_PAK : JOYBUS_STATUS_PAK_REMOVED)
+				| (c->address_error ? JOYBUS_STATUS_ADDR_CRC : 0);
+			c->address_error = 0;
+			return 3;
+
+		case JOYBUS_CMD_STATE:
+			c->polls++;
+			memset(rx, 0, 4);
+			if (l_Animate)
+			{
+				// sweep the stick, press A every second half of the sweep
+				rx[0] = (c->polls & 0x80) ? 0x80 : 0x00;
+				rx[2] = (unsigned char) (signed char) ((int) (c->polls & 0x7F) - 64);
+			}
+			return 4;
+
+		case JOYBUS_CMD_PAK_READ:
+		case JOYBUS_CMD_PAK_WRITE:
+		{
+			if (tx_len < 3 || (tx[0] == JOYBUS_CMD_PAK_WRITE && tx_len < 3 + JOYBUS_PAK_BLOCK))
+				return 0;
+
+			uint16_t address = (uint16_t) (((tx[1] << 8) | tx[2]) & 0xFFE0);
+			if ((tx[2] & 0x1F) != JoybusAddressCrc(address))
+				c->address_error = 1;
+
+			// without a pak the controller answers with an inverted CRC
+			if (tx[0] == JOYBUS_CMD_PAK_READ)
+			{
+				int present = SimPakRead(c, address, rx);
+				rx[JOYBUS_PAK_BLOCK] = JoybusDataCrc(rx) ^ (present ? 0x00 : 0xFF);
+				return JOYBUS_PAK_BLOCK + 1;
+			}
+
+			int present = SimPakWrite(c, address, tx + 3);
+			rx[0] = JoybusDataCrc(tx + 3) ^ (present ? 0x00 : 0xFF);
+			return 1;
+		}
+
+		default:
+			return 0;
+	}
+}
+
+/* The wire */
+
+static unsigned char SimFrameCrc(const unsigned char *data, int len)
+{
+	unsigned char crc = 0;
+
+	for (int i = 0; i < len; i++)
+	{
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80) ? (unsigned char) ((crc << 1) ^ 0x07) : (unsigned char) (crc << 1);
+	}
+
+	return crc;
+}
+
+/* Hold the reply back like the adapter would, then send it */
+static void SimReply(const unsigned char *data, int len, int request_len)
+{
+	int64_t now = SimMicros();
+	int64_t due = (now > l_BusyUntil ? now : l_BusyUntil) + l_TransactionUs + (int64_t) l_ByteUs * (request_len + len);
+
+	if (l_UsbFrameUs > 0)
+		due = (due + l_UsbFrameUs - 1) / l_UsbFrameUs * l_UsbFrameUs;
+
+	SimSleepUntil(due);
+	l_BusyUntil = due;
+
+	while (len > 0)
+	{
+		ssize_t res = write(l_Master, data, len);
+		if (res < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return;
+		}
+		data += res;
+		len -= (int) res;
+	}
+}
+
+static void SimSendFrame(unsigned char seq, unsigned char channel, const unsigned char *payload, int len)
+{
+	unsigned char frame[FRAME_SIZE(FRAME_MAX)];
+
+	frame[0] = FRAME_SYNC;
+	frame[1] = seq;
+	frame[2] = channel;
+	frame[3] = (unsigned char) len;
+	memcpy(frame + FRAME_HEADER, payload, len);
+	frame[FRAME_HEADER + len] = SimFrameCrc(frame + 1, FRAME_HEADER - 1 + len);
+
+	SimReply(frame, FRAME_SIZE(len), 0);
+}
+
+static void SimHello(void)
+{
+	const unsigned char hello[3] = { 'N', 'F', SIM_VERSION };
+
+	l_Framed = 1;
+	SimSendFrame(0, 0, hello, sizeof(hello));
+	if (l_Verbose)
+		fprintf(stderr, "framed protocol\n");
+}
+
+/* Run a channel block for a controller, returns the reply length, -1 if
+   the reply is dropped */
+static int SimTransaction(int channel, const unsigned char *cmd, unsigned char *reply)
+{
+	const int tx_len = JOYBUS_TX_LEN(cmd);
+	const int rx_len = JOYBUS_RX_LEN(cmd);
+	unsigned char rx[64];
+
+	if (channel >= l_Count)
+		return 0;
+
+	int len = SimCommand(&l_Controllers[channel], cmd + 2, tx_len, rx);
+	if (len > rx_len)
+		len = rx_len;
+	memcpy(reply, rx, len);
+
+	l_Transactions++;
+	if (l_Verbose)
+		fprintf(stderr, "ch%d cmd %02x tx %d rx %d -> %d\n", channel, cmd[2], tx_len, rx_len, len);
+
+	// the write went through, only its reply is lost
+	if (cmd[2] == JOYBUS_CMD_PAK_WRITE && l_DropWrites && ++l_PakWrites % l_DropWrites == 0)
+	{
+		if (l_Verbose)
+			fprintf(stderr, "ch%d reply dropped\n", channel);
+		return -1;
+	}
+	return len;
+}
+
+/* Handle whatever complete messages are in buf, returns the bytes used */
+static int SimProcess(const unsigned char *buf, int len)
+{
+	int used = 0;
+
+	while (used < len)
+	{
+		const unsigned char *p = buf + used;
+		const int left = len - used;
+		unsigned char reply[64];
+
+		// the probe also works in framed mode, for a host that started over
+		if (!l_LegacyOnly && left >= (int) sizeof(l_Probe) && memcmp(p, l_Probe, sizeof(l_Probe)) == 0)
+		{
+			used += sizeof(l_Probe);
+			SimHello();
+			continue;
+		}
+
+		if (!l_Framed)
+		{
+			if (left < 2 || left < 2 + JOYBUS_TX_LEN(p))
+				break;
+			// a probe that isn't a prefix of a longer message yet
+			if (!l_LegacyOnly && left < (int) sizeof(l_Probe) && memcmp(p, l_Probe, left) == 0)
+				break;
+
+			int n = SimTransaction(0, p, reply);
+			used += 2 + JOYBUS_TX_LEN(p);
+			if (n > 0)
+				SimReply(reply, n, 2 + JOYBUS_TX_LEN(p));
+			continue;
+		}
+
+		if (p[0] != FRAME_SYNC)
+		{
+			used++;
+			l_Resyncs++;
+			continue;
+		}
+		if (left < FRAME_HEADER)
+			break;
+
+		const int payload = p[3];
+		if (payload > FRAME_MAX || payload < 2)
+		{
+			used++;
+			l_Resyncs++;
+			continue;
+		}
+		if (left < FRAME_SIZE(payload))
+			break;
+		if (p[FRAME_HEADER + payload] != SimFrameCrc(p + 1, FRAME_HEADER - 1 + payload))
+		{
+			used++;
+			l_Resyncs++;
+			continue;
+		}
+
+		int n = SimTransaction(p[2], p + FRAME_HEADER, reply);
+		used += FRAME_SIZE(payload);
+		l_BusyUntil += (int64_t) l_ByteUs * FRAME_SIZE(payload);
+		if (n >= 0)
+			SimSendFrame(p[1], p[2], reply, n);
+	}
+
+	return used;
+}
+
+/* Make a new pty and point the link at it */
+static int SimPlug(void)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+	{
+		perror("n64io-sim: posix_openpt");
+		return -1;
+	}
+
+	const char *name = ptsname(master);
+
+	// raw bytes from the start, in case the host doesn't set up the line
+	int slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave >= 0)
+	{
+		struct termios config;
+		if (tcgetattr(slave, &config) == 0)
+		{
+			cfmakeraw(&config);
+			tcsetattr(slave, TCSANOW, &config);
+		}
+		close(slave);
+	}
+
+	if (l_Link)
+	{
+		struct stat st;
+		// only ever replace a link of our own, never a real file
+		if (lstat(l_Link, &st) == 0 && S_ISLNK(st.st_mode))
+			unlink(l_Link);
+		if (symlink(name, l_Link) < 0)
+		{
+			perror("n64io-sim: symlink");
+			close(master);
+			return -1;
+		}
+	}
+
+	fprintf(stderr, "n64io-sim: %s%s%s\n", name, l_Link ? " as " : "", l_Link ? l_Link : "");
+	return master;
+}
+
+static void SimUnplug(void)
+{
+	if (l_Master >= 0)
+		close(l_Master);
+	l_Master = -1;
+	if (l_Link)
+		unlink(l_Link);
+}
+
+static void SimSignal(int sig)
+{
+	if (sig == SIGUSR1)
+		l_Replug = 1;
+	else
+		l_Running = 0;
+}
+
+static int SimPak(SSimController *c, const char *spec)
+{
+	c->mempak_fd = -1;
+	c->cart.ram_fd = -1;
+
+	if (strcmp(spec, "none") == 0)
+		c->pak = PAK_NONE;
+	else if (strcmp(spec, "rumble") == 0)
+		c->pak = PAK_RUMBLE;
+	else if (strncmp(spec, "mpk:", 4) == 0)
+	{
+		c->pak = PAK_MEMPAK;
+		c->mempak_fd = open(spec + 4, O_RDWR | O_CREAT, 0644);
+		if (c->mempak_fd < 0 || pread(c->mempak_fd, c->mempak, MEMPAK_SIZE, 0) < 0)
+		{
+			perror("n64io-sim: opening the .mpk");
+			return 0;
+		}
+	}
+	else if (strncmp(spec, "tpak:", 5) == 0)
+	{
+		char rom[1024];
+		snprintf(rom, sizeof(rom), "%s", spec + 5);
+		char *sav = strchr(rom, ':');
+		if (sav)
+			*sav++ = 0;
+		c->pak = PAK_TPAK;
+		return CartLoad(&c->cart, rom, sav);
+	}
+	else
+	{
+		fprintf(stderr, "n64io-sim: unknown pak %s\n", spec);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void SimUsage(void)
+{
+	fprintf(stderr,
+		"usage: n64io-sim [options]\n"
+		"  -l PATH   make PATH a link to the pty (e.g. /dev/ttyACM99), removed on exit\n"
+		"  -n COUNT  controllers on the adapter, 1-4, one per framed channel (default 1)\n"
+		"  -p PAK    pak of the next controller: none, rumble, mpk:FILE.mpk, tpak:ROM.gb[:SAVE.sav]\n"
+		"  -B US     latency per byte on the wire in microseconds (87 is about 115200 baud)\n"
+		"  -T US     latency per transaction (firmware and controller)\n"
+		"  -U US     deliver replies on USB frame boundaries (1000 for full speed)\n"
+		"  -L        legacy firmware, don't answer the framed protocol probe\n"
+		"  -D N      carry out every Nth pak write but drop its reply\n"
+		"  -a        sweep the analog stick so state polls change\n"
+		"  -v        log every transaction\n"
+		"SIGUSR1 unplugs the adapter and plugs it back in on a new pty.\n");
+}
+
+int main(int argc, char **argv)
+{
+	int paks = 0;
+	int opt;
+
+	for (int i = 0; i < SIM_CONTROLLERS; i++)
+	{
+		l_Controllers[i].mempak_fd = -1;
+		l_Controllers[i].cart.ram_fd = -1;
+	}
+
+	while ((opt = getopt(argc, argv, "l:n:p:B:T:U:D:Lavh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l': l_Link = optarg; break;
+			case 'n': l_Count = atoi(optarg); break;
+			case 'p':
+				if (paks == SIM_CONTROLLERS || !SimPak(&l_Controllers[paks++], optarg))
+					return 1;
+				break;
+			case 'B': l_ByteUs = atoi(optarg); break;
+			case 'T': l_TransactionUs = atoi(optarg); break;
+			case 'U': l_UsbFrameUs = atoi(optarg); break;
+			case 'D': l_DropWrites = atoi(optarg); break;
+			case 'L': l_LegacyOnly = 1; break;
+			case 'a': l_Animate = 1; break;
+			case 'v': l_Verbose = 1; break;
+			default: SimUsage(); return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (l_Count < paks)
+		l_Count = paks;
+	if (l_Count < 1 || l_Count > SIM_CONTROLLERS)
+	{
+		SimUsage();
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SimSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	l_Master = SimPlug();
+	if (l_Master < 0)
+		return 1;
+
+	unsigned char buf[4096];
+	int len = 0;
+	int open = 0;
+
+	while (l_Running)
+	{
+		if (l_Replug)
+		{
+			l_Replug = 0;
+			SimUnplug();
+			fprintf(stderr, "n64io-sim: unplugged\n");
+			usleep(500000);
+			if ((l_Master = SimPlug()) < 0)
+				break;
+			len = 0;
+			l_Framed = 0;
+			open = 0;
+		}
+
+		struct pollfd pfd = { l_Master, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		// nobody has the port open: an Arduino resets when it is opened again
+		if (!(pfd.revents & POLLIN))
+		{
+			if (open && l_Verbose)
+				fprintf(stderr, "port closed\n");
+			open = 0;
+			len = 0;
+			l_Framed = 0;
+			usleep(10000);
+			continue;
+		}
+
+		ssize_t res = read(l_Master, buf + len, sizeof(buf) - len);
+		if (res <= 0)
+		{
+			usleep(10000);
+			continue;
+		}
+		open = 1;
+		len += (int) res;
+
+		int used = SimProcess(buf, len);
+		memmove(buf, buf + used, len - used);
+		len -= used;
+
+		// garbage that never completes a message
+		if (len == (int) sizeof(buf))
+			len = 0;
+	}
+
+	SimUnplug();
+	fprintf(stderr, "n64io-sim: %lld transactions, %lld bytes skipped\n", (long long) l_Transactions, (long long) l_Resyncs);
+	return 0;
+}